@@ -0,0 +1,197 @@
+#ifndef __ESLAM_CHECKPOINT_HPP__
+#define __ESLAM_CHECKPOINT_HPP__
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+#include <envire/maps/MLSGrid.hpp>
+
+#include "PoseParticle.hpp"
+
+namespace eslam
+{
+
+/**
+ * Helpers for the binary checkpoint format of the filter. Values are stored
+ * in their native representation, so checkpoints can only be read on the
+ * same architecture they were written on.
+ */
+namespace checkpoint
+{
+
+static const char MAGIC[] = "ESLAMCHK";
+static const boost::uint32_t VERSION = 1;
+
+template <class T>
+void write( std::ostream& os, const T& value )
+{
+    os.write( reinterpret_cast<const char*>( &value ), sizeof( T ) );
+}
+
+template <class T>
+void read( std::istream& is, T& value )
+{
+    is.read( reinterpret_cast<char*>( &value ), sizeof( T ) );
+    if( !is )
+	throw std::runtime_error( "the checkpoint is truncated." );
+}
+
+/** write a vector of plain data, prefixed by its size */
+template <class T>
+void writeVector( std::ostream& os, const std::vector<T>& values )
+{
+    write( os, static_cast<boost::uint64_t>( values.size() ) );
+    if( !values.empty() )
+	os.write( reinterpret_cast<const char*>( &values[0] ), values.size() * sizeof( T ) );
+}
+
+template <class T>
+void readVector( std::istream& is, std::vector<T>& values )
+{
+    boost::uint64_t size;
+    read( is, size );
+    values.resize( size );
+    if( size )
+    {
+	is.read( reinterpret_cast<char*>( &values[0] ), size * sizeof( T ) );
+	if( !is )
+	    throw std::runtime_error( "the checkpoint is truncated." );
+    }
+}
+
+inline void writeString( std::ostream& os, const std::string& value )
+{
+    writeVector( os, std::vector<char>( value.begin(), value.end() ) );
+}
+
+inline void readString( std::istream& is, std::string& value )
+{
+    std::vector<char> data;
+    readVector( is, data );
+    value.assign( data.begin(), data.end() );
+}
+
+inline void writeHeader( std::ostream& os )
+{
+    os.write( MAGIC, sizeof( MAGIC ) - 1 );
+    write( os, VERSION );
+}
+
+inline void readHeader( std::istream& is )
+{
+    char magic[sizeof( MAGIC ) - 1];
+    is.read( magic, sizeof( magic ) );
+    boost::uint32_t version = 0;
+    if( is )
+	read( is, version );
+    if( !is || memcmp( magic, MAGIC, sizeof( magic ) ) != 0 )
+	throw std::runtime_error( "the file is not a filter checkpoint." );
+    if( version != VERSION )
+	throw std::runtime_error( "the checkpoint version is not supported." );
+}
+
+/** write the pose and weight of a particle. The debug data is skipped. */
+inline void writeParticle( std::ostream& os, const PoseParticle& p )
+{
+    write( os, p.position );
+    write( os, p.orientation );
+    write( os, p.zPos );
+    write( os, p.zSigma );
+    write( os, p.mprob );
+    write( os, p.floating );
+    write( os, p.meas_pos );
+    write( os, p.meas_theta );
+    write( os, p.weight );
+}
+
+inline void readParticle( std::istream& is, PoseParticle& p )
+{
+    read( is, p.position );
+    read( is, p.orientation );
+    read( is, p.zPos );
+    read( is, p.zSigma );
+    read( is, p.mprob );
+    read( is, p.floating );
+    read( is, p.meas_pos );
+    read( is, p.meas_theta );
+    read( is, p.weight );
+}
+
+/** write the geometry and the patches of a grid */
+inline void writeGrid( std::ostream& os, envire::MLSGrid& grid )
+{
+    write( os, static_cast<boost::uint64_t>( grid.getWidth() ) );
+    write( os, static_cast<boost::uint64_t>( grid.getHeight() ) );
+    write( os, grid.getScaleX() );
+    write( os, grid.getScaleY() );
+    write( os, grid.getOffsetX() );
+    write( os, grid.getOffsetY() );
+
+    boost::uint64_t count = 0;
+    for( size_t m = 0; m < grid.getWidth(); m++ )
+	for( size_t n = 0; n < grid.getHeight(); n++ )
+	    for( envire::MLSGrid::iterator it = grid.beginCell( m, n ); it != grid.endCell(); it++ )
+		count++;
+    write( os, count );
+
+    for( size_t m = 0; m < grid.getWidth(); m++ )
+    {
+	for( size_t n = 0; n < grid.getHeight(); n++ )
+	{
+	    for( envire::MLSGrid::iterator it = grid.beginCell( m, n ); it != grid.endCell(); it++ )
+	    {
+		write( os, static_cast<boost::uint32_t>( m ) );
+		write( os, static_cast<boost::uint32_t>( n ) );
+		write( os, *it );
+	    }
+	}
+    }
+}
+
+/** create a grid from the data written by writeGrid */
+inline envire::MLSGrid* readGrid( std::istream& is )
+{
+    boost::uint64_t width, height;
+    double scaleX, scaleY, offsetX, offsetY;
+    read( is, width );
+    read( is, height );
+    read( is, scaleX );
+    read( is, scaleY );
+    read( is, offsetX );
+    read( is, offsetY );
+
+    envire::MLSGrid *grid = new envire::MLSGrid( width, height, scaleX, scaleY, offsetX, offsetY );
+
+    try
+    {
+	boost::uint64_t count;
+	read( is, count );
+	for( boost::uint64_t i = 0; i < count; i++ )
+	{
+	    boost::uint32_t m, n;
+	    envire::MLSGrid::SurfacePatch patch;
+	    read( is, m );
+	    read( is, n );
+	    read( is, patch );
+	    if( m >= width || n >= height )
+		throw std::runtime_error( "the checkpoint contains an invalid grid cell." );
+	    grid->insertTail( m, n, patch );
+	}
+    }
+    catch( ... )
+    {
+	delete grid;
+	throw;
+    }
+
+    return grid;
+}
+
+}
+}
+
+#endif
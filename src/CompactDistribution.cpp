@@ -0,0 +1,281 @@
+#include "CompactDistribution.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace eslam;
+
+namespace
+{
+/** number of quantized values per particle: x, y, z, heading, weight and
+ * the floating flag */
+const size_t FIELDS = 6;
+/** weights are stored relative to the uniform weight with this resolution */
+const double WEIGHT_SCALE = 1024.0;
+
+void writeVarint( std::vector<boost::uint8_t>& data, boost::uint64_t value )
+{
+    while( value >= 0x80 )
+    {
+	data.push_back( static_cast<boost::uint8_t>( value | 0x80 ) );
+	value >>= 7;
+    }
+    data.push_back( static_cast<boost::uint8_t>( value ) );
+}
+
+boost::uint64_t readVarint( const std::vector<boost::uint8_t>& data, size_t& pos )
+{
+    boost::uint64_t value = 0;
+    for( int shift = 0; shift < 64; shift += 7 )
+    {
+	if( pos >= data.size() )
+	    throw std::runtime_error( "compact distribution data is truncated." );
+	const boost::uint8_t b = data[pos++];
+	value |= static_cast<boost::uint64_t>( b & 0x7f ) << shift;
+	if( !(b & 0x80) )
+	    return value;
+    }
+    throw std::runtime_error( "invalid compact distribution data." );
+}
+
+/** signed values are stored in zigzag encoding, so small negative values
+ * are short as well */
+void writeSigned( std::vector<boost::uint8_t>& data, boost::int64_t value )
+{
+    writeVarint( data, (static_cast<boost::uint64_t>( value ) << 1) ^ static_cast<boost::uint64_t>( value >> 63 ) );
+}
+
+boost::int64_t readSigned( const std::vector<boost::uint8_t>& data, size_t& pos )
+{
+    const boost::uint64_t v = readVarint( data, pos );
+    return static_cast<boost::int64_t>( v >> 1 ) ^ -static_cast<boost::int64_t>( v & 1 );
+}
+
+boost::int64_t headingSteps( double resolution )
+{
+    return std::max<boost::int64_t>( 1, static_cast<boost::int64_t>( floor( 2.0 * M_PI / resolution + 0.5 ) ) );
+}
+
+/** difference of two quantized headings, wrapped to the shorter side */
+boost::int64_t headingDiff( boost::int64_t a, boost::int64_t b, boost::int64_t steps )
+{
+    boost::int64_t d = (a - b) % steps;
+    if( d < 0 )
+	d += steps;
+    if( d > steps / 2 )
+	d -= steps;
+    return d;
+}
+
+void quantize( const PoseParticle& p, size_t count, const CompactPoseDistribution& c, boost::int64_t steps, boost::int64_t* q )
+{
+    q[0] = static_cast<boost::int64_t>( floor( p.position.x() / c.positionResolution + 0.5 ) );
+    q[1] = static_cast<boost::int64_t>( floor( p.position.y() / c.positionResolution + 0.5 ) );
+    q[2] = static_cast<boost::int64_t>( floor( p.zPos / c.positionResolution + 0.5 ) );
+    q[3] = static_cast<boost::int64_t>( floor( p.orientation / c.headingResolution + 0.5 ) ) % steps;
+    if( q[3] < 0 )
+	q[3] += steps;
+    q[4] = static_cast<boost::int64_t>( floor( p.weight * count * WEIGHT_SCALE + 0.5 ) );
+    q[5] = p.floating ? 1 : 0;
+}
+
+void dequantize( const boost::int64_t* q, size_t count, const CompactPoseDistribution& c, PoseParticle& p )
+{
+    double heading = q[3] * c.headingResolution;
+    if( heading > M_PI )
+	heading -= 2.0 * M_PI;
+    p = PoseParticle( 
+	    base::Vector2d( q[0] * c.positionResolution, q[1] * c.positionResolution ),
+	    heading, q[2] * c.positionResolution, 0, q[5] != 0 );
+    p.weight = count > 0 ? q[4] / (count * WEIGHT_SCALE) : 0.0;
+}
+
+struct WeightGreater
+{
+    const std::vector<PoseParticle>& particles;
+    WeightGreater( const std::vector<PoseParticle>& particles ) : particles( particles ) {}
+    bool operator()( size_t a, size_t b ) const
+    {
+	return particles[a].weight > particles[b].weight;
+    }
+};
+}
+
+PoseDistributionEncoder::PoseDistributionEncoder( const CompactDistributionConfig& config )
+    : config( config ), sequence( 0 ), count( 0 ), sinceKeyframe( 0 )
+{
+    if( config.positionResolution <= 0 || config.headingResolution <= 0 )
+	throw std::runtime_error( "the resolution of the compact distribution needs to be positive." );
+}
+
+void PoseDistributionEncoder::reset()
+{
+    count = 0;
+    sinceKeyframe = 0;
+    last.clear();
+}
+
+void PoseDistributionEncoder::encode( const PoseDistribution& dist, CompactPoseDistribution& result )
+{
+    result.time = dist.time;
+    result.orientation = dist.orientation;
+    result.particleCount = dist.particles.size();
+    result.sequence = ++sequence;
+    result.positionResolution = config.positionResolution;
+    result.headingResolution = config.headingResolution;
+    result.delta = false;
+    result.data.clear();
+
+    result.gmm.resize( dist.gmm.params.size() );
+    for( size_t i = 0; i < result.gmm.size(); i++ )
+    {
+	const PoseDistribution::GMM::Parameter &p( dist.gmm.params[i] );
+	CompactGaussian &g( result.gmm[i] );
+	g.weight = p.weight;
+	g.mean[0] = p.dist.mean.x();
+	g.mean[1] = p.dist.mean.y();
+	g.cov[0] = p.dist.cov(0,0);
+	g.cov[1] = p.dist.cov(0,1);
+	g.cov[2] = p.dist.cov(1,1);
+    }
+
+    // subsample the distributions which contain particles
+    const bool withParticles =
+	config.mode != CompactPoseDistribution::GMM_ONLY
+	&& config.particlePeriod > 0
+	&& count % config.particlePeriod == 0;
+    count++;
+
+    if( !withParticles )
+    {
+	result.mode = CompactPoseDistribution::GMM_ONLY;
+	return;
+    }
+    result.mode = config.mode;
+
+    const std::vector<PoseParticle> &particles( dist.particles );
+    const boost::int64_t steps = headingSteps( result.headingResolution );
+    boost::int64_t q[FIELDS];
+
+    if( config.mode == CompactPoseDistribution::TOP_K )
+    {
+	std::vector<size_t> idx( particles.size() );
+	for( size_t i = 0; i < idx.size(); i++ )
+	    idx[i] = i;
+	const size_t k = std::min( config.topK, idx.size() );
+	std::partial_sort( idx.begin(), idx.begin() + k, idx.end(), WeightGreater( particles ) );
+	// keep the order of the filter
+	std::sort( idx.begin(), idx.begin() + k );
+
+	writeVarint( result.data, k );
+	for( size_t i = 0; i < k; i++ )
+	{
+	    quantize( particles[idx[i]], particles.size(), result, steps, q );
+	    for( size_t f = 0; f < FIELDS; f++ )
+		writeSigned( result.data, q[f] );
+	}
+	return;
+    }
+
+    // ALL_PARTICLES
+    const bool delta =
+	config.keyframePeriod > 0
+	&& sinceKeyframe < config.keyframePeriod
+	&& last.size() == particles.size() * FIELDS;
+    result.delta = delta;
+    sinceKeyframe = delta ? sinceKeyframe + 1 : 1;
+
+    last.resize( particles.size() * FIELDS );
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	quantize( particles[i], particles.size(), result, steps, q );
+	boost::int64_t *l = &last[i * FIELDS];
+	for( size_t f = 0; f < FIELDS; f++ )
+	{
+	    if( !delta )
+		writeSigned( result.data, q[f] );
+	    else if( f == 3 )
+		writeSigned( result.data, headingDiff( q[f], l[f], steps ) );
+	    else
+		writeSigned( result.data, q[f] - l[f] );
+	    l[f] = q[f];
+	}
+    }
+}
+
+PoseDistributionDecoder::PoseDistributionDecoder()
+    : valid( false ), sequence( 0 )
+{
+}
+
+bool PoseDistributionDecoder::decode( const CompactPoseDistribution& compact, PoseDistribution& dist )
+{
+    // a missing sample breaks the chain of delta encoded particles
+    if( compact.sequence != sequence + 1 )
+	valid = false;
+    sequence = compact.sequence;
+
+    dist.time = compact.time;
+    dist.orientation = compact.orientation;
+
+    dist.gmm.params.resize( compact.gmm.size() );
+    for( size_t i = 0; i < compact.gmm.size(); i++ )
+    {
+	const CompactGaussian &g( compact.gmm[i] );
+	PoseDistribution::GMM::Parameter &p( dist.gmm.params[i] );
+	p.weight = g.weight;
+	p.dist.mean = base::Vector2d( g.mean[0], g.mean[1] );
+	p.dist.cov << g.cov[0], g.cov[1], g.cov[1], g.cov[2];
+    }
+
+    if( compact.mode == CompactPoseDistribution::GMM_ONLY )
+	return true;
+
+    const boost::int64_t steps = headingSteps( compact.headingResolution );
+    boost::int64_t q[FIELDS];
+    size_t pos = 0;
+
+    if( compact.mode == CompactPoseDistribution::TOP_K )
+    {
+	const size_t k = readVarint( compact.data, pos );
+	dist.particles.resize( k );
+	for( size_t i = 0; i < k; i++ )
+	{
+	    for( size_t f = 0; f < FIELDS; f++ )
+		q[f] = readSigned( compact.data, pos );
+	    PoseParticle p;
+	    dequantize( q, compact.particleCount, compact, p );
+	    dist.particles[i] = p;
+	}
+	return true;
+    }
+
+    if( compact.delta && (!valid || last.size() != compact.particleCount * FIELDS) )
+    {
+	valid = false;
+	return false;
+    }
+
+    last.resize( compact.particleCount * FIELDS );
+    dist.particles.resize( compact.particleCount );
+    for( size_t i = 0; i < compact.particleCount; i++ )
+    {
+	boost::int64_t *l = &last[i * FIELDS];
+	for( size_t f = 0; f < FIELDS; f++ )
+	{
+	    const boost::int64_t v = readSigned( compact.data, pos );
+	    if( !compact.delta )
+		l[f] = v;
+	    else if( f == 3 )
+		l[f] = ((l[f] + v) % steps + steps) % steps;
+	    else
+		l[f] += v;
+	}
+	PoseParticle p;
+	dequantize( l, compact.particleCount, compact, p );
+	dist.particles[i] = p;
+    }
+    valid = true;
+    return true;
+}
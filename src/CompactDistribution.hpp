@@ -0,0 +1,144 @@
+#ifndef __ESLAM_COMPACTDISTRIBUTION_HPP__
+#define __ESLAM_COMPACTDISTRIBUTION_HPP__
+
+#include "PoseParticle.hpp"
+
+#include <boost/cstdint.hpp>
+#include <vector>
+
+namespace eslam
+{
+
+/** summary of a single component of the gaussian mixture model */
+struct CompactGaussian
+{
+    float weight;
+    float mean[2];
+    /** xx, xy and yy element of the covariance */
+    float cov[3];
+};
+
+/**
+ * Compact representation of a PoseDistribution for logging and
+ * visualization. The particles are quantized and stored in a variable length
+ * encoding, optionally as the difference to the previous distribution.
+ * Debug data and the body contact state are not included.
+ */
+struct CompactPoseDistribution
+{
+    enum Mode
+    {
+	/** all particles */
+	ALL_PARTICLES = 0,
+	/** only the particles with the highest weights */
+	TOP_K = 1,
+	/** only the gaussian mixture model */
+	GMM_ONLY = 2
+    };
+
+    CompactPoseDistribution()
+	: mode( GMM_ONLY ), delta( false ), particleCount( 0 ), sequence( 0 ) {}
+
+    base::Time time;
+    base::Quaterniond orientation;
+
+    boost::uint8_t mode;
+    /** if true, the particles are encoded as difference to the particles of
+     * the previous distribution with the same mode */
+    bool delta;
+    /** total number of particles in the filter */
+    boost::uint32_t particleCount;
+    /** incremented with each encoded distribution, so a decoder can detect
+     * missing samples */
+    boost::uint32_t sequence;
+
+    /** quantization steps */
+    float positionResolution;
+    float headingResolution;
+
+    std::vector<CompactGaussian> gmm;
+    /** encoded particles */
+    std::vector<boost::uint8_t> data;
+};
+
+struct CompactDistributionConfig
+{
+    CompactDistributionConfig() :
+	mode( CompactPoseDistribution::ALL_PARTICLES ),
+	topK( 50 ),
+	particlePeriod( 1 ),
+	keyframePeriod( 20 ),
+	positionResolution( 0.005 ),
+	headingResolution( 0.001 )
+    {}
+
+    /** representation of the particles */
+    CompactPoseDistribution::Mode mode;
+    /** number of particles for the TOP_K mode */
+    size_t topK;
+    /** only every nth distribution contains particles, the others only the
+     * gaussian mixture model. 0 never includes particles. This corresponds
+     * to Configuration::logParticlePeriod. */
+    unsigned int particlePeriod;
+    /** every nth distribution with particles is encoded without delta. 0 to
+     * disable the delta encoding. */
+    unsigned int keyframePeriod;
+    /** quantization step of the position and height in m */
+    double positionResolution;
+    /** quantization step of the heading in rad */
+    double headingResolution;
+};
+
+/**
+ * Creates CompactPoseDistribution samples. Each consumer of the distribution
+ * should use its own encoder, with the configuration suited for it. The
+ * delta encoding is only used for the ALL_PARTICLES mode, since the particle
+ * indices are stable there between resampling steps.
+ */
+class PoseDistributionEncoder
+{
+public:
+    explicit PoseDistributionEncoder( const CompactDistributionConfig& config = CompactDistributionConfig() );
+
+    void encode( const PoseDistribution& dist, CompactPoseDistribution& result );
+
+    /** start again with a keyframe */
+    void reset();
+
+private:
+    CompactDistributionConfig config;
+    boost::uint32_t sequence;
+    size_t count;
+    size_t sinceKeyframe;
+    /** quantized values of the last particles, used for the delta encoding */
+    std::vector<boost::int64_t> last;
+};
+
+/**
+ * Restores a PoseDistribution from the samples of a single
+ * PoseDistributionEncoder, which need to be decoded in order.
+ */
+class PoseDistributionDecoder
+{
+public:
+    PoseDistributionDecoder();
+
+    /**
+     * decode the given sample. The particles of dist are only updated if the
+     * sample contains particles.
+     *
+     * @result false if the sample is delta encoded and the previous sample is
+     *         missing. The particles can be decoded again after the next
+     *         keyframe.
+     */
+    bool decode( const CompactPoseDistribution& compact, PoseDistribution& dist );
+
+private:
+    bool valid;
+    boost::uint32_t sequence;
+    std::vector<boost::int64_t> last;
+};
+
+}
+
+#endif
@@ -2,6 +2,8 @@
 #define __ESLAM_CONFIGURATION_HPP__
 
 #include <cmath>
+#include <limits>
+#include <string>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 #include <base/Eigen.hpp>
@@ -22,7 +24,7 @@ struct UpdateThreshold
 
     bool test( const Eigen::Affine3d& pdelta )
     {
-	return test( Eigen::AngleAxisd( pdelta.linear() ).angle(), pdelta.translation().norm() );
+	return test( pdelta.translation().norm(), Eigen::AngleAxisd( pdelta.linear() ).angle() );
     }
 
     double distance;
@@ -37,7 +39,10 @@ struct SurfaceHashConfig
 	percentage( 0.05 ),
 	avgFactor( 0.1 ),
 	slopeBins( 20 ),
-	angularSteps( 16 )
+	angularSteps( 16 ),
+	pyramidLevels( 1 ),
+	adaptiveBins( false ),
+	maxBucketSize( 0 )
     {}
 
     bool useHash;
@@ -46,6 +51,50 @@ struct SurfaceHashConfig
     double avgFactor; // weight factor to average particle for newly spawned
     size_t slopeBins; // number of hash bins for slope 
     size_t angularSteps; // circle divisions for hashing
+    size_t pyramidLevels; // number of index levels, each halving the slope bins of the next finer level
+    bool adaptiveBins; // use the slope distribution of the map for the bin boundaries
+    size_t maxBucketSize; // lookups stop descending the index once a bucket has at most this many candidates
+};
+
+struct UpdateSchedulerConfig
+{
+    UpdateSchedulerConfig() :
+	useScheduler( false ),
+	maxThreshold( 0.5, 30*M_PI/180.0 ),
+	spreadThreshold( 0.1 ),
+	angularSpreadThreshold( 5*M_PI/180.0 ),
+	effectiveThreshold( 0.5 ),
+	gainThreshold( 0.01 ),
+	cpuBudget( 0.0 )
+    {}
+
+    /** if set to true, measurement updates are scheduled by the
+     * UpdateScheduler. Otherwise every input which passes the
+     * measurementThreshold is used. */
+    bool useScheduler;
+    /** a measurement update is always done after this distance/rotation,
+     * even if the filter is converged or out of budget. The
+     * measurementThreshold is the minimum distance/rotation between updates. */
+    UpdateThreshold maxThreshold;
+    /** positional spread of the particles in m above which the filter is
+     * considered ambiguous */
+    double spreadThreshold;
+    /** spread of the particle headings in rad above which the filter is
+     * considered ambiguous */
+    double angularSpreadThreshold;
+    /** the filter is considered ambiguous if the effective number of
+     * particles is below this fraction of the particle count */
+    double effectiveThreshold;
+    /** the filter is considered ambiguous if the last update changed the
+     * particle weights by more than this information gain in nats */
+    double gainThreshold;
+    /** fraction of the time, given by the timestamps of the contact states,
+     * that may be spent on measurement updates which are not required by
+     * the maxThreshold. A value of 0 disables the budget. Using the budget
+     * makes the updates depend on the processing time, so replays are no
+     * longer reproducible.
+     */
+    double cpuBudget;
 };
 
 struct ContactModelConfiguration
@@ -105,9 +154,35 @@ struct Configuration
 	gridGapSize( 1.5 ),
 	gridUseNegativeInformation( false ),
 	maxSensorRange( 3.0 ),
+	maxSensorOffset( std::numeric_limits<double>::infinity() ),
+	voxelSize( 0.0 ),
+	depthPyramidLevels( 4 ),
 	useVisualUpdate( false ),
+	useFusedProjection( true ),
+	useSpatialOrder( true ),
+	useLikelihoodCache( false ),
+	likelihoodCacheResolution( 0.01 ),
+	likelihoodCacheAngularResolution( 0.01 ),
+	useClusterEvaluation( false ),
+	clusterResolution( 0.5 ),
+	clusterAngularResolution( 0.35 ),
+	clusterThreshold( 0.1 ),
+	deadlinePriorityFraction( 0.1 ),
+	deadlineWeightFactor( 0.9 ),
+	islandCount( 1 ),
+	islandMigrationPeriod( 10 ),
+	islandMigrationCount( 2 ),
+	useNumaPlacement( false ),
+	numaNodeCount( 0 ),
 	logDebug( false ),
-	logParticlePeriod( 100 )
+	logParticlePeriod( 100 ),
+	asyncMapping( false ),
+	mappingQueueSize( 4 ),
+	mappingBatchSize( 10 ),
+	pagingRadius( 0.0 ),
+	pagingBudget( 0 ),
+	memoryBudget( 0 ),
+	memoryCheckPeriod( 10 )
     {};
 
     /** seed for all random processes in the filter */
@@ -165,6 +240,9 @@ struct Configuration
      * minimum distance/rotation after which a new measurement is considered.
      */
     UpdateThreshold measurementThreshold;
+    /** adaptive scheduling of the measurement updates based on the state
+     * of the filter */
+    UpdateSchedulerConfig updateScheduler;
     /** minimum distance/rotation after which a new mapping input is considered.
      */
     UpdateThreshold mappingThreshold;
@@ -194,9 +272,99 @@ struct Configuration
     /** maximum range value for camera sensor data
      */
     double maxSensorRange;
+    /** maximum distance of a mapping sensor from the body frame in m. 
+     * Together with maxSensorRange this defines the region of the grid
+     * that sensor data is projected into, which is never larger than
+     * gridSize. The updates with sensor data throw if the sensor is further
+     * away from the body. The default is no limit.
+     */
+    double maxSensorOffset;
+    /** size of the voxels in m, which are used to downsample point clouds
+     * before they are projected into the grid. A value of 0 will use the
+     * gridResolution.
+     */
+    double voxelSize;
+    /** number of levels of the depth pyramid, which is used to sample
+     * distance images at about one point per grid cell. Level n combines
+     * 2^n x 2^n pixels. A value of 0 will project every pixel.
+     */
+    int depthPyramidLevels;
     /** flag if visual update method should be used.
      */
     bool useVisualUpdate;
+    /** if set to true, sensor data is projected directly into the scan grid
+     * instead of using the envire processing chain. The envire chain is
+     * still used for distance images with texture information, and for
+     * laser scans if gridUseNegativeInformation is set.
+     */
+    bool useFusedProjection;
+    /** if set to true, the particles are evaluated and mapped in the order
+     * of a space filling curve over their position, so that particles
+     * which are processed one after the other access nearby grid cells.
+     */
+    bool useSpatialOrder;
+    /** if set to true and all particles use the shared map, the evaluation
+     * of the contact model is reused for particles whose poses fall into
+     * the same bin. The bins have a size of likelihoodCacheResolution in m
+     * for the position, height and height sigma, and of
+     * likelihoodCacheAngularResolution in rad for the heading. The contact
+     * points of particles in the same bin differ by at most resolution + r
+     * * angularResolution horizontally, where r is the distance of the
+     * contact point from the body origin, and by resolution vertically.
+     */
+    bool useLikelihoodCache;
+    double likelihoodCacheResolution;
+    double likelihoodCacheAngularResolution;
+    /** if set to true, the particles are grouped into clusters on a grid of
+     * clusterResolution in m for the position and clusterAngularResolution
+     * in rad for the heading. At first only the particle with the highest
+     * weight of each cluster is evaluated. The other particles of a cluster
+     * are only evaluated if the likelihood of this representative is at
+     * least clusterThreshold times the highest likelihood of all
+     * representatives, otherwise they take the likelihood of the
+     * representative. A representative without contact has a likelihood
+     * of 0, so with a threshold of 0 all particles are evaluated.
+     */
+    bool useClusterEvaluation;
+    double clusterResolution;
+    double clusterAngularResolution;
+    double clusterThreshold;
+    /** if the weight update is given a deadline, this fraction of the
+     * particles with the highest prior weight is evaluated first, followed
+     * by a sample of the other particles which is spread evenly over space.
+     * Particles which are not evaluated before the deadline are treated
+     * like particles without contact, and their weight is additionally
+     * multiplied with deadlineWeightFactor. The cluster evaluation is not
+     * used in this case.
+     */
+    double deadlinePriorityFraction;
+    double deadlineWeightFactor;
+    /** if larger than 1, the particles are split into this number of
+     * islands, which are resampled independently of each other, and in
+     * parallel if USE_OPENMP is set. An island is resampled if its
+     * effective count falls below minEffective scaled to the size of the
+     * island. Every islandMigrationPeriod weight updates, the
+     * islandMigrationCount best particles of each island are passed on to
+     * the next island. A period of 0 disables the migration.
+     */
+    size_t islandCount;
+    size_t islandMigrationPeriod;
+    size_t islandMigrationCount;
+    /** if set to true and the library is built with USE_NUMA, the
+     * particles are split into contiguous blocks, one for each NUMA node.
+     * The per particle maps are cloned on the node of their particle, and
+     * the particles are evaluated by threads running on that node. A
+     * shared map is copied to each node, which needs the memory of the map
+     * once per node. The islands are kept on one node if islandCount is a
+     * multiple of the number of nodes.
+     */
+    bool useNumaPlacement;
+    /** number of blocks the particles are split into with
+     * useNumaPlacement, 0 for the number of NUMA nodes of the system.
+     * Blocks beyond the nodes of the system are not bound to a node, which
+     * is mainly useful for testing.
+     */
+    int numaNodeCount;
     /** configuration options for the contact model
      */
     ContactModelConfiguration contactModel;
@@ -210,6 +378,45 @@ struct Configuration
      * values greater than 1 will log every nth distribution.
      */
     unsigned int logParticlePeriod;
+    /** if set to true, laser scans and distance images are merged into the
+     * particle maps by a separate mapping thread.
+     */
+    bool asyncMapping;
+    /** maximum number of sensor inputs waiting for the mapping thread.
+     * Additional inputs are dropped.
+     */
+    size_t mappingQueueSize;
+    /** number of particle maps that are merged by the mapping thread before
+     * giving the localization the chance to run.
+     */
+    size_t mappingBatchSize;
+    /** grids of the per particle maps which are further than this distance
+     * in m from their particle are written to disk and released. They are
+     * read back when the particle comes closer again. A value of 0 disables
+     * paging. Otherwise it needs to be at least the lookup distance of the
+     * contact points, which is 3m.
+     */
+    double pagingRadius;
+    /** maximum number of bytes the patches of the per particle maps should
+     * use. If exceeded, the least recently used grids are written to disk,
+     * even if they are within the pagingRadius. A value of 0 means no limit.
+     * Only used if paging is enabled.
+     */
+    size_t pagingBudget;
+    /** file that paged out grids are written to. If empty, an anonymous
+     * temporary file is used.
+     */
+    std::string pagingFile;
+    /** maximum number of bytes the filter should use. If the budget is
+     * exceeded, the debug data is dropped, the particle maps are paged out
+     * (if paging is enabled), maps of particles with nearly the same pose
+     * are shared, and finally the number of particles is reduced, in that
+     * order. A value of 0 means no limit.
+     */
+    size_t memoryBudget;
+    /** number of measurement updates between checks of the memoryBudget
+     */
+    size_t memoryCheckPeriod;
 };
 
 }
@@ -18,6 +18,24 @@ void ContactModel::setConfiguration( const ContactModelConfiguration& config )
     this->config = config;
 }
 
+void ContactModel::getResult( ContactModelResult& result ) const
+{
+    result.weight = m_weight;
+    result.zDelta = m_zDelta;
+    result.zVar = m_zVar;
+    result.poseVar = m_poseVar;
+    result.contactPoints = contact_points;
+}
+
+void ContactModel::setResult( const ContactModelResult& result )
+{
+    m_weight = result.weight;
+    m_zDelta = result.zDelta;
+    m_zVar = result.zVar;
+    m_poseVar = result.poseVar;
+    contact_points = result.contactPoints;
+}
+
 void ContactModel::setContactPoints( const odometry::BodyContactState& state, const base::Quaterniond& orientation )
 {
     // generate a copy of the provided contact points, transform them using the
@@ -12,6 +12,19 @@
 namespace eslam
 {
 
+/**
+ * State of the contact model after evaluatePose, which can be stored in
+ * order to reuse the evaluation for another pose.
+ */
+struct ContactModelResult
+{
+    double weight;
+    double zDelta;
+    double zVar;
+    double poseVar;
+    std::vector<ContactPoint> contactPoints;
+};
+
 /** 
  * Contactmodel class that relates the kinematic configuration of a robot with
  * an environment model.  
@@ -163,6 +176,12 @@ public:
 	return slip_points;
     }
 
+    /** store the result of the last evaluatePose */
+    void getResult( ContactModelResult& result ) const;
+    /** restore a stored result, as if evaluatePose was called for the pose
+     * it was stored for. Slip points are not restored. */
+    void setResult( const ContactModelResult& result );
+
 };
 
 /** 
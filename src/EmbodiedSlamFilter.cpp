@@ -7,6 +7,20 @@
 #include <envire/tools/Numeric.hpp>
 #include <terrain_estimator/TerrainConfiguration.hpp>
 
+#include <Eigen/StdVector>
+#include <boost/bind.hpp>
+#include <map>
+#include <set>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+
+#include "Checkpoint.hpp"
+#include "Trace.hpp"
+#include "PerfCounters.hpp"
+
+#include <omp.h>
+
 using namespace eslam;
 using namespace envire;
 
@@ -18,13 +32,47 @@ EmbodiedSlamFilter::EmbodiedSlamFilter(
     odometry( odometryConfig ), 
     filter( odometry, eslamConfig ), 
     sharedMap(NULL),
+    scanMap(NULL),
     distGrid(NULL),
-    textureGrid(NULL)
+    textureGrid(NULL),
+    update_idx(0),
+    stopMappingThread(false),
+    pendingMappingJobs(0),
+    droppedMappingJobs(0),
+    scheduler(eslamConfig.updateScheduler, eslamConfig.measurementThreshold),
+    memoryCheckCount(0),
+    checkpointFailed(false)
 {};
 
+EmbodiedSlamFilter::~EmbodiedSlamFilter()
+{
+    stopMapping();
+    waitForCheckpoint();
+}
+
 MLSGrid* EmbodiedSlamFilter::createGridTemplate( envire::Environment* env )
 {
-    const double size = eslamConfig.gridSize;
+    return createGridTemplate( env, eslamConfig.gridSize );
+}
+
+MLSGrid* EmbodiedSlamFilter::createScanGridTemplate( envire::Environment* env )
+{
+    // The scan grid only needs to cover the region the sensors can reach
+    // around the body. All sensor data is limited to maxSensorRange from the
+    // sensor, and the sensors are at most maxSensorOffset away from the body
+    // frame, which is checked on each update. Keeping the grid at that size
+    // means that clear, match and merge don't have to iterate over cells
+    // which can never contain data.
+    const double resolution = eslamConfig.gridResolution;
+    const double reach = eslamConfig.maxSensorRange + eslamConfig.maxSensorOffset;
+    const double size = std::min( eslamConfig.gridSize, 
+	    2.0 * std::ceil( reach / resolution ) * resolution );
+
+    return createGridTemplate( env, size );
+}
+
+MLSGrid* EmbodiedSlamFilter::createGridTemplate( envire::Environment* env, double size )
+{
     const double resolution = eslamConfig.gridResolution;
     envire::MLSGrid* gridTemplate = 
 	    new envire::MLSGrid( size/resolution, size/resolution, resolution, resolution, -size/2.0, -size/2.0  );
@@ -67,51 +115,67 @@ MLSMap* EmbodiedSlamFilter::createMapTemplate( envire::Environment* env, const b
 }
 
 
+MLSMap* EmbodiedSlamFilter::createSharedMap( envire::Environment* env )
+{
+    // see if there is a MLSGrid in the environment and use that as a sharedmap
+    // otherwise create a new map
+    std::vector<envire::MLSGrid*> grids = env->getItems<envire::MLSGrid>();
+    if( !grids.empty() )
+    {
+	MLSGrid *gridTemplate = grids.front();
+
+	// for now use the first grid found...
+	MLSMap* mapTemplate = new MLSMap();
+	FrameNode *mapNode = new envire::FrameNode(); 
+	env->addChild( env->getRootNode(), mapNode );
+	if( gridTemplate->getFrameNode() == env->getRootNode() )
+	    env->setFrameNode( gridTemplate, mapNode );
+	else
+	    env->addChild( mapNode, gridTemplate->getFrameNode() );
+	env->setFrameNode( mapTemplate, mapNode );
+	mapTemplate->addGrid( gridTemplate );
+
+	return mapTemplate;
+    }
+    else
+    {
+	throw std::runtime_error("The provided environment does not contain an mls grid.");
+	//return createMapTemplate( env );
+    }
+}
+
 void EmbodiedSlamFilter::init( envire::Environment* env, const base::Pose& pose, bool useSharedMap, const SurfaceHashConfig& hashConfig )
 {
+    // the checkpoint thread may still use the maps
+    waitForCheckpoint();
+
     bool useHash = hashConfig.useHash;
-    if( useSharedMap )
-    {
-	// see if there is a MLSGrid in the environment and use that as a sharedmap
-	// otherwise create a new map
-	std::vector<envire::MLSGrid*> grids = env->getItems<envire::MLSGrid>();
-	if( !grids.empty() )
-	{
-	    MLSGrid *gridTemplate = grids.front();
 
-	    // for now use the first grid found...
-	    MLSMap* mapTemplate = new MLSMap();
-	    FrameNode *mapNode = new envire::FrameNode(); 
-	    env->addChild( env->getRootNode(), mapNode );
-	    if( gridTemplate->getFrameNode() == env->getRootNode() )
-		env->setFrameNode( gridTemplate, mapNode );
-	    else
-		env->addChild( mapNode, gridTemplate->getFrameNode() );
-	    env->setFrameNode( mapTemplate, mapNode );
-	    mapTemplate->addGrid( gridTemplate );
-
-	    if( useHash )
-	    {
-		// create a surfaceHash
-		hash.setConfiguration( hashConfig );
-		hash.create( gridTemplate );
-	    }
+    // a map given with setSharedMap is only used as a shared map
+    if( !useSharedMap )
+	sharedMap = NULL;
 
-	    sharedMap = mapTemplate;
-	}
-	else
-	{
-	    throw std::runtime_error("The provided environment does not contain an mls grid.");
-	    //sharedMap = createMapTemplate( env );
-	}
+    if( useSharedMap && !sharedMap )
+	sharedMap = createSharedMap( env );
+
+    if( useSharedMap && useHash && !hash )
+    {
+	// create a surfaceHash
+	boost::shared_ptr<SurfaceHash> newHash( new SurfaceHash() );
+	newHash->setConfiguration( hashConfig );
+	newHash->create( sharedMap->getActiveGrid().get() );
+	hash = newHash;
     }
 
     const double angle = pose.orientation.toRotationMatrix().eulerAngles(2,1,0)[0];
     if( useHash )
     {
+	if( !hash )
+	    throw std::runtime_error("The surface hash can only be used with a shared map.");
+
 	filter.init( 
 		eslamConfig.particleCount, 
-		&hash );
+		hash.get() );
     }
     else
     {
@@ -125,7 +189,7 @@ void EmbodiedSlamFilter::init( envire::Environment* env, const base::Pose& pose,
 		);
     }
 
-    udPose = mapPose = stereoPose = Eigen::Translation3d(1000,0,0) * Eigen::Affine3d::Identity();
+    udPose = mapPose = stereoPose = cloudPose = Eigen::Translation3d(1000,0,0) * Eigen::Affine3d::Identity();
 
     // either use the shared map to init, or create a grid template for the per particle maps
     if( sharedMap )
@@ -133,8 +197,16 @@ void EmbodiedSlamFilter::init( envire::Environment* env, const base::Pose& pose,
     else
 	filter.setEnvironment( env, createMapTemplate( env, pose ), useSharedMap );
 
+    initPipeline( env );
+
+    if( eslamConfig.asyncMapping )
+	startMapping();
+}
+
+void EmbodiedSlamFilter::initPipeline( envire::Environment* env )
+{
     // setup environment for converting scans
-    scanMap = createGridTemplate( env ); 
+    scanMap = createScanGridTemplate( env ); 
     scanFrame = new envire::FrameNode(); // yaw compensated body frame
     scannerFrame = new envire::FrameNode(); // transform from laser scanner to scanframe
     env->addChild( env->getRootNode(), scanFrame );
@@ -174,61 +246,141 @@ void EmbodiedSlamFilter::init( envire::Environment* env, const base::Pose& pose,
     distMlsOp->addInput( distPc );
     distMlsOp->addOutput( scanMap );
     distMlsOp->useUncertainty( true );
+
+    scanProjection.setMaxRange( eslamConfig.maxSensorRange );
+    scanProjection.setResolution( eslamConfig.gridResolution );
+    scanProjection.setPyramidLevels( eslamConfig.depthPyramidLevels );
+    voxelFilter.setVoxelSize( eslamConfig.voxelSize > 0 ? eslamConfig.voxelSize : eslamConfig.gridResolution );
 }
 
 void EmbodiedSlamFilter::processMap( MLSGrid* scanMap, bool match, bool update )
 {
-    static size_t update_idx = 0;
-
     std::vector<eslam::PoseEstimator::Particle> &particles( getParticles() );
-    for( size_t i=0; i< particles.size(); i++ )
+    mapParticles( particles, 0, particles.size(), scanMap, match, update, &filter.getOrder() );
+
+    if( update )
+	update_idx++;
+}
+
+void EmbodiedSlamFilter::mapParticles( std::vector<eslam::PoseEstimator::Particle>& particles, 
+	size_t begin, size_t end, MLSGrid* scanMap, bool match, bool update,
+	const std::vector<size_t>* order )
+{
+    ESLAM_TRACE_SCOPE( "mapParticles" );
+    const char* stage = match ? "mapParticles.match" : "mapParticles";
+    PerfScope perf( stage, end - begin );
+
+    envire::Environment *env = scanMap->getEnvironment();
+
+    // The transforms between the scan and the particle grids are composed
+    // from the particle pose and the cached transforms of the frame chains,
+    // so the frame tree is only touched when a new grid needs to be selected.
+    const Eigen::Affine3d C_scan2frame = 
+	env->relativeTransform( scanMap->getFrameNode(), scanFrame );
+    std::map<const envire::FrameNode*, Eigen::Affine3d, std::less<const envire::FrameNode*>, 
+	Eigen::aligned_allocator<std::pair<const envire::FrameNode* const, Eigen::Affine3d> > > C_root2grid;
+
+    std::vector<envire::MLSGrid*> grids( particles.size() );
+    std::vector<Eigen::Affine3d, Eigen::aligned_allocator<Eigen::Affine3d> > C_s2p( particles.size() );
+
+    // particles can share a map, in which case the scan is only merged
+    // once, using the pose of the first of these particles. This also
+    // makes sure no grid is merged from multiple threads.
+    std::set<envire::MLSGrid*> usedGrids;
+    std::vector<bool> merge( particles.size(), false );
+
+    for( size_t k=begin; k<end; k++ )
     {
+	const size_t i = order ? (*order)[k] : k;
 	eslam::PoseEstimator::Particle &p( particles[i] );
 	envire::MLSMap *pmap = p.grid.getMap();
 	envire::MLSGrid *pgrid = pmap->getActiveGrid().get();
 
-	scanFrame->setTransform( envire::Transform( 
-		    Eigen::Translation3d( p.position.x(), p.position.y(), 0 ) *
-		    Eigen::AngleAxisd( p.orientation, Eigen::Vector3d::UnitZ() )
-		    ) );
+	const Eigen::Affine3d C_frame2root = 
+	    Eigen::Translation3d( p.position.x(), p.position.y(), 0 ) *
+	    Eigen::AngleAxisd( p.orientation, Eigen::Vector3d::UnitZ() );
+
+	if( !C_root2grid.count( pgrid->getFrameNode() ) )
+	    C_root2grid[pgrid->getFrameNode()] = 
+		env->relativeTransform( env->getRootNode(), pgrid->getFrameNode() );
+	Eigen::Affine3d tf = C_root2grid[pgrid->getFrameNode()] * C_frame2root;
 
  	if( update )
  	{
-	    Transform tf = scanFrame->relativeTransform( pgrid->getFrameNode() );
  	    // creating a new map is then a matter of looking if either x
  	    // or y is gone over a portion of the map size.
  	    const double newMapThreshold = eslamConfig.gridSize / 2.0 * eslamConfig.gridThreshold;
 	    if( fabs(tf.translation().x()) > newMapThreshold || fabs(tf.translation().y()) > newMapThreshold )
 	    {
 		// see if we need to select a new grid
+		scanFrame->setTransform( envire::Transform( C_frame2root ) );
 		pmap->selectActiveGrid( scanFrame, newMapThreshold );
 		pgrid = pmap->getActiveGrid().get();
+
+		if( !C_root2grid.count( pgrid->getFrameNode() ) )
+		    C_root2grid[pgrid->getFrameNode()] = 
+			env->relativeTransform( env->getRootNode(), pgrid->getFrameNode() );
+		tf = C_root2grid[pgrid->getFrameNode()] * C_frame2root;
 	    }
+
+	    merge[i] = usedGrids.insert( pgrid ).second;
 	}
 
-	Eigen::Affine3d C_s2p = scanMap->getEnvironment()->relativeTransform( scanMap->getFrameNode(), pgrid->getFrameNode() );
+	// the grid may have been paged out
+	GridPager &pager( filter.getPager() );
+	if( pager.isEnabled() && !sharedMap )
+	    pager.require( pgrid, update );
 
-	// merge the scan with the map of the current particle
-	envire::MLSGrid::SurfacePatch offsetPatch( p.zPos, p.zSigma );
-	offsetPatch.update_idx = update_idx;
-	if( match )
-	{
-	    const size_t sampling = 10;
-	    const float sigma = 0.2;
-	    float weight = pgrid->match( *scanMap, C_s2p, offsetPatch, sampling, sigma );
-	    const float visualWeighting = 0.1;
-	    p.weight *= pow( weight, visualWeighting );
-	}
+	// a checkpoint which is being written needs the grid as it was
 	if( update )
+	    snapshotGrid( pgrid );
+
+	grids[i] = pgrid;
+	C_s2p[i] = tf * C_scan2frame;
+    }
+
+    // match and merge the scan with the map of each particle. All
+    // particles are matched before any grid is merged, since particles
+    // which share a grid would otherwise match against a grid another
+    // thread is merging into.
+    ESLAM_TRACE_SCOPE( match ? "matchAndMerge" : "merge" );
+    for( int pass = match ? 0 : 1; pass < 2; pass++ )
+    {
+#ifdef USE_OPENMP
+#pragma omp parallel
+#endif
 	{
-	    pgrid->merge( *scanMap, C_s2p, offsetPatch );
-	    // mark as modified to trigger updates
-	    pgrid->itemModified();
+#ifdef USE_OPENMP
+	    PerfWorkerScope workerPerf( stage, omp_get_thread_num() > 0 );
+#pragma omp for
+#endif
+	    for( size_t k=begin; k<end; k++ )
+	    {
+		const size_t i = order ? (*order)[k] : k;
+		eslam::PoseEstimator::Particle &p( particles[i] );
+		envire::MLSGrid *pgrid = grids[i];
+
+		// merge the scan with the map of the current particle
+		envire::MLSGrid::SurfacePatch offsetPatch( p.zPos, p.zSigma );
+		offsetPatch.update_idx = update_idx;
+		if( pass == 0 )
+		{
+		    const size_t sampling = 10;
+		    const float sigma = 0.2;
+		    float weight = pgrid->match( *scanMap, C_s2p[i], offsetPatch, sampling, sigma );
+		    const float visualWeighting = 0.1;
+		    p.weight *= pow( weight, visualWeighting );
+		}
+		else if( merge[i] )
+		    pgrid->merge( *scanMap, C_s2p[i], offsetPatch );
+	    }
 	}
     }
 
-    if( update )
-	update_idx++;
+    // mark as modified to trigger updates. This is done outside of the
+    // parallel section, since it will notify the environment.
+    for( std::set<envire::MLSGrid*>::iterator it = usedGrids.begin(); it != usedGrids.end(); it++ )
+	(*it)->itemModified();
 }
 
 bool EmbodiedSlamFilter::update( envire::Featurecloud *stereo_features )
@@ -236,112 +388,157 @@ bool EmbodiedSlamFilter::update( envire::Featurecloud *stereo_features )
     return false;
 }
 
+void EmbodiedSlamFilter::checkSensorOffset( const Eigen::Affine3d& sensor2body ) const
+{
+    // the scan grid only covers maxSensorOffset around the body, so data of
+    // a sensor which is further away would partly be lost
+    if( sensor2body.translation().norm() > eslamConfig.maxSensorOffset )
+	throw std::runtime_error( "The sensor is further away from the body than maxSensorOffset." );
+}
+
 bool EmbodiedSlamFilter::update( 
 	const Eigen::Affine3d& body2odometry, const base::samples::DistanceImage& dimage, 
 	const Eigen::Affine3d& camera2body, const base::samples::frame::Frame* timage )
 {
+    checkSensorOffset( camera2body );
     if( eslamConfig.mappingCameraThreshold.test( stereoPose.inverse() * body2odometry * camera2body ) )
     {
-	Eigen::Quaterniond orientation( body2odometry.linear() );
-
-	if( !distGrid )
-	{
-	    // create new grid using the parameters from the distance image
-	    distGrid = new envire::DistanceGrid( dimage );
-
-	    // distGrid has just been created and needs to be attached
-	    distOp->addInput( distGrid );
-	    distGrid->setFrameNode( distPc->getFrameNode() );
-	}
-	distGrid->copyFromDistanceImage( dimage );
-
-	// if there is a texture image add it to the processing chain
-	if( timage )
+	if( mappingThread )
 	{
-	    // create new imagegrid object if not available
-	    if( !textureGrid )
+	    MappingJob *job = new MappingJob();
+	    job->type = MappingJob::DISTANCE_IMAGE;
+	    job->body2odometry = body2odometry;
+	    job->sensor2body = camera2body;
+	    job->dimage = dimage;
+	    if( timage )
 	    {
-		// copy the scaling properties from distanceImage
-		// TODO this is a hack!
-		textureGrid = new envire::ImageRGB24( 
-			dimage.width, dimage.height, 
-			dimage.scale_x, dimage.scale_y, 
-			dimage.center_x, dimage.center_y );
-
-		distOp->addInput( textureGrid );
-		textureGrid->setFrameNode( distPc->getFrameNode() );
+		job->timage = *timage;
+		job->hasTexture = true;
 	    }
-	    textureGrid->copyFromFrame( *timage );
+	    enqueueMappingJob( job );
+	}
+	else
+	{
+	    boost::unique_lock<boost::timed_mutex> lock( mapMutex, boost::defer_lock );
+	    if( needsMapLock() )
+		lock.lock();
+
+	    projectDistanceImage( body2odometry, dimage, camera2body, timage );
+	    processMap( scanMap, false, true );
 	}
 
-	// run the actual operation
-	distOp->updateAll();
+	stereoPose = body2odometry * camera2body;
+
+	return true;
+    }
+
+    return false;
+}
+
+void EmbodiedSlamFilter::projectDistanceImage( 
+	const Eigen::Affine3d& body2odometry, const base::samples::DistanceImage& dimage, 
+	const Eigen::Affine3d& camera2body, const base::samples::frame::Frame* timage )
+{
+    ESLAM_TRACE_SCOPE( "projectDistanceImage" );
+    PerfScope perf( "projectDistanceImage", dimage.width * dimage.height );
 
-	// assume a 2 deg rotation error for the laser2Body transform
-	const double scanAngleSigma = 5.0/180.0*M_PI;
-	Eigen::Matrix<double,6,1> lcov;
-	lcov << scanAngleSigma,0,0, 0,0,0;
-	envire::TransformWithUncertainty dist2bodyU( camera2body, lcov.array().square().matrix().asDiagonal());
+    // the fused projection does not handle texture information, so use the
+    // envire pipeline if there is a texture image
+    const bool fused = eslamConfig.useFusedProjection && !timage;
 
-	// the covariance for the body to world transform comes from
-	// a 1 deg error for pitch and roll
-	// TODO: actually the errors should be in global frame, and not in body
-	// frame... fix later
-	const double pitchRollSigma = 3.0/180.0*M_PI;
-	Eigen::Matrix<double,6,1> pcov;
-	pcov << pitchRollSigma,pitchRollSigma,0, 0,0,0;
-	envire::TransformWithUncertainty body2World( 
-		Eigen::Affine3d( base::removeYaw(orientation) ), pcov.array().square().matrix().asDiagonal());
+    if( !fused )
+	updateDistancePointcloud( dimage, timage );
 
-	distFrame->setTransform( body2World * dist2bodyU );
+    const envire::TransformWithUncertainty dist2frame = 
+	getSensorTransform( body2odometry, camera2body );
 
+    if( fused )
+    {
 	scanMap->clear();
-	distMlsOp->updateAll();
+	scanProjection.project( dimage, getScanGridTransform( dist2frame ), *scanMap );
+	return;
+    }
 
-	processMap( scanMap, false, true );
+    distFrame->setTransform( dist2frame );
 
-	stereoPose = body2odometry * camera2body;
+    scanMap->clear();
+    distMlsOp->updateAll();
+}
 
-	return true;
+void EmbodiedSlamFilter::updateDistancePointcloud( 
+	const base::samples::DistanceImage& dimage, const base::samples::frame::Frame* timage )
+{
+    if( !distGrid )
+    {
+	// create new grid using the parameters from the distance image
+	distGrid = new envire::DistanceGrid( dimage );
+
+	// distGrid has just been created and needs to be attached
+	distOp->addInput( distGrid );
+	distGrid->setFrameNode( distPc->getFrameNode() );
     }
+    distGrid->copyFromDistanceImage( dimage );
 
-    return false;
+    // if there is a texture image add it to the processing chain
+    if( timage )
+    {
+	// create new imagegrid object if not available
+	if( !textureGrid )
+	{
+	    // copy the scaling properties from distanceImage
+	    // TODO this is a hack!
+	    textureGrid = new envire::ImageRGB24( 
+		    dimage.width, dimage.height, 
+		    dimage.scale_x, dimage.scale_y, 
+		    dimage.center_x, dimage.center_y );
+
+	    distOp->addInput( textureGrid );
+	    textureGrid->setFrameNode( distPc->getFrameNode() );
+	}
+	textureGrid->copyFromFrame( *timage );
+    }
+
+    // run the actual operation
+    distOp->updateAll();
 }
 
 bool EmbodiedSlamFilter::update( const Eigen::Affine3d& body2odometry, const base::samples::LaserScan& scan, const Eigen::Affine3d& laser2body )
 {
+    checkSensorOffset( laser2body );
     if( eslamConfig.mappingThreshold.test( mapPose.inverse() * body2odometry * laser2body ) )
     {
-	Eigen::Quaterniond orientation( body2odometry.linear() );
-
-	// convert scan object to pointcloud
-	scanNode->lines.clear();
-	scanNode->addScanLine( 0, scan );
-	smOp->updateAll();
-
-	// assume a 2 deg rotation error for the laser2Body transform
-	const double scanAngleSigma = 5.0/180.0*M_PI;
-	Eigen::Matrix<double,6,1> lcov;
-	lcov << scanAngleSigma,0,0, 0,0,0;
-	envire::TransformWithUncertainty laser2bodyU( laser2body, lcov.array().square().matrix().asDiagonal());
-
-	// the covariance for the body to world transform comes from
-	// a 1 deg error for pitch and roll
-	// TODO: actually the errors should be in global frame, and not in body
-	// frame... fix later
-	const double pitchRollSigma = 3.0/180.0*M_PI;
-	Eigen::Matrix<double,6,1> pcov;
-	pcov << pitchRollSigma,pitchRollSigma,0, 0,0,0;
-	envire::TransformWithUncertainty body2World( 
-		Eigen::Affine3d( base::removeYaw(orientation) ), pcov.array().square().matrix().asDiagonal());
-
-	scannerFrame->setTransform( body2World * laser2bodyU );
-	scanMap->clear();
-	mlsOp->updateAll();
-
 	bool match = eslamConfig.useVisualUpdate; 
 	bool update = !sharedMap;
-	processMap( scanMap, match, update );
+
+	// the visual update changes the particle weights, which can only be
+	// done synchronously
+	if( mappingThread && !match )
+	{
+	    if( update )
+	    {
+		MappingJob *job = new MappingJob();
+		job->type = MappingJob::LASER_SCAN;
+		job->body2odometry = body2odometry;
+		job->sensor2body = laser2body;
+		job->scan = scan;
+		enqueueMappingJob( job );
+	    }
+	}
+	else
+	{
+	    // the mapping thread releases the maps between the batches of a
+	    // job, while it still merges the scan grid, so the queued jobs
+	    // need to be done before the scan grid can be reused here
+	    if( mappingThread )
+		waitForMapping();
+
+	    boost::unique_lock<boost::timed_mutex> lock( mapMutex, boost::defer_lock );
+	    if( needsMapLock() )
+		lock.lock();
+
+	    projectLaserScan( body2odometry, scan, laser2body );
+	    processMap( scanMap, match, update );
+	}
 
 	mapPose = body2odometry * laser2body;
 
@@ -350,24 +547,854 @@ bool EmbodiedSlamFilter::update( const Eigen::Affine3d& body2odometry, const bas
     return false;
 }
 
+void EmbodiedSlamFilter::projectLaserScan( const Eigen::Affine3d& body2odometry, const base::samples::LaserScan& scan, const Eigen::Affine3d& laser2body )
+{
+    ESLAM_TRACE_SCOPE( "projectLaserScan" );
+    PerfScope perf( "projectLaserScan", scan.ranges.size() );
+
+    const envire::TransformWithUncertainty laser2frame = 
+	getSensorTransform( body2odometry, laser2body );
+
+    // the fused projection only adds the measured surfaces, so the envire
+    // pipeline is used if the free space along the rays is needed as well
+    if( eslamConfig.useFusedProjection && !eslamConfig.gridUseNegativeInformation )
+    {
+	scanMap->clear();
+	scanProjection.project( scan, getScanGridTransform( laser2frame ), *scanMap );
+	return;
+    }
+
+    // convert scan object to pointcloud
+    scanNode->lines.clear();
+    scanNode->addScanLine( 0, scan );
+    smOp->updateAll();
+
+    scannerFrame->setTransform( laser2frame );
+    scanMap->clear();
+    mlsOp->updateAll();
+}
+
+envire::TransformWithUncertainty EmbodiedSlamFilter::getSensorTransform( const Eigen::Affine3d& body2odometry, const Eigen::Affine3d& sensor2body )
+{
+    Eigen::Quaterniond orientation( body2odometry.linear() );
+
+    // assume a 2 deg rotation error for the laser2Body transform
+    const double scanAngleSigma = 5.0/180.0*M_PI;
+    Eigen::Matrix<double,6,1> lcov;
+    lcov << scanAngleSigma,0,0, 0,0,0;
+    envire::TransformWithUncertainty sensor2bodyU( sensor2body, lcov.array().square().matrix().asDiagonal());
+
+    // the covariance for the body to world transform comes from
+    // a 1 deg error for pitch and roll
+    // TODO: actually the errors should be in global frame, and not in body
+    // frame... fix later
+    const double pitchRollSigma = 3.0/180.0*M_PI;
+    Eigen::Matrix<double,6,1> pcov;
+    pcov << pitchRollSigma,pitchRollSigma,0, 0,0,0;
+    envire::TransformWithUncertainty body2World( 
+	    Eigen::Affine3d( base::removeYaw(orientation) ), pcov.array().square().matrix().asDiagonal());
+
+    return body2World * sensor2bodyU;
+}
+
+envire::TransformWithUncertainty EmbodiedSlamFilter::getScanGridTransform( const envire::TransformWithUncertainty& sensor2frame )
+{
+    // the scan grid is attached to the scan frame
+    const Eigen::Affine3d C_frame2grid = 
+	scanMap->getEnvironment()->relativeTransform( scanFrame, scanMap->getFrameNode() );
+    return envire::TransformWithUncertainty( C_frame2grid, Eigen::Matrix<double,6,6>::Zero() ) * sensor2frame;
+}
+
+bool EmbodiedSlamFilter::update( const Eigen::Affine3d& body2odometry, const base::samples::Pointcloud& pc, const Eigen::Affine3d& sensor2body )
+{
+    checkSensorOffset( sensor2body );
+    if( eslamConfig.mappingThreshold.test( cloudPose.inverse() * body2odometry * sensor2body ) )
+    {
+	if( sharedMap )
+	    return false;
+
+	if( mappingThread )
+	{
+	    MappingJob *job = new MappingJob();
+	    job->type = MappingJob::POINTCLOUD;
+	    job->body2odometry = body2odometry;
+	    job->sensor2body = sensor2body;
+	    job->points = pc.points;
+	    enqueueMappingJob( job );
+	}
+	else
+	{
+	    boost::unique_lock<boost::timed_mutex> lock( mapMutex, boost::defer_lock );
+	    if( needsMapLock() )
+		lock.lock();
+
+	    projectPointcloud( body2odometry, pc.points, sensor2body );
+	    processMap( scanMap, false, true );
+	}
+
+	cloudPose = body2odometry * sensor2body;
+
+	return true;
+    }
+    return false;
+}
+
+void EmbodiedSlamFilter::projectPointcloud( const Eigen::Affine3d& body2odometry, const std::vector<base::Point>& points, const Eigen::Affine3d& sensor2body )
+{
+    ESLAM_TRACE_SCOPE( "projectPointcloud" );
+    PerfScope perf( "projectPointcloud", points.size() );
+
+    // reduce the points to about one per grid cell and height interval
+    // before projecting them 
+    voxelFilter.filter( points, voxelPoints );
+
+    scanMap->clear();
+    scanProjection.project( voxelPoints, 
+	    getScanGridTransform( getSensorTransform( body2odometry, sensor2body ) ), *scanMap );
+}
+
 bool EmbodiedSlamFilter::update( const Eigen::Affine3d& body2odometry, const odometry::BodyContactState& bs, const std::vector<terrain_estimator::TerrainClassification>& ltc )
+{
+    return update( body2odometry, bs, ltc, base::Time() );
+}
+
+bool EmbodiedSlamFilter::update( const Eigen::Affine3d& body2odometry, const odometry::BodyContactState& bs, const std::vector<terrain_estimator::TerrainClassification>& ltc, const base::Time& deadline )
 {
     Eigen::Quaterniond orientation( body2odometry.linear() );
 
+    // the particle maps must not be modified by the mapping thread while
+    // they are used for the weight update, nor released or paged while the
+    // checkpoint thread serializes them. With a deadline, the contact state
+    // is dropped if the other thread holds the maps for too long.
+    boost::unique_lock<boost::timed_mutex> lock( mapMutex, boost::defer_lock );
+    if( needsMapLock() )
+    {
+	if( deadline.isNull() )
+	    lock.lock();
+	else
+	{
+	    const boost::int64_t wait = (deadline - base::Time::now()).toMicroseconds();
+	    if( !lock.timed_lock( boost::posix_time::microseconds( std::max<boost::int64_t>( wait, 0 ) ) ) )
+		return false;
+	}
+    }
+
     odometry.update( bs, orientation );
     filter.project( bs, orientation );
 
-    if( eslamConfig.measurementThreshold.test( udPose.inverse() * body2odometry ) || ltc.size() > 0 )
+    const Eigen::Affine3d pdelta = udPose.inverse() * body2odometry;
+    const bool useScheduler = eslamConfig.updateScheduler.useScheduler;
+    const bool doUpdate = useScheduler ? 
+	scheduler.test( pdelta, bs.time ) : eslamConfig.measurementThreshold.test( pdelta );
+
+    if( doUpdate || ltc.size() > 0 )
     {
-	filter.update( bs, orientation, ltc );
+	// only measure the time if it is needed, so the updates don't depend
+	// on it otherwise
+	base::Time start;
+	if( useScheduler && scheduler.usesBudget() )
+	    start = base::Time::now();
+
+	filter.update( bs, orientation, ltc, deadline );
 	udPose = body2odometry;
 
+	if( useScheduler )
+	    scheduler.updated( filter.getParticles(), 
+		    filter.getEffectiveCount(), filter.getInformationGain(),
+		    start.isNull() ? 0.0 : (base::Time::now() - start).toSeconds() );
+
+	// the memory budget is checked on the next update if the deadline
+	// has passed already
+	if( eslamConfig.memoryBudget > 0 && ++memoryCheckCount >= eslamConfig.memoryCheckPeriod 
+		&& (deadline.isNull() || base::Time::now() < deadline) )
+	{
+	    memoryCheckCount = 0;
+	    enforceMemoryBudget();
+	}
+
 	return true;
     }
     else
 	return false;
 }
 
+void EmbodiedSlamFilter::startMapping()
+{
+    if( mappingThread )
+	return;
+
+    mappingQueue.reset( new MappingQueue( std::max<size_t>( 1, eslamConfig.mappingQueueSize ) ) );
+    stopMappingThread = false;
+    mappingThread.reset( new boost::thread( boost::bind( &EmbodiedSlamFilter::mappingLoop, this ) ) );
+}
+
+void EmbodiedSlamFilter::stopMapping()
+{
+    if( !mappingThread )
+	return;
+
+    {
+	boost::lock_guard<boost::mutex> lock( mappingSignalMutex );
+	stopMappingThread = true;
+    }
+    mappingSignal.notify_all();
+    mappingThread->join();
+    mappingThread.reset();
+
+    // remove jobs that have not been processed
+    MappingJob *job;
+    while( mappingQueue->pop( job ) )
+	delete job;
+    pendingMappingJobs = 0;
+    mappingDone.notify_all();
+}
+
+void EmbodiedSlamFilter::waitForMapping()
+{
+    boost::unique_lock<boost::mutex> lock( mappingSignalMutex );
+    while( mappingThread && (pendingMappingJobs > 0) )
+	mappingDone.wait( lock );
+}
+
+size_t EmbodiedSlamFilter::getDroppedMappingJobs() const
+{
+    return droppedMappingJobs;
+}
+
+void EmbodiedSlamFilter::enqueueMappingJob( MappingJob* job )
+{
+    // snapshot of the particle poses at the time of the scan. The particles
+    // hold a reference to their maps, so the maps stay valid even if the
+    // particles are resampled in the meantime. They are stored in the
+    // processing order, so each batch of the job covers a compact area.
+    // Only the pose and the map are copied, not the debug data.
+    const std::vector<eslam::PoseEstimator::Particle> &particles( getParticles() );
+    const std::vector<size_t> &order( filter.getOrder() );
+    job->particles.reserve( particles.size() );
+    for( size_t k = 0; k < order.size(); k++ )
+    {
+	const eslam::PoseEstimator::Particle &p( particles[order[k]] );
+	job->particles.push_back( eslam::PoseEstimator::Particle( 
+		    p.position, p.orientation, p.zPos, p.zSigma, p.floating ) );
+	job->particles.back().grid = p.grid;
+    }
+
+    {
+	boost::lock_guard<boost::mutex> lock( mappingSignalMutex );
+	pendingMappingJobs++;
+    }
+
+    if( !mappingQueue->push( job ) )
+    {
+	// the queue is full, so drop the job in order to keep the
+	// latency for the localization bounded
+	boost::lock_guard<boost::mutex> lock( mappingSignalMutex );
+	pendingMappingJobs--;
+	droppedMappingJobs++;
+	delete job;
+	return;
+    }
+
+    // the mutex is only used for signaling the mapping thread, the queue
+    // itself is lock-free. Taking the lock before notifying makes sure the
+    // wakeup is not lost.
+    {
+	boost::lock_guard<boost::mutex> lock( mappingSignalMutex );
+    }
+    mappingSignal.notify_one();
+}
+
+void EmbodiedSlamFilter::mappingLoop()
+{
+    while( true )
+    {
+	MappingJob *job = NULL;
+	bool stop;
+	{
+	    boost::unique_lock<boost::mutex> lock( mappingSignalMutex );
+	    while( !stopMappingThread && !mappingQueue->pop( job ) )
+		mappingSignal.wait( lock );
+	    stop = stopMappingThread;
+	}
+
+	if( stop )
+	{
+	    deleteMappingJob( job );
+	    return;
+	}
+
+	processMappingJob( *job );
+	deleteMappingJob( job );
+
+	{
+	    boost::lock_guard<boost::mutex> lock( mappingSignalMutex );
+	    pendingMappingJobs--;
+	}
+	mappingDone.notify_all();
+    }
+}
+
+void EmbodiedSlamFilter::deleteMappingJob( MappingJob* job )
+{
+    // the job may hold the last reference to the map of a particle which
+    // was resampled in the meantime, and releasing it detaches the map from
+    // the environment
+    boost::lock_guard<boost::timed_mutex> lock( mapMutex );
+    delete job;
+}
+
+void EmbodiedSlamFilter::processMappingJob( MappingJob& job )
+{
+    {
+	boost::lock_guard<boost::timed_mutex> lock( mapMutex );
+	if( job.type == MappingJob::LASER_SCAN )
+	    projectLaserScan( job.body2odometry, job.scan, job.sensor2body );
+	else if( job.type == MappingJob::POINTCLOUD )
+	    projectPointcloud( job.body2odometry, job.points, job.sensor2body );
+	else
+	    projectDistanceImage( job.body2odometry, job.dimage, job.sensor2body, 
+		    job.hasTexture ? &job.timage : NULL );
+    }
+
+    // merge the scan in batches of particles, and give the localization the
+    // chance to run in between. Each particle map is always seen either
+    // before or after the merge.
+    const size_t batchSize = std::max<size_t>( 1, eslamConfig.mappingBatchSize );
+    for( size_t i = 0; i < job.particles.size(); i += batchSize )
+    {
+	boost::lock_guard<boost::timed_mutex> lock( mapMutex );
+	mapParticles( job.particles, i, std::min( i + batchSize, job.particles.size() ), scanMap, false, true );
+    }
+
+    boost::lock_guard<boost::timed_mutex> lock( mapMutex );
+    update_idx++;
+}
+
+MemoryUsage EmbodiedSlamFilter::getMemoryUsage()
+{
+    boost::unique_lock<boost::timed_mutex> lock( mapMutex, boost::defer_lock );
+    if( needsMapLock() )
+	lock.lock();
+
+    return computeMemoryUsage();
+}
+
+MemoryUsage EmbodiedSlamFilter::computeMemoryUsage()
+{
+    MemoryUsage usage;
+    std::vector<eslam::PoseEstimator::Particle> &particles( getParticles() );
+    usage.particles = particles.capacity() * sizeof( eslam::PoseEstimator::Particle );
+
+    // maps which are used by more than one particle are split between them
+    std::map<envire::MLSMap*, size_t> refs;
+    for( size_t i = 0; i < particles.size(); i++ )
+	refs[particles[i].grid.getMap()]++;
+
+    std::map<envire::MLSMap*, size_t> mapBytes;
+    for( std::map<envire::MLSMap*, size_t>::iterator it = refs.begin(); it != refs.end(); it++ )
+    {
+	size_t bytes = 0;
+	std::vector<envire::MLSGrid*> grids = GridPager::getGrids( it->first );
+	for( size_t i = 0; i < grids.size(); i++ )
+	    bytes += GridPager::getGridBytes( grids[i] );
+	mapBytes[it->first] = bytes;
+	usage.maps += bytes;
+    }
+
+    usage.perParticle.resize( particles.size() );
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	const eslam::PoseEstimator::Particle &p( particles[i] );
+	const size_t debug = 
+	    p.cpoints.capacity() * sizeof( ContactPoint ) + p.spoints.capacity() * sizeof( SlipPoint );
+	envire::MLSMap *map = particles[i].grid.getMap();
+	usage.debugData += debug;
+	usage.perParticle[i] = mapBytes[map] / refs[map] + debug;
+    }
+
+    usage.pagedMaps = filter.getPager().getSpilledBytes();
+    usage.surfaceHash = hash ? hash->getMemoryUsage() : 0;
+    usage.scratch = 
+	voxelPoints.capacity() * sizeof( Eigen::Vector3d ) 
+	+ scanProjection.getMemoryUsage() + voxelFilter.getMemoryUsage();
+    if( scanMap )
+	usage.scratch += GridPager::getGridBytes( scanMap );
+
+    return usage;
+}
+
+void EmbodiedSlamFilter::enforceMemoryBudget()
+{
+    const size_t budget = eslamConfig.memoryBudget;
+    MemoryUsage usage = computeMemoryUsage();
+    size_t total = usage.getTotal();
+    if( total <= budget )
+	return;
+
+    std::vector<eslam::PoseEstimator::Particle> &particles( getParticles() );
+
+    // the debug data is not needed by the filter, so drop it first
+    if( usage.debugData > 0 )
+    {
+	filter.setLogDebug( false );
+	for( size_t i = 0; i < particles.size(); i++ )
+	{
+	    std::vector<ContactPoint>().swap( particles[i].cpoints );
+	    std::vector<SlipPoint>().swap( particles[i].spoints );
+	}
+	total -= usage.debugData;
+    }
+
+    // page out the least recently used grids, using what is left of the
+    // budget for the maps
+    GridPager &pager( filter.getPager() );
+    if( total > budget && pager.isEnabled() && !sharedMap )
+    {
+	const size_t other = total - usage.maps;
+	size_t mapBudget = budget > other ? budget - other : 1;
+	if( eslamConfig.pagingBudget > 0 )
+	    mapBudget = std::min( mapBudget, eslamConfig.pagingBudget );
+	pager.setBudget( mapBudget );
+	pager.enforceBudget();
+
+	usage = computeMemoryUsage();
+	total = usage.getTotal();
+    }
+
+    // particles which are within a grid cell, and an angle which moves the
+    // end of the sensor range by a grid cell, would merge nearly the same
+    // data, so they can share a map.
+    if( total > budget && !sharedMap )
+    {
+	const double distance = eslamConfig.gridResolution;
+	const double angle = distance / std::max( eslamConfig.maxSensorRange, distance );
+	if( filter.shareMaps( distance, angle ) > 0 )
+	{
+	    usage = computeMemoryUsage();
+	    total = usage.getTotal();
+	}
+    }
+
+    // finally reduce the number of particles
+    if( total > budget )
+    {
+	const size_t minCount = std::min( particles.size(), eslamConfig.minEffective );
+	const size_t count = std::max( minCount, 
+		static_cast<size_t>( particles.size() * static_cast<double>( budget ) / total ) );
+	filter.reduceParticles( count );
+    }
+}
+
+void EmbodiedSlamFilter::setSharedMap( envire::MLSMap* map )
+{
+    sharedMap = map;
+}
+
+envire::MLSMap* EmbodiedSlamFilter::getSharedMap() const
+{
+    return sharedMap;
+}
+
+void EmbodiedSlamFilter::setSurfaceHash( boost::shared_ptr<const SurfaceHash> hash )
+{
+    this->hash = hash;
+}
+
+boost::shared_ptr<const SurfaceHash> EmbodiedSlamFilter::getSurfaceHash() const
+{
+    return hash;
+}
+
+const UpdateScheduler& EmbodiedSlamFilter::getUpdateScheduler() const
+{
+    return scheduler;
+}
+
+const LikelihoodCache& EmbodiedSlamFilter::getLikelihoodCache() const
+{
+    return filter.getLikelihoodCache();
+}
+
+double EmbodiedSlamFilter::getCompletedFraction() const
+{
+    return filter.getCompletedFraction();
+}
+
+GridPager& EmbodiedSlamFilter::getGridPager()
+{
+    return filter.getPager();
+}
+
+void EmbodiedSlamFilter::writeCheckpoint( const std::string& path )
+{
+    // only one checkpoint is written at a time
+    waitForCheckpoint();
+
+    boost::scoped_ptr<CheckpointJob> job( new CheckpointJob() );
+    job->path = path;
+
+    boost::unique_lock<boost::timed_mutex> lock( mapMutex, boost::defer_lock );
+    if( mappingThread )
+	lock.lock();
+
+    writeState( *job );
+
+    checkpointFailed = false;
+    checkpointJob.swap( job );
+    checkpointThread.reset( new boost::thread( 
+		boost::bind( &EmbodiedSlamFilter::writeCheckpointFile, this ) ) );
+}
+
+bool EmbodiedSlamFilter::waitForCheckpoint()
+{
+    if( checkpointThread )
+    {
+	checkpointThread->join();
+	checkpointThread.reset();
+	releaseCheckpoint();
+    }
+    return !checkpointFailed;
+}
+
+void EmbodiedSlamFilter::releaseCheckpoint()
+{
+    boost::unique_lock<boost::timed_mutex> lock( mapMutex, boost::defer_lock );
+    if( mappingThread )
+	lock.lock();
+
+    // the entries of grids which are released together with the checkpoint
+    // are removed from the pager, the others are swept once their maps are
+    // not used anymore
+    GridPager &pager( filter.getPager() );
+    if( pager.isEnabled() && !sharedMap )
+    {
+	std::set<envire::MLSGrid*> used;
+	for( size_t i = 0; i < checkpointJob->maps.size(); i++ )
+	{
+	    GridAccess &map( checkpointJob->maps[i] );
+	    if( !map.isUnique() )
+	    {
+		std::vector<envire::MLSGrid*> grids = GridPager::getGrids( map.getMap() );
+		used.insert( grids.begin(), grids.end() );
+	    }
+	}
+	for( size_t i = 0; i < checkpointJob->grids.size(); i++ )
+	    pager.unpin( checkpointJob->grids[i], !used.count( checkpointJob->grids[i] ) );
+    }
+
+    checkpointJob.reset();
+}
+
+bool EmbodiedSlamFilter::needsMapLock() const
+{
+    return mappingThread || checkpointJob;
+}
+
+void EmbodiedSlamFilter::writeCheckpointFile()
+{
+    CheckpointJob &job( *checkpointJob );
+
+    // write to a temporary file first, so there is always a complete
+    // checkpoint on disk
+    const std::string tmpPath = job.path + ".tmp";
+    std::ofstream os( tmpPath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+    os.write( job.head.data(), job.head.size() );
+
+    // the hash index is rebuilt on restore, which is much faster than
+    // creating the hash from the map
+    checkpoint::write( os, static_cast<bool>( job.hash ) );
+    if( job.hash )
+    {
+	checkpoint::write( os, job.hash->config );
+	checkpoint::write( os, static_cast<boost::uint64_t>( job.hash->poses.size() ) );
+	for( size_t i = 0; i < job.hash->poses.size(); i++ )
+	    checkpoint::writeParticle( os, job.hash->poses[i] );
+	checkpoint::writeVector( os, job.hash->params );
+    }
+    os.write( job.gridCount.data(), job.gridCount.size() );
+
+    // the maps are only locked while a grid is serialized, and not while
+    // it is written to disk
+    try
+    {
+	for( size_t i = 0; i < job.grids.size(); i++ )
+	{
+	    std::string chunk;
+	    {
+		boost::lock_guard<boost::timed_mutex> lock( mapMutex );
+		if( job.pending.count( job.grids[i] ) )
+		    serializeGrid( i );
+		chunk.swap( job.chunks[i] );
+	    }
+	    os.write( chunk.data(), chunk.size() );
+	}
+    }
+    catch( const std::exception& )
+    {
+	// e.g. a paged out grid could not be read back
+	os.close();
+	std::remove( tmpPath.c_str() );
+	checkpointFailed = true;
+	return;
+    }
+
+    os.write( job.tail.data(), job.tail.size() );
+    os.close();
+
+    if( !os || rename( tmpPath.c_str(), job.path.c_str() ) != 0 )
+    {
+	std::remove( tmpPath.c_str() );
+	checkpointFailed = true;
+    }
+}
+
+void EmbodiedSlamFilter::serializeGrid( size_t index )
+{
+    CheckpointJob &job( *checkpointJob );
+    envire::MLSGrid *grid = job.grids[index];
+
+    // paged out grids are read back, and paged out again on the next
+    // update
+    GridPager &pager( filter.getPager() );
+    if( pager.isEnabled() )
+	pager.require( grid, false );
+
+    envire::Environment *env = grid->getEnvironment();
+    const Eigen::Affine3d C_grid2root = 
+	env->relativeTransform( grid->getFrameNode(), env->getRootNode() );
+
+    std::ostringstream os( std::ios::out | std::ios::binary );
+    checkpoint::write( os, C_grid2root );
+    checkpoint::writeGrid( os, *grid );
+    job.chunks[index] = os.str();
+    job.pending.erase( grid );
+}
+
+void EmbodiedSlamFilter::snapshotGrid( envire::MLSGrid* grid )
+{
+    if( !checkpointJob )
+	return;
+
+    std::map<envire::MLSGrid*, size_t>::iterator it = checkpointJob->pending.find( grid );
+    if( it != checkpointJob->pending.end() )
+	serializeGrid( it->second );
+}
+
+void EmbodiedSlamFilter::writeState( CheckpointJob& job )
+{
+    std::ostringstream os( std::ios::out | std::ios::binary );
+    checkpoint::writeHeader( os );
+
+    checkpoint::write( os, static_cast<bool>( sharedMap ) );
+    checkpoint::write( os, udPose );
+    checkpoint::write( os, mapPose );
+    checkpoint::write( os, stereoPose );
+    checkpoint::write( os, cloudPose );
+    checkpoint::write( os, static_cast<boost::uint64_t>( update_idx ) );
+
+    filter.writeState( os );
+    job.head = os.str();
+
+    // the hash is not modified, so it is written by the checkpoint thread
+    job.hash = hash;
+
+    // the shared map is part of the environment, so only the per particle
+    // maps are written. Maps and grids which are used more than once are
+    // only written once.
+    if( sharedMap )
+	return;
+
+    std::vector<eslam::PoseEstimator::Particle> &particles( getParticles() );
+    std::map<envire::MLSMap*, boost::uint32_t> mapIndex;
+    std::vector<envire::MLSMap*> maps;
+    std::vector<boost::uint32_t> particleMaps( particles.size() );
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	envire::MLSMap *map = particles[i].grid.getMap();
+	std::pair<std::map<envire::MLSMap*, boost::uint32_t>::iterator, bool> res = 
+	    mapIndex.insert( std::make_pair( map, maps.size() ) );
+	if( res.second )
+	{
+	    maps.push_back( map );
+	    job.maps.push_back( particles[i].grid );
+	}
+	particleMaps[i] = res.first->second;
+    }
+
+    std::map<envire::MLSGrid*, boost::uint32_t> gridIndex;
+    for( size_t i = 0; i < maps.size(); i++ )
+    {
+	std::vector<envire::MLSGrid*> mapGrids = GridPager::getGrids( maps[i] );
+	for( size_t g = 0; g < mapGrids.size(); g++ )
+	{
+	    if( gridIndex.insert( std::make_pair( mapGrids[g], job.grids.size() ) ).second )
+	    {
+		job.pending[mapGrids[g]] = job.grids.size();
+		job.grids.push_back( mapGrids[g] );
+	    }
+	}
+    }
+    job.chunks.resize( job.grids.size() );
+
+    // the pager must not forget spilled grids whose maps are released
+    // before they are serialized
+    GridPager &pager( filter.getPager() );
+    if( pager.isEnabled() )
+    {
+	for( size_t i = 0; i < job.grids.size(); i++ )
+	    pager.pin( job.grids[i] );
+    }
+
+    std::ostringstream layout( std::ios::out | std::ios::binary );
+    checkpoint::write( layout, static_cast<boost::uint64_t>( job.grids.size() ) );
+    job.gridCount = layout.str();
+
+    envire::Environment *env = scanMap->getEnvironment();
+    std::ostringstream tail( std::ios::out | std::ios::binary );
+    checkpoint::write( tail, static_cast<boost::uint64_t>( maps.size() ) );
+    for( size_t i = 0; i < maps.size(); i++ )
+    {
+	const Eigen::Affine3d C_map2root = 
+	    env->relativeTransform( maps[i]->getFrameNode(), env->getRootNode() );
+	checkpoint::write( tail, C_map2root );
+
+	std::vector<envire::MLSGrid*> mapGrids = GridPager::getGrids( maps[i] );
+	std::vector<boost::uint32_t> indices;
+	for( size_t g = 0; g < mapGrids.size(); g++ )
+	    indices.push_back( gridIndex[mapGrids[g]] );
+	checkpoint::writeVector( tail, indices );
+	checkpoint::write( tail, gridIndex[maps[i]->getActiveGrid().get()] );
+    }
+
+    checkpoint::writeVector( tail, particleMaps );
+    job.tail = tail.str();
+}
+
+void EmbodiedSlamFilter::restoreCheckpoint( envire::Environment* env, const std::string& path )
+{
+    // the checkpoint thread may still use the maps
+    waitForCheckpoint();
+
+    std::ifstream is( path.c_str(), std::ios::in | std::ios::binary );
+    if( !is )
+	throw std::runtime_error("Could not open the checkpoint " + path + ".");
+
+    checkpoint::readHeader( is );
+
+    bool useSharedMap;
+    checkpoint::read( is, useSharedMap );
+    checkpoint::read( is, udPose );
+    checkpoint::read( is, mapPose );
+    checkpoint::read( is, stereoPose );
+    checkpoint::read( is, cloudPose );
+    boost::uint64_t value;
+    checkpoint::read( is, value );
+    update_idx = value;
+
+    filter.readState( is );
+
+    bool useHash;
+    checkpoint::read( is, useHash );
+    if( useHash )
+    {
+	boost::shared_ptr<SurfaceHash> newHash( new SurfaceHash() );
+	checkpoint::read( is, newHash->config );
+	boost::uint64_t count;
+	checkpoint::read( is, count );
+	newHash->poses.resize( count );
+	for( size_t i = 0; i < count; i++ )
+	    checkpoint::readParticle( is, newHash->poses[i] );
+	checkpoint::readVector( is, newHash->params );
+
+	// a hash given with setSurfaceHash is used instead
+	if( !hash )
+	{
+	    newHash->buildIndex();
+	    hash = newHash;
+	}
+	filter.setSurfaceHash( hash.get() );
+    }
+
+    if( useSharedMap )
+    {
+	if( !sharedMap )
+	    sharedMap = createSharedMap( env );
+	filter.setEnvironment( env, sharedMap, true );
+    }
+    else
+    {
+	sharedMap = NULL;
+
+	boost::uint64_t count;
+	checkpoint::read( is, count );
+	std::vector<envire::MLSGrid*> grids;
+	for( size_t i = 0; i < count; i++ )
+	{
+	    Eigen::Affine3d C_grid2root;
+	    checkpoint::read( is, C_grid2root );
+	    envire::MLSGrid *grid = checkpoint::readGrid( is );
+	    grid->setHorizontalPatchThickness( eslamConfig.gridPatchThickness );
+	    grid->setGapSize( eslamConfig.gridGapSize );
+
+	    envire::FrameNode *gridNode = new envire::FrameNode();
+	    gridNode->setTransform( C_grid2root );
+	    env->addChild( env->getRootNode(), gridNode );
+	    env->setFrameNode( grid, gridNode );
+	    grids.push_back( grid );
+	}
+
+	checkpoint::read( is, count );
+	std::vector<envire::MLSMap*> maps;
+	for( size_t i = 0; i < count; i++ )
+	{
+	    Eigen::Affine3d C_map2root;
+	    checkpoint::read( is, C_map2root );
+	    std::vector<boost::uint32_t> indices;
+	    checkpoint::readVector( is, indices );
+	    boost::uint32_t active;
+	    checkpoint::read( is, active );
+
+	    MLSMap *map = new MLSMap();
+	    FrameNode *mapNode = new envire::FrameNode(); 
+	    mapNode->setTransform( C_map2root );
+	    env->addChild( env->getRootNode(), mapNode );
+	    env->setFrameNode( map, mapNode );
+
+	    // the last grid that is added becomes the active grid
+	    for( size_t g = 0; g < indices.size(); g++ )
+	    {
+		if( indices[g] >= grids.size() )
+		    throw std::runtime_error("The checkpoint contains an invalid grid index.");
+		if( indices[g] != active )
+		    map->addGrid( grids[indices[g]] );
+	    }
+	    if( active >= grids.size() )
+		throw std::runtime_error("The checkpoint contains an invalid grid index.");
+	    map->addGrid( grids[active] );
+	    maps.push_back( map );
+	}
+
+	std::vector<boost::uint32_t> particleMaps;
+	checkpoint::readVector( is, particleMaps );
+	if( particleMaps.size() != getParticles().size() )
+	    throw std::runtime_error("The checkpoint contains an invalid number of particle maps.");
+
+	std::vector<envire::MLSMap*> mapPtrs( particleMaps.size() );
+	for( size_t i = 0; i < particleMaps.size(); i++ )
+	{
+	    if( particleMaps[i] >= maps.size() )
+		throw std::runtime_error("The checkpoint contains an invalid map index.");
+	    mapPtrs[i] = maps[particleMaps[i]];
+	}
+	filter.setMaps( env, mapPtrs );
+    }
+
+    initPipeline( env );
+
+    if( eslamConfig.asyncMapping )
+	startMapping();
+}
+
 std::vector<eslam::PoseEstimator::Particle>& EmbodiedSlamFilter::getParticles()
 {
     return filter.getParticles();
@@ -16,14 +16,123 @@
 #include <envire/operators/DistanceGridToPointcloud.hpp>
 
 #include <base/samples/LaserScan.hpp>
+#include <base/samples/Pointcloud.hpp>
 
 #include <base/samples/DistanceImage.hpp>
+#include <base/samples/Frame.hpp>
 
 #include "SurfaceHash.hpp"
+#include "ScanProjection.hpp"
+#include "VoxelFilter.hpp"
+#include "UpdateScheduler.hpp"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include <string>
+#include <map>
+#include <iostream>
 
 namespace eslam 
 {
 
+/** 
+ * Input for the mapping thread. Contains the sensor data and a snapshot of
+ * the particles at the time the data was received.
+ */
+struct MappingJob
+{
+    enum Type
+    {
+	LASER_SCAN,
+	DISTANCE_IMAGE,
+	POINTCLOUD
+    };
+
+    MappingJob() : hasTexture( false ) {}
+
+    Type type;
+    Eigen::Affine3d body2odometry;
+    Eigen::Affine3d sensor2body;
+
+    base::samples::LaserScan scan;
+    base::samples::DistanceImage dimage;
+    base::samples::frame::Frame timage;
+    bool hasTexture;
+    std::vector<base::Point> points;
+
+    /** pose and map of the particles at the time of the sensor data, in
+     * processing order */
+    std::vector<eslam::PoseEstimator::Particle> particles;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/** 
+ * Checkpoint which is written by the checkpoint thread. The state of the
+ * particles is copied when the checkpoint is started, while the surface hash
+ * and the grids of the per particle maps are serialized by the checkpoint
+ * thread, the grids one at a time. A grid which is going to be merged into
+ * before that is serialized first, so the checkpoint holds the maps as they
+ * were when it was started.
+ */
+struct CheckpointJob
+{
+    std::string path;
+    /** the filter state, which is followed by the surface hash */
+    std::string head;
+    /** the surface hash, which is not modified by the filter */
+    boost::shared_ptr<const SurfaceHash> hash;
+    /** the number of grids, empty if the shared map is used */
+    std::string gridCount;
+    /** the maps and the map of each particle, which follow the grids */
+    std::string tail;
+
+    /** the grids of the per particle maps and their serialized form */
+    std::vector<envire::MLSGrid*> grids;
+    std::vector<std::string> chunks;
+    /** index of the grids which have not been serialized yet */
+    std::map<envire::MLSGrid*, size_t> pending;
+
+    /** keeps the maps in the environment until the grids are serialized */
+    std::vector<GridAccess> maps;
+};
+
+/** 
+ * Memory used by the filter in bytes, split up by category.
+ */
+struct MemoryUsage
+{
+    MemoryUsage() 
+	: particles( 0 ), maps( 0 ), pagedMaps( 0 ), debugData( 0 ), surfaceHash( 0 ), scratch( 0 ) {}
+
+    /** the particle vector, without the debug data */
+    size_t particles;
+    /** patches of the particle maps. Maps which are used by more than one
+     * particle are counted once. */
+    size_t maps;
+    /** map data which has been paged out to disk. This is not part of the
+     * total. */
+    size_t pagedMaps;
+    /** contact and slip points stored in the particles */
+    size_t debugData;
+    /** poses and index of the surface hash */
+    size_t surfaceHash;
+    /** scan grid and buffers used for projecting the sensor data */
+    size_t scratch;
+    /** for each particle its share of the map it uses plus its debug data */
+    std::vector<size_t> perParticle;
+
+    size_t getTotal() const
+    {
+	return particles + maps + debugData + surfaceHash + scratch;
+    }
+};
+
 class EmbodiedSlamFilter
 {
     eslam::Configuration eslamConfig;
@@ -33,10 +142,10 @@ class EmbodiedSlamFilter
     eslam::PoseEstimator filter;
 
     /** pose of last update an mapping step */
-    base::Affine3d udPose, mapPose, stereoPose;
+    base::Affine3d udPose, mapPose, stereoPose, cloudPose;
 
     envire::MLSMap* sharedMap;
-    SurfaceHash hash;
+    boost::shared_ptr<const SurfaceHash> hash;
 
     // store pointers to processing pipeline
     envire::FrameNode *scanFrame;
@@ -54,21 +163,200 @@ class EmbodiedSlamFilter
     envire::TriMesh *distPc;
     envire::MLSProjection *distMlsOp;
 
+    /** fused projection of the sensor data into the scanMap */
+    ScanProjection scanProjection;
+    /** downsampling of point clouds before projection */
+    VoxelFilter voxelFilter;
+    std::vector<Eigen::Vector3d> voxelPoints;
+
+    /** index of the current map update, stored in the merged patches */
+    size_t update_idx;
+
+    // asynchronous mapping
+    typedef boost::lockfree::spsc_queue<MappingJob*> MappingQueue;
+    boost::scoped_ptr<MappingQueue> mappingQueue;
+    boost::scoped_ptr<boost::thread> mappingThread;
+    /** protects the particle maps and the scan processing pipeline. Timed,
+     * so that an update with a deadline does not wait for it too long. */
+    boost::timed_mutex mapMutex;
+    /** used together with the condition variables to signal the mapping
+     * thread and the threads waiting for it */
+    boost::mutex mappingSignalMutex;
+    boost::condition_variable mappingSignal, mappingDone;
+    bool stopMappingThread;
+    size_t pendingMappingJobs;
+    size_t droppedMappingJobs;
+
+    /** decides on the measurement updates if
+     * UpdateSchedulerConfig::useScheduler is set */
+    UpdateScheduler scheduler;
+
+    /** number of measurement updates since the memory budget was checked */
+    size_t memoryCheckCount;
+
+    /** writes the last checkpoint to disk */
+    boost::scoped_ptr<boost::thread> checkpointThread;
+    /** the last checkpoint, protected by mapMutex while it is written */
+    boost::scoped_ptr<CheckpointJob> checkpointJob;
+    bool checkpointFailed;
+
+    void mapParticles( std::vector<eslam::PoseEstimator::Particle>& particles, 
+	    size_t begin, size_t end, envire::MLSGrid* scanMap, bool match, bool update,
+	    const std::vector<size_t>* order = NULL );
+    void projectLaserScan( const Eigen::Affine3d& body2odometry, const base::samples::LaserScan& scan, const Eigen::Affine3d& laser2body );
+    void projectDistanceImage( const Eigen::Affine3d& body2odometry, const base::samples::DistanceImage& dimage, const Eigen::Affine3d& camera2body, const base::samples::frame::Frame* timage );
+    void updateDistancePointcloud( const base::samples::DistanceImage& dimage, const base::samples::frame::Frame* timage );
+    void projectPointcloud( const Eigen::Affine3d& body2odometry, const std::vector<base::Point>& points, const Eigen::Affine3d& sensor2body );
+    envire::TransformWithUncertainty getSensorTransform( const Eigen::Affine3d& body2odometry, const Eigen::Affine3d& sensor2body );
+    envire::TransformWithUncertainty getScanGridTransform( const envire::TransformWithUncertainty& sensor2frame );
+
+    envire::MLSMap* createSharedMap( envire::Environment* env );
+    void initPipeline( envire::Environment* env );
+
+    void writeState( CheckpointJob& job );
+    void writeCheckpointFile();
+    /** serialize a grid of the checkpoint, needs mapMutex */
+    void serializeGrid( size_t index );
+    /** serialize the grid if it is part of the checkpoint and has not been
+     * serialized yet. Called before the grid is modified. */
+    void snapshotGrid( envire::MLSGrid* grid );
+    /** release the maps of the written checkpoint */
+    void releaseCheckpoint();
+    /** true if the particle maps are used by another thread, in which case
+     * mapMutex needs to be held */
+    bool needsMapLock() const;
+
+    MemoryUsage computeMemoryUsage();
+    void enforceMemoryBudget();
+
+    void enqueueMappingJob( MappingJob* job );
+    void mappingLoop();
+    void processMappingJob( MappingJob& job );
+    /** throw if the sensor is further away from the body than
+     * Configuration::maxSensorOffset */
+    void checkSensorOffset( const Eigen::Affine3d& sensor2body ) const;
+    /** delete a job on the mapping thread, see mapMutex */
+    void deleteMappingJob( MappingJob* job );
+
 public:
     EmbodiedSlamFilter(
 	const odometry::Configuration& odometryConfig, 
 	const eslam::Configuration& eslamConfig );
+    ~EmbodiedSlamFilter();
 
     envire::MLSMap* createMapTemplate( envire::Environment* env, const base::Pose& origin = base::Pose() );
     envire::MultiLevelSurfaceGrid* createGridTemplate( envire::Environment* env );
+    envire::MultiLevelSurfaceGrid* createGridTemplate( envire::Environment* env, double size );
+    /** create the grid the sensor data is projected into before being
+     * merged with the particle maps. The size of the grid is limited to the
+     * region that can be reached by the sensors.
+     */
+    envire::MultiLevelSurfaceGrid* createScanGridTemplate( envire::Environment* env );
     void init( envire::Environment* env, const base::Pose& pose, bool useSharedMap = true, const SurfaceHashConfig& hashConfig = SurfaceHashConfig() );
 
+    /** 
+     * use the given map as the shared prior map instead of the first grid of
+     * the environment. Needs to be called before init(). The map is only
+     * read by the filter, so the same map can be used by several filters in
+     * the same environment, e.g. the one returned by getSharedMap() of
+     * another filter. Since envire environments are not thread-safe, the
+     * filters need to be initialized one after the other.
+     */
+    void setSharedMap( envire::MLSMap* map );
+    envire::MLSMap* getSharedMap() const;
+
+    /** 
+     * use the given surface hash instead of creating one in init(). The
+     * hash is not modified by the filter and can be shared between filters.
+     * Needs to be called before init().
+     */
+    void setSurfaceHash( boost::shared_ptr<const SurfaceHash> hash );
+    boost::shared_ptr<const SurfaceHash> getSurfaceHash() const;
+
     void processMap( envire::MLSGrid* scanMap, bool match, bool update );
     bool update( const Eigen::Affine3d& body2odometry, const base::samples::LaserScan& scan, const Eigen::Affine3d& laser2body );
     bool update( const Eigen::Affine3d& body2odometry, const base::samples::DistanceImage& dimage, const Eigen::Affine3d& camera2body, const base::samples::frame::Frame* timage = NULL );
+    /**
+     * Update the maps with a 3d point cloud, e.g. from a multi-beam lidar.
+     * The points are downsampled using a voxel grid of
+     * Configuration::voxelSize before they are projected. Uses the
+     * mappingThreshold to decide if the input is used.
+     */
+    bool update( const Eigen::Affine3d& body2odometry, const base::samples::Pointcloud& pc, const Eigen::Affine3d& sensor2body );
     bool update( const Eigen::Affine3d& body2odometry, const odometry::BodyContactState& bs, const std::vector<terrain_estimator::TerrainClassification>& ltc );
+    /**
+     * Same as the update above, but the weight update stops evaluating
+     * particles once the deadline has passed. Use getCompletedFraction() to
+     * check how many particles were evaluated. After the deadline, the
+     * resampling, the cloning of the maps and the memory budget check are
+     * deferred to a later update, while the projection and normalization
+     * of the weights, which are linear in the number of particles, still
+     * run.
+     *
+     * If the mapping thread holds the maps until the deadline, the contact
+     * state is dropped and false is returned.
+     */
+    bool update( const Eigen::Affine3d& body2odometry, const odometry::BodyContactState& bs, const std::vector<terrain_estimator::TerrainClassification>& ltc, const base::Time& deadline );
     bool update( envire::Featurecloud *stereo_features );
 
+    /** 
+     * start the mapping thread. Laser scans and distance images are then
+     * queued and merged into the particle maps in the background. This is
+     * done automatically by init() if Configuration::asyncMapping is set.
+     * Laser scans with Configuration::useVisualUpdate are still processed
+     * synchronously, after waiting for the queued input.
+     */
+    void startMapping();
+    /** stop the mapping thread, discarding any queued mapping input */
+    void stopMapping();
+    /** block until the mapping thread has processed all queued input */
+    void waitForMapping();
+    /** number of mapping inputs which were dropped because the queue was full */
+    size_t getDroppedMappingJobs() const;
+
+    /**
+     * write a checkpoint of the filter to the given file. The state of the
+     * particles is copied in the calling thread, while the maps and the
+     * surface hash are serialized and written to disk in the background,
+     * see CheckpointJob.
+     * The checkpoint contains the particles, the state of the random
+     * generators, the last update poses, the per particle maps and the
+     * surface hash. The shared map is expected to be part of the
+     * environment the filter is restored in. The odometry state and sensor
+     * data which is still queued for the mapping thread are not included.
+     */
+    void writeCheckpoint( const std::string& path );
+    /** 
+     * block until the last checkpoint has been written.
+     * @result false if the checkpoint could not be written
+     */
+    bool waitForCheckpoint();
+    /** 
+     * restore the filter from a checkpoint. This is used instead of init().
+     */
+    void restoreCheckpoint( envire::Environment* env, const std::string& path );
+
+    /** 
+     * memory used by the filter. This needs to iterate over all cells of
+     * the particle maps, so it should not be called too often.
+     */
+    MemoryUsage getMemoryUsage();
+
+    /** paging of the per particle maps, see Configuration::pagingRadius */
+    GridPager& getGridPager();
+
+    /** scheduling of the measurement updates, see
+     * Configuration::updateScheduler */
+    const UpdateScheduler& getUpdateScheduler() const;
+
+    /** cache of the contact model evaluations, see
+     * Configuration::useLikelihoodCache */
+    const LikelihoodCache& getLikelihoodCache() const;
+
+    /** fraction of the particles evaluated in the last weight update, see
+     * update() with a deadline */
+    double getCompletedFraction() const;
+
     std::vector<eslam::PoseEstimator::Particle>& getParticles();
     size_t getBestParticleIndex() const;
     base::Affine3d getCentroid();
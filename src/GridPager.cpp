@@ -0,0 +1,510 @@
+#include "GridPager.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <list>
+
+#include <unistd.h>
+
+using namespace eslam;
+
+namespace
+{
+template <class T>
+void writeValue( FILE* file, const T& value )
+{
+    if( fwrite( &value, sizeof( T ), 1, file ) != 1 )
+	throw std::runtime_error( "could not write to the spill file." );
+}
+
+template <class T>
+void readValue( FILE* file, T& value )
+{
+    if( fread( &value, sizeof( T ), 1, file ) != 1 )
+	throw std::runtime_error( "could not read from the spill file." );
+}
+
+/** size of a patch and its cell indices in the spill file */
+const long PATCH_RECORD_SIZE = 
+    2 * sizeof( boost::uint32_t ) + 3 * sizeof( float ) + 2 * sizeof( boost::uint8_t )
+    + sizeof( boost::uint64_t ) + 3 * sizeof( double );
+
+/** 
+ * write the fields of a patch one by one, so the record does not depend on
+ * the padding of the struct and does not contain uninitialized bytes
+ */
+void writePatch( FILE* file, size_t m, size_t n, const envire::MLSGrid::SurfacePatch& patch )
+{
+    writeValue( file, static_cast<boost::uint32_t>( m ) );
+    writeValue( file, static_cast<boost::uint32_t>( n ) );
+    writeValue( file, patch.mean );
+    writeValue( file, patch.stdev );
+    writeValue( file, patch.height );
+    writeValue( file, static_cast<boost::uint8_t>( patch.isHorizontal() ) );
+    writeValue( file, static_cast<boost::uint8_t>( patch.isVertical() ) );
+    writeValue( file, static_cast<boost::uint64_t>( patch.update_idx ) );
+    const Eigen::Vector3d color = patch.getColor();
+    for( int i = 0; i < 3; i++ )
+	writeValue( file, color[i] );
+}
+
+void readPatch( FILE* file, boost::uint32_t& m, boost::uint32_t& n, envire::MLSGrid::SurfacePatch& patch )
+{
+    boost::uint8_t horizontal, vertical;
+    boost::uint64_t update_idx;
+    Eigen::Vector3d color;
+    readValue( file, m );
+    readValue( file, n );
+    readValue( file, patch.mean );
+    readValue( file, patch.stdev );
+    readValue( file, patch.height );
+    readValue( file, horizontal );
+    readValue( file, vertical );
+    readValue( file, update_idx );
+    for( int i = 0; i < 3; i++ )
+	readValue( file, color[i] );
+
+    if( horizontal )
+	patch.setHorizontal();
+    else if( vertical )
+	patch.setVertical();
+    else
+	patch.setNegative();
+    patch.update_idx = update_idx;
+    patch.setColor( color );
+}
+}
+
+GridPager::GridPager()
+    : radius( 0 ),
+    budget( 0 ),
+    spillFile( NULL ),
+    spillSize( 0 ),
+    staleSize( 0 ),
+    tick( 0 ),
+    hits( 0 ),
+    misses( 0 ),
+    evictions( 0 )
+{
+}
+
+GridPager::~GridPager()
+{
+    if( spillFile )
+	fclose( spillFile );
+}
+
+void GridPager::setRadius( double radius )
+{
+    this->radius = radius;
+}
+
+double GridPager::getRadius() const
+{
+    return radius;
+}
+
+void GridPager::setBudget( size_t bytes )
+{
+    budget = bytes;
+}
+
+void GridPager::setSpillFile( const std::string& path )
+{
+    spillPath = path;
+}
+
+void GridPager::beginRound()
+{
+    tick++;
+}
+
+std::vector<envire::MLSGrid*> GridPager::getGrids( envire::MLSMap* map )
+{
+    std::vector<envire::MLSGrid*> result;
+    std::list<envire::Layer*> children = map->getEnvironment()->getChildren( map );
+    for( std::list<envire::Layer*>::iterator it = children.begin(); it != children.end(); it++ )
+    {
+	envire::MLSGrid *grid = dynamic_cast<envire::MLSGrid*>( *it );
+	if( grid )
+	    result.push_back( grid );
+    }
+    return result;
+}
+
+size_t GridPager::getGridBytes( envire::MLSGrid* grid )
+{
+    size_t patches = 0;
+    for( size_t m = 0; m < grid->getWidth(); m++ )
+    {
+	for( size_t n = 0; n < grid->getHeight(); n++ )
+	{
+	    for( envire::MLSGrid::iterator it = grid->beginCell( m, n ); it != grid->endCell(); it++ )
+		patches++;
+	}
+    }
+    return patches * sizeof( envire::MLSGrid::SurfacePatch );
+}
+
+GridPager::Entry& GridPager::getEntry( envire::MLSGrid* grid )
+{
+    EntryMap::iterator it = entries.find( grid );
+    if( it != entries.end() )
+	return it->second;
+
+    // the frames of the grids don't change once they are created, so the
+    // transform is only calculated once
+    Entry &entry( entries[grid] );
+    envire::Environment *env = grid->getEnvironment();
+    const Eigen::Affine3d C_root2grid = 
+	env->relativeTransform( env->getRootNode(), grid->getFrameNode() );
+    entry.R_root2grid = C_root2grid.linear();
+    entry.t_root2grid = C_root2grid.translation();
+
+    entry.minX = grid->getOffsetX();
+    entry.minY = grid->getOffsetY();
+    entry.maxX = entry.minX + grid->getWidth() * grid->getScaleX();
+    entry.maxY = entry.minY + grid->getHeight() * grid->getScaleY();
+
+    return entry;
+}
+
+void GridPager::update( envire::MLSMap* map, const Eigen::Vector3d& position )
+{
+    std::vector<envire::MLSGrid*> grids = getGrids( map );
+    for( size_t i = 0; i < grids.size(); i++ )
+    {
+	envire::MLSGrid *grid = grids[i];
+	Entry &entry( getEntry( grid ) );
+
+	// distance of the position to the area covered by the grid
+	const Eigen::Vector3d p = entry.R_root2grid * position + entry.t_root2grid;
+	const double dx = std::max( 0.0, std::max( entry.minX - p.x(), p.x() - entry.maxX ) );
+	const double dy = std::max( 0.0, std::max( entry.minY - p.y(), p.y() - entry.maxY ) );
+
+	if( dx*dx + dy*dy <= radius*radius )
+	    touch( grid, entry );
+	else if( !entry.spilled )
+	    spill( grid, entry );
+    }
+}
+
+void GridPager::require( envire::MLSGrid* grid, bool modify )
+{
+    Entry &entry( getEntry( grid ) );
+    touch( grid, entry );
+
+    // the record in the spill file is outdated once the grid is modified
+    if( modify )
+    {
+	releaseRecord( entry.offset );
+	entry.offset = -1;
+	entry.stale = true;
+    }
+}
+
+void GridPager::touch( envire::MLSGrid* grid, Entry& entry )
+{
+    if( entry.spilled )
+    {
+	restore( grid, entry );
+	misses++;
+    }
+    else
+	hits++;
+
+    entry.lastAccess = tick;
+}
+
+void GridPager::cloned( envire::MLSMap* orig, envire::MLSMap* clone )
+{
+    std::vector<envire::MLSGrid*> origGrids = getGrids( orig );
+    std::vector<envire::MLSGrid*> cloneGrids = getGrids( clone );
+
+    for( size_t i = 0; i < cloneGrids.size(); i++ )
+    {
+	// the cloned grids share the frame nodes with the original, otherwise
+	// rely on the order of the grids
+	envire::MLSGrid *source = NULL;
+	for( size_t j = 0; j < origGrids.size() && !source; j++ )
+	{
+	    if( origGrids[j]->getFrameNode() == cloneGrids[i]->getFrameNode() )
+		source = origGrids[j];
+	}
+	if( !source && i < origGrids.size() )
+	    source = origGrids[i];
+
+	EntryMap::iterator it = entries.find( source );
+	if( it != entries.end() )
+	{
+	    // the clone shares the record of the original
+	    Entry &entry( entries[cloneGrids[i]] );
+	    releaseRecord( entry.offset );
+	    entry = it->second;
+	    entry.pinned = false;
+	    retainRecord( entry.offset );
+	}
+	else
+	    removeEntry( cloneGrids[i] );
+    }
+}
+
+void GridPager::sweep( const std::set<envire::MLSMap*>& maps )
+{
+    std::set<envire::MLSGrid*> used;
+    for( std::set<envire::MLSMap*>::const_iterator it = maps.begin(); it != maps.end(); it++ )
+    {
+	std::vector<envire::MLSGrid*> grids = getGrids( *it );
+	used.insert( grids.begin(), grids.end() );
+    }
+
+    for( EntryMap::iterator it = entries.begin(); it != entries.end(); )
+    {
+	if( used.count( it->first ) || it->second.pinned )
+	    it++;
+	else
+	{
+	    releaseRecord( it->second.offset );
+	    entries.erase( it++ );
+	}
+    }
+}
+
+void GridPager::pin( envire::MLSGrid* grid )
+{
+    getEntry( grid ).pinned = true;
+}
+
+void GridPager::unpin( envire::MLSGrid* grid, bool released )
+{
+    if( released )
+	removeEntry( grid );
+    else
+    {
+	EntryMap::iterator it = entries.find( grid );
+	if( it != entries.end() )
+	    it->second.pinned = false;
+    }
+}
+
+void GridPager::removeEntry( envire::MLSGrid* grid )
+{
+    EntryMap::iterator it = entries.find( grid );
+    if( it == entries.end() )
+	return;
+
+    releaseRecord( it->second.offset );
+    entries.erase( it );
+}
+
+void GridPager::enforceBudget()
+{
+    if( !budget )
+	return;
+
+    // Grids that were used in this round are not spilled. Their size is
+    // not measured either, since the active grids are modified all the time.
+    size_t resident = 0;
+    std::vector<std::pair<boost::uint64_t, envire::MLSGrid*> > candidates;
+    for( EntryMap::iterator it = entries.begin(); it != entries.end(); it++ )
+    {
+	Entry &entry( it->second );
+	if( entry.spilled )
+	    continue;
+
+	if( entry.lastAccess != tick )
+	{
+	    if( entry.stale )
+	    {
+		entry.bytes = getGridBytes( it->first );
+		entry.stale = false;
+	    }
+	    candidates.push_back( std::make_pair( entry.lastAccess, it->first ) );
+	}
+	resident += entry.bytes;
+    }
+
+    // spill the least recently used grids first
+    std::sort( candidates.begin(), candidates.end() );
+    for( size_t i = 0; i < candidates.size() && resident > budget; i++ )
+    {
+	Entry &entry( entries[candidates[i].second] );
+	resident -= entry.bytes;
+	spill( candidates[i].second, entry );
+    }
+}
+
+size_t GridPager::getResidentBytes() const
+{
+    size_t resident = 0;
+    for( EntryMap::const_iterator it = entries.begin(); it != entries.end(); it++ )
+    {
+	if( !it->second.spilled )
+	    resident += it->second.bytes;
+    }
+    return resident;
+}
+
+size_t GridPager::getSpilledBytes() const
+{
+    size_t spilled = 0;
+    for( EntryMap::const_iterator it = entries.begin(); it != entries.end(); it++ )
+    {
+	if( it->second.spilled )
+	    spilled += it->second.bytes;
+    }
+    return spilled;
+}
+
+size_t GridPager::getSpillFileSize() const
+{
+    return spillSize;
+}
+
+void GridPager::retainRecord( long offset )
+{
+    if( offset >= 0 )
+	records[offset].refs++;
+}
+
+void GridPager::releaseRecord( long offset )
+{
+    if( offset < 0 )
+	return;
+
+    RecordMap::iterator it = records.find( offset );
+    if( it == records.end() )
+	return;
+
+    // a record which is not used by any grid anymore is only reclaimed when
+    // the file is compacted
+    if( --it->second.refs == 0 )
+    {
+	staleSize += it->second.size;
+	records.erase( it );
+    }
+}
+
+void GridPager::compactSpillFile()
+{
+    // move the used records to the front of the file. They are moved in the
+    // order of their offsets, so a record is never written over one that
+    // still needs to be moved.
+    std::map<long, long> moved;
+    RecordMap compacted;
+    std::vector<char> buffer;
+    long end = 0;
+    for( RecordMap::iterator it = records.begin(); it != records.end(); it++ )
+    {
+	const long size = it->second.size;
+	if( it->first != end )
+	{
+	    buffer.resize( size );
+	    if( fseek( spillFile, it->first, SEEK_SET ) != 0 
+		    || fread( &buffer[0], 1, size, spillFile ) != static_cast<size_t>( size ) )
+		throw std::runtime_error( "could not read from the spill file." );
+	    if( fseek( spillFile, end, SEEK_SET ) != 0 
+		    || fwrite( &buffer[0], 1, size, spillFile ) != static_cast<size_t>( size ) )
+		throw std::runtime_error( "could not write to the spill file." );
+	}
+	moved[it->first] = end;
+	compacted[end] = it->second;
+	end += size;
+    }
+
+    for( EntryMap::iterator it = entries.begin(); it != entries.end(); it++ )
+    {
+	if( it->second.offset >= 0 )
+	    it->second.offset = moved[it->second.offset];
+    }
+
+    records.swap( compacted );
+    spillSize = end;
+    staleSize = 0;
+
+    if( fflush( spillFile ) != 0 || ftruncate( fileno( spillFile ), spillSize ) != 0 )
+	throw std::runtime_error( "could not truncate the spill file." );
+}
+
+void GridPager::openSpillFile()
+{
+    if( spillFile )
+	return;
+
+    if( spillPath.empty() )
+	spillFile = tmpfile();
+    else
+	spillFile = fopen( spillPath.c_str(), "w+b" );
+
+    if( !spillFile )
+	throw std::runtime_error( "could not open the spill file for the grid pager." );
+}
+
+void GridPager::spill( envire::MLSGrid* grid, Entry& entry )
+{
+    if( entry.offset < 0 )
+    {
+	openSpillFile();
+
+	// the file is compacted once the records which are not used anymore
+	// take more space than the used ones
+	if( staleSize > spillSize - staleSize )
+	    compactSpillFile();
+
+	// write the number of patches, followed by the patches and their
+	// cell indices
+	boost::uint64_t count = 0;
+	if( fseek( spillFile, spillSize, SEEK_SET ) != 0 )
+	    throw std::runtime_error( "could not write to the spill file." );
+	writeValue( spillFile, count );
+
+	for( size_t m = 0; m < grid->getWidth(); m++ )
+	{
+	    for( size_t n = 0; n < grid->getHeight(); n++ )
+	    {
+		for( envire::MLSGrid::iterator it = grid->beginCell( m, n ); it != grid->endCell(); it++ )
+		{
+		    writePatch( spillFile, m, n, *it );
+		    count++;
+		}
+	    }
+	}
+
+	if( fseek( spillFile, spillSize, SEEK_SET ) != 0 )
+	    throw std::runtime_error( "could not write to the spill file." );
+	writeValue( spillFile, count );
+
+	entry.offset = spillSize;
+	entry.bytes = count * sizeof( envire::MLSGrid::SurfacePatch );
+	Record &record( records[entry.offset] );
+	record.size = sizeof( count ) + count * PATCH_RECORD_SIZE;
+	record.refs = 1;
+	spillSize += record.size;
+    }
+
+    grid->clear();
+    entry.spilled = true;
+    entry.stale = false;
+    evictions++;
+}
+
+void GridPager::restore( envire::MLSGrid* grid, Entry& entry )
+{
+    boost::uint64_t count = 0;
+    if( fseek( spillFile, entry.offset, SEEK_SET ) != 0 )
+	throw std::runtime_error( "could not read from the spill file." );
+    readValue( spillFile, count );
+
+    // the patches are stored in the order of the cells, so appending them
+    // restores the grid as it was
+    grid->clear();
+    boost::uint32_t m, n;
+    envire::MLSGrid::SurfacePatch patch;
+    for( boost::uint64_t i = 0; i < count; i++ )
+    {
+	readPatch( spillFile, m, n, patch );
+	grid->insertTail( m, n, patch );
+    }
+
+    entry.spilled = false;
+}
@@ -0,0 +1,201 @@
+#ifndef __ESLAM_GRIDPAGER_HPP__
+#define __ESLAM_GRIDPAGER_HPP__
+
+#include <envire/Core.hpp>
+#include <envire/maps/MLSMap.hpp>
+#include <envire/maps/MLSGrid.hpp>
+
+#include <Eigen/Core>
+#include <boost/cstdint.hpp>
+
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace eslam
+{
+
+/**
+ * Paging of the grids of the per particle maps.
+ *
+ * Grids which are further than a given radius away from the particle that
+ * owns them are written to a spill file and cleared, which releases the
+ * memory of the patches. When the particle comes close to the grid again, the
+ * content is read back. Additionally, a memory budget can be given, in which
+ * case the least recently used grids are spilled until the resident grids
+ * fit into the budget.
+ *
+ * Records in the spill file are never modified, so a spilled grid and its
+ * clones can share the same record. A grid that was read back and not
+ * modified afterwards is spilled again without writing a new record. Once
+ * the records which are not used by any grid take more space than the used
+ * ones, the spill file is compacted.
+ */
+class GridPager
+{
+public:
+    GridPager();
+    ~GridPager();
+
+    /** grids whose extent is further away than this from the particle are
+     * spilled. A value of 0 disables paging. */
+    void setRadius( double radius );
+    double getRadius() const;
+
+    /** maximum number of bytes used by resident grids. 0 for no limit. */
+    void setBudget( size_t bytes );
+
+    /** path of the spill file. If empty, an anonymous temporary file is
+     * used. Needs to be set before the first grid is spilled. */
+    void setSpillFile( const std::string& path );
+
+    bool isEnabled() const { return radius > 0; }
+
+    /** 
+     * start a new paging round. Grids which are used within a round are not
+     * spilled by enforceBudget().
+     */
+    void beginRound();
+
+    /**
+     * make sure the grids of the map within the radius of position are
+     * resident, and spill the ones outside of the radius.
+     *
+     * @param map - particle map
+     * @param position - position of the particle in the root frame
+     */
+    void update( envire::MLSMap* map, const Eigen::Vector3d& position );
+
+    /** 
+     * make sure the given grid is resident.
+     *
+     * @param modify - set to true if the grid is going to be modified
+     */
+    void require( envire::MLSGrid* grid, bool modify = true );
+
+    /**
+     * register the grids of a map that was cloned from orig. The grids of
+     * both maps are matched by their order.
+     */
+    void cloned( envire::MLSMap* orig, envire::MLSMap* clone );
+
+    /**
+     * remove all entries for grids that are not part of the given maps.
+     * Needs to be called after maps were released, since the memory of
+     * released grids may be reused.
+     */
+    void sweep( const std::set<envire::MLSMap*>& maps );
+
+    /** 
+     * keep the entry of the grid in sweep(), even if its map is not used
+     * anymore. This is needed while the map is still referenced elsewhere,
+     * e.g. by a checkpoint which is being written, since the content of a
+     * spilled grid would be lost otherwise.
+     */
+    void pin( envire::MLSGrid* grid );
+    /** 
+     * undo pin(). If the grid is going to be released, the entry is
+     * removed right away, since its memory may be reused before the next
+     * sweep().
+     */
+    void unpin( envire::MLSGrid* grid, bool released );
+
+    /** spill least recently used grids until the budget is met */
+    void enforceBudget();
+
+    /** number of bytes of the patches and cells of the resident grids */
+    size_t getResidentBytes() const;
+    /** number of bytes of the patches of the grids which are spilled */
+    size_t getSpilledBytes() const;
+    /** number of bytes used in the spill file, including records which are
+     * not used anymore */
+    size_t getSpillFileSize() const;
+
+    /** number of times a grid was required and resident */
+    size_t getHits() const { return hits; }
+    /** number of times a grid was required and had to be read back */
+    size_t getMisses() const { return misses; }
+    /** number of times a grid was spilled */
+    size_t getEvictions() const { return evictions; }
+
+    /** memory used by the patches of the given grid */
+    static size_t getGridBytes( envire::MLSGrid* grid );
+
+    /** return the grids that belong to a map */
+    static std::vector<envire::MLSGrid*> getGrids( envire::MLSMap* map );
+
+private:
+    GridPager( const GridPager& );
+    GridPager& operator=( const GridPager& );
+
+    struct Entry
+    {
+	Entry() : spilled( false ), stale( true ), pinned( false ), offset( -1 ), bytes( 0 ), lastAccess( 0 ) {}
+
+	bool spilled;
+	/** the grid may have changed since bytes was calculated */
+	bool stale;
+	/** the entry is kept by sweep() */
+	bool pinned;
+	/** offset of the record in the spill file, or -1 if the grid has
+	 * been modified since it was written */
+	long offset;
+	size_t bytes;
+	boost::uint64_t lastAccess;
+
+	/** transform from the root frame to the grid frame */
+	Eigen::Matrix3d R_root2grid;
+	Eigen::Vector3d t_root2grid;
+	/** extents of the grid in the grid frame */
+	double minX, minY, maxX, maxY;
+    };
+
+    typedef std::map<envire::MLSGrid*, Entry> EntryMap;
+
+    /** record in the spill file, which may be shared by several grids */
+    struct Record
+    {
+	Record() : size( 0 ), refs( 0 ) {}
+
+	/** number of bytes of the record in the file */
+	long size;
+	/** number of entries which use the record */
+	size_t refs;
+    };
+
+    typedef std::map<long, Record> RecordMap;
+
+    Entry& getEntry( envire::MLSGrid* grid );
+    void removeEntry( envire::MLSGrid* grid );
+    void spill( envire::MLSGrid* grid, Entry& entry );
+    void restore( envire::MLSGrid* grid, Entry& entry );
+    void touch( envire::MLSGrid* grid, Entry& entry );
+    void openSpillFile();
+
+    void retainRecord( long offset );
+    void releaseRecord( long offset );
+    /** move the used records to the front of the spill file and update
+     * the offsets of the entries */
+    void compactSpillFile();
+
+    double radius;
+    size_t budget;
+    std::string spillPath;
+    FILE *spillFile;
+    long spillSize;
+    /** number of bytes of the records which are not used anymore */
+    long staleSize;
+
+    EntryMap entries;
+    /** used records by their offset */
+    RecordMap records;
+    boost::uint64_t tick;
+
+    size_t hits, misses, evictions;
+};
+
+}
+
+#endif
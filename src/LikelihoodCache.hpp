@@ -0,0 +1,134 @@
+#ifndef __ESLAM_LIKELIHOODCACHE_HPP__
+#define __ESLAM_LIKELIHOODCACHE_HPP__
+
+#include "ContactModel.hpp"
+
+#include <boost/cstdint.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <cmath>
+
+namespace eslam
+{
+
+/**
+ * Results of the contact model evaluation for a single measurement update,
+ * binned by the quantized pose of the particles.
+ *
+ * Particles which fall into the same bin are evaluated only once. This is
+ * only valid if the particles use the same map, and the cache needs to be
+ * cleared for each new contact state.
+ *
+ * The cache is not synchronized. Entries are returned as copies, so that a
+ * lock around each call is sufficient when it is used from several threads.
+ */
+class LikelihoodCache
+{
+public:
+    struct Key
+    {
+	boost::int64_t v[5];
+
+	bool operator==( const Key& other ) const
+	{
+	    for( int i = 0; i < 5; i++ )
+		if( v[i] != other.v[i] )
+		    return false;
+	    return true;
+	}
+    };
+
+    struct Entry
+    {
+	/** result of evaluatePose */
+	bool found;
+	ContactModelResult result;
+    };
+
+    LikelihoodCache()
+	: resolution( 0.01 ), angularResolution( 0.01 ), hits( 0 ), lookups( 0 ) {}
+
+    /**
+     * @param resolution - bin size in m for the position, height and
+     *                     height sigma
+     * @param angularResolution - bin size in rad for the heading
+     */
+    void setResolution( double resolution, double angularResolution )
+    {
+	this->resolution = resolution;
+	this->angularResolution = angularResolution;
+    }
+
+    Key getKey( double x, double y, double yaw, double z, double zSigma ) const
+    {
+	Key key;
+	key.v[0] = quantize( x, resolution );
+	key.v[1] = quantize( y, resolution );
+	key.v[2] = quantize( yaw, angularResolution );
+	key.v[3] = quantize( z, resolution );
+	key.v[4] = quantize( zSigma, resolution );
+	return key;
+    }
+
+    /** 
+     * copy the entry for the key to entry.
+     * @result false if there is no entry for the key 
+     */
+    bool find( const Key& key, Entry& entry )
+    {
+	lookups++;
+	Entries::const_iterator it = entries.find( key );
+	if( it == entries.end() )
+	    return false;
+	hits++;
+	entry = it->second;
+	return true;
+    }
+
+    /** true if there is an entry for the key, without counting a lookup */
+    bool contains( const Key& key ) const
+    {
+	return entries.count( key ) > 0;
+    }
+
+    /** add the entry, unless there already is one for the key */
+    void insert( const Key& key, const Entry& entry )
+    {
+	entries.insert( std::make_pair( key, entry ) );
+    }
+
+    /** remove all entries, but keep the statistics */
+    void clear() { entries.clear(); }
+
+    size_t getHits() const { return hits; }
+    size_t getLookups() const { return lookups; }
+    double getHitRate() const { return lookups > 0 ? static_cast<double>( hits ) / lookups : 0.0; }
+    void resetStats() { hits = lookups = 0; }
+
+    struct KeyHash
+    {
+	size_t operator()( const Key& key ) const
+	{
+	    size_t seed = 0;
+	    for( int i = 0; i < 5; i++ )
+		boost::hash_combine( seed, key.v[i] );
+	    return seed;
+	}
+    };
+
+private:
+    typedef boost::unordered_map<Key, Entry, KeyHash> Entries;
+
+    static boost::int64_t quantize( double value, double res )
+    {
+	return static_cast<boost::int64_t>( floor( value / res ) );
+    }
+
+    double resolution, angularResolution;
+    Entries entries;
+    size_t hits, lookups;
+};
+
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef __ESLAM_MORTONORDER_HPP__
+#define __ESLAM_MORTONORDER_HPP__
+
+#include <boost/cstdint.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace eslam
+{
+
+/**
+ * Order of the particles along a Morton (z-order) curve over their x and y
+ * position.
+ *
+ * Particles which are next to each other in this order are also close in
+ * space, so evaluating them in this order accesses the same grid cells in
+ * succession. The particles themselves are not moved, instead a permutation
+ * is kept, which is updated with a radix sort on the quantized positions.
+ * The sort is stable and starts from the previous order, so particles with
+ * the same key keep their relative order between updates.
+ */
+class MortonOrder
+{
+public:
+    /** interleave the bits of x and y, with x in the even bits */
+    static boost::uint32_t getKey( boost::uint16_t x, boost::uint16_t y )
+    {
+	return spread( x ) | (spread( y ) << 1);
+    }
+
+    /**
+     * sort the particles along the curve.
+     *
+     * @param particles - particles with a position field
+     * @param resolution - size of the cells of the curve. Particles within
+     *                     the same cell have no defined order. The
+     *                     resolution is reduced if the extent of the
+     *                     particles does not fit into 16 bits per axis.
+     */
+    template <class Particle>
+    void update( const std::vector<Particle>& particles, double resolution )
+    {
+	const size_t n = particles.size();
+	if( order.size() != n )
+	    setIdentity( n );
+	if( n == 0 )
+	    return;
+
+	double minX = particles[0].position.x(), minY = particles[0].position.y();
+	double maxX = minX, maxY = minY;
+	for( size_t i = 1; i < n; i++ )
+	{
+	    minX = std::min( minX, particles[i].position.x() );
+	    minY = std::min( minY, particles[i].position.y() );
+	    maxX = std::max( maxX, particles[i].position.x() );
+	    maxY = std::max( maxY, particles[i].position.y() );
+	}
+
+	const double extent = std::max( maxX - minX, maxY - minY );
+	const double scale = 1.0 / std::max( resolution, extent / 65535.0 );
+
+	keys.resize( n );
+	for( size_t i = 0; i < n; i++ )
+	{
+	    // NaN positions end up in cell 0
+	    const double x = (particles[i].position.x() - minX) * scale;
+	    const double y = (particles[i].position.y() - minY) * scale;
+	    keys[i] = getKey(
+		    x > 0 ? static_cast<boost::uint16_t>( std::min( x, 65535.0 ) ) : 0,
+		    y > 0 ? static_cast<boost::uint16_t>( std::min( y, 65535.0 ) ) : 0 );
+	}
+
+	sort();
+    }
+
+    /** reset to the identity permutation for n particles */
+    void setIdentity( size_t n )
+    {
+	order.resize( n );
+	for( size_t i = 0; i < n; i++ )
+	    order[i] = i;
+    }
+
+    /** indices of the particles in the order of the curve */
+    const std::vector<size_t>& getOrder() const { return order; }
+
+private:
+    static boost::uint32_t spread( boost::uint32_t v )
+    {
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+    }
+
+    /** LSD radix sort of order by keys, 8 bits per pass */
+    void sort()
+    {
+	const size_t n = order.size();
+	buffer.resize( n );
+	for( int shift = 0; shift < 32; shift += 8 )
+	{
+	    size_t count[257] = { 0 };
+	    for( size_t i = 0; i < n; i++ )
+		count[ ((keys[i] >> shift) & 0xFF) + 1 ]++;
+
+	    // skip the pass if all keys have the same digit, which is the
+	    // case for the high bits if the particles are close together
+	    if( std::find( count + 1, count + 257, n ) != count + 257 )
+		continue;
+
+	    for( size_t d = 1; d < 257; d++ )
+		count[d] += count[d - 1];
+	    for( size_t i = 0; i < n; i++ )
+		buffer[ count[ (keys[order[i]] >> shift) & 0xFF ]++ ] = order[i];
+	    order.swap( buffer );
+	}
+    }
+
+    std::vector<size_t> order, buffer;
+    std::vector<boost::uint32_t> keys;
+};
+
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "NumaPlacement.hpp"
+
+#include <vector>
+
+#ifdef USE_NUMA
+#include <numa.h>
+#endif
+
+using namespace eslam;
+
+namespace
+{
+
+/** ids of the memory nodes which can be used, empty without NUMA */
+const std::vector<int>& getNodes()
+{
+    static std::vector<int> nodes;
+    static bool initialized = false;
+    if( !initialized )
+    {
+#ifdef USE_NUMA
+	if( numa_available() >= 0 )
+	{
+	    for( int i = 0; i <= numa_max_node(); i++ )
+		if( numa_bitmask_isbitset( numa_all_nodes_ptr, i ) )
+		    nodes.push_back( i );
+	}
+#endif
+	initialized = true;
+    }
+    return nodes;
+}
+
+}
+
+bool NumaPlacement::isAvailable()
+{
+    return !getNodes().empty();
+}
+
+int NumaPlacement::getNodeCount()
+{
+    return isAvailable() ? getNodes().size() : 1;
+}
+
+bool NumaPlacement::runOnNode( int node )
+{
+#ifdef USE_NUMA
+    if( isAvailable() && node >= 0 && node < getNodeCount() )
+	return numa_run_on_node( getNodes()[node] ) == 0;
+#endif
+    return false;
+}
+
+
+void NumaPlacement::setPreferred( int node )
+{
+#ifdef USE_NUMA
+    if( isAvailable() && node >= 0 && node < getNodeCount() )
+	numa_set_preferred( getNodes()[node] );
+#endif
+}
+
+void NumaPlacement::setLocal()
+{
+#ifdef USE_NUMA
+    if( isAvailable() )
+	numa_set_localalloc();
+#endif
+}
+
+NumaBinding::NumaBinding( int node )
+    : previous( NULL )
+{
+#ifdef USE_NUMA
+    if( NumaPlacement::isAvailable() )
+    {
+	previous = numa_allocate_cpumask();
+	if( numa_sched_getaffinity( 0, previous ) < 0 
+		|| !NumaPlacement::runOnNode( node ) )
+	{
+	    numa_free_cpumask( previous );
+	    previous = NULL;
+	}
+    }
+#endif
+}
+
+NumaBinding::~NumaBinding()
+{
+#ifdef USE_NUMA
+    if( previous )
+    {
+	numa_sched_setaffinity( 0, previous );
+	numa_free_cpumask( previous );
+    }
+#endif
+}
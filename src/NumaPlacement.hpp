@@ -0,0 +1,107 @@
+#ifndef __ESLAM_NUMAPLACEMENT_HPP__
+#define __ESLAM_NUMAPLACEMENT_HPP__
+
+#include <cstddef>
+#include <algorithm>
+
+/** cpu mask of libnuma */
+struct bitmask;
+
+namespace eslam
+{
+
+/**
+ * Placement of memory and threads on NUMA nodes, using libnuma.
+ *
+ * The nodes are numbered from 0 to getNodeCount() - 1, which are mapped to
+ * the memory nodes the process is allowed to use. If the library is built
+ * without USE_NUMA, or the system has no NUMA support, there is a single
+ * node and the placement functions do nothing.
+ */
+class NumaPlacement
+{
+public:
+    /** true if built with USE_NUMA and the system supports NUMA */
+    static bool isAvailable();
+
+    /** number of nodes, 1 if NUMA is not available */
+    static int getNodeCount();
+
+    /**
+     * node of an item if count items are split into contiguous blocks, one
+     * per node.
+     */
+    static int getBlockNode( size_t index, size_t count, int nodes )
+    {
+	return count > 0 ? static_cast<int>( index * nodes / count ) : 0;
+    }
+
+    /**
+     * range [first, last) of the threads which work on a node, if the
+     * threads are split evenly over the nodes. If there are less threads
+     * than nodes, a thread works on several nodes.
+     */
+    static void getNodeThreads( int node, int nodes, int threads, int& first, int& last )
+    {
+	first = node * threads / nodes;
+	last = std::max( (node + 1) * threads / nodes, first + 1 );
+    }
+
+    /**
+     * let the calling thread run only on the cpus of the node. Use
+     * NumaBinding to restore the previous cpus of the thread afterwards.
+     * @result false if the thread could not be bound
+     */
+    static bool runOnNode( int node );
+
+    /** allocate new memory of the calling thread on the node if possible */
+    static void setPreferred( int node );
+    /** allocate new memory of the calling thread on the node it runs on,
+     * which is the default */
+    static void setLocal();
+};
+
+/**
+ * runs the calling thread on the cpus of the node during its lifetime, and
+ * restores the cpus it was allowed to run on before afterwards, so that a
+ * binding of the thread, e.g. from OMP_PROC_BIND, is kept.
+ */
+class NumaBinding
+{
+public:
+    explicit NumaBinding( int node );
+    ~NumaBinding();
+
+private:
+    NumaBinding( const NumaBinding& );
+    NumaBinding& operator=( const NumaBinding& );
+
+    /** cpu mask of the thread before the binding, NULL if not bound */
+    struct bitmask *previous;
+};
+
+/**
+ * prefers the node for the allocations of the calling thread during its
+ * lifetime
+ */
+class NumaScope
+{
+public:
+    explicit NumaScope( int node )
+    {
+	NumaPlacement::setPreferred( node );
+    }
+
+    ~NumaScope()
+    {
+	NumaPlacement::setLocal();
+    }
+
+private:
+    NumaScope( const NumaScope& );
+    NumaScope& operator=( const NumaScope& );
+};
+
+}
+
+#endif
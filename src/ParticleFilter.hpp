@@ -4,7 +4,10 @@
 #include <boost/random/linear_congruential.hpp>
 #include <boost/random/uniform_real.hpp>
 #include <boost/random/variate_generator.hpp>
+#include <algorithm>
+#include <cassert>
 #include <limits>
+#include <vector>
 
 namespace eslam 
 {
@@ -107,6 +110,83 @@ public:
 	xi_k.swap( xi_kp );
     }
 
+    /** @brief stratified resampling of the particles in the range [begin, end)
+     *
+     * The range is resampled in place using the given random generator.
+     * The number of particles in the range stays the same, and the weights
+     * of the new particles are set to the mean weight of the range, so the
+     * total weight of the range is kept. The weights do not need to be
+     * normalized. Nothing is done if the weights of the range sum to zero.
+     */
+    void resample_stratified( size_t begin, size_t end, boost::minstd_rand& gen )
+    {
+	std::vector<size_t> selection;
+	if( select_stratified( begin, end, gen, selection ) )
+	    apply_selection( begin, end, selection );
+    }
+
+    /** @brief select the particles for a stratified resampling of the range
+     * [begin, end)
+     *
+     * Only reads the particles, so disjoint ranges can be selected in
+     * parallel, each with its own random generator. 
+     *
+     * @param selection - indices of the selected particles
+     * @result false if the weights of the range sum to zero
+     */
+    bool select_stratified( size_t begin, size_t end, boost::minstd_rand& gen, std::vector<size_t>& selection ) const
+    {
+	boost::variate_generator<boost::minstd_rand&, boost::uniform_real<> > 
+	    rand(gen, boost::uniform_real<>(0,1.0) );
+
+	assert( begin < end && end <= xi_k.size() );
+
+	selection.clear();
+	double total = 0;
+	for( size_t i=begin; i<end; i++ )
+	    total += xi_k[i].weight;
+	if( total <= 0.0 )
+	    return false;
+
+	const size_t samples = end - begin;
+	selection.reserve( samples );
+	size_t idx = begin;
+	double sum_w = xi_k[idx].weight;
+	for( size_t k=0; k<samples; ++k )
+	{
+	    double sum_r = total * (k + rand())/samples;
+	    while( sum_w < sum_r && idx + 1 < end )
+	    {
+		++idx;
+		sum_w += xi_k[idx].weight;
+	    }
+	    selection.push_back( idx );
+	}
+	return true;
+    }
+
+    /** @brief replace the particles of the range [begin, end) with copies
+     * of the selected particles, with the mean weight of the range
+     */
+    void apply_selection( size_t begin, size_t end, const std::vector<size_t>& selection )
+    {
+	assert( selection.size() == end - begin );
+
+	double total = 0;
+	for( size_t i=begin; i<end; i++ )
+	    total += xi_k[i].weight;
+
+	std::vector<Particle> xi_kp;
+	xi_kp.reserve( selection.size() );
+	for( size_t k=0; k<selection.size(); ++k )
+	{
+	    xi_kp.push_back( xi_k[selection[k]] );
+	    xi_kp.back().weight = total / selection.size();
+	}
+
+	std::copy( xi_kp.begin(), xi_kp.end(), xi_k.begin() + begin );
+    }
+
     /** @brief implementation of a multinomial resampling scheme
      *
      * multinomial resampling: imagine a strip of paper where each particle has
@@ -0,0 +1,264 @@
+#include "PerfCounters.hpp"
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace eslam;
+
+namespace
+{
+
+#ifdef __linux__
+int openCounter( boost::uint64_t config, int group )
+{
+    perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group < 0 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall( __NR_perf_event_open, &attr, 0, -1, group, 0 );
+}
+#endif
+
+struct Registry
+{
+    Registry() : enabled( false ), timing( false ) {}
+
+    boost::mutex mutex;
+    bool enabled;
+    bool timing;
+    std::map<std::string, PerfStage> stages;
+};
+
+Registry& getRegistry()
+{
+    static Registry registry;
+    return registry;
+}
+
+double perUnit( boost::uint64_t value, size_t count )
+{
+    return count > 0 ? static_cast<double>( value ) / count : 0.0;
+}
+
+}
+
+PerfCounts& PerfCounts::operator+=( const PerfCounts& other )
+{
+    cycles += other.cycles;
+    instructions += other.instructions;
+    llcMisses += other.llcMisses;
+    branchMisses += other.branchMisses;
+    return *this;
+}
+
+PerfCounts PerfCounts::operator-( const PerfCounts& other ) const
+{
+    PerfCounts result;
+    result.cycles = cycles - other.cycles;
+    result.instructions = instructions - other.instructions;
+    result.llcMisses = llcMisses - other.llcMisses;
+    result.branchMisses = branchMisses - other.branchMisses;
+    return result;
+}
+
+PerfCounters::PerfCounters()
+    : opened( 0 )
+{
+    for( int i = 0; i < COUNTERS; i++ )
+    {
+	fds[i] = -1;
+	index[i] = -1;
+    }
+
+#ifdef __linux__
+    const boost::uint64_t config[COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES };
+
+    // the cycle counter leads the group, the other counters are optional
+    fds[0] = openCounter( config[0], -1 );
+    if( fds[0] < 0 )
+	return;
+    index[0] = opened++;
+
+    for( int i = 1; i < COUNTERS; i++ )
+    {
+	fds[i] = openCounter( config[i], fds[0] );
+	if( fds[i] >= 0 )
+	    index[i] = opened++;
+    }
+
+    ioctl( fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+    ioctl( fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for( int i = COUNTERS - 1; i >= 0; i-- )
+	if( fds[i] >= 0 )
+	    close( fds[i] );
+#endif
+}
+
+PerfCounts PerfCounters::read() const
+{
+    PerfCounts result;
+#ifdef __linux__
+    if( fds[0] < 0 )
+	return result;
+
+    // the group read returns the number of counters, followed by the values
+    boost::uint64_t values[COUNTERS + 1];
+    const ssize_t size = (opened + 1) * sizeof( boost::uint64_t );
+    if( ::read( fds[0], values, size ) != size )
+	return result;
+
+    boost::uint64_t* const fields[COUNTERS] = {
+	&result.cycles, &result.instructions, &result.llcMisses, &result.branchMisses };
+    for( int i = 0; i < COUNTERS; i++ )
+	if( index[i] >= 0 )
+	    *fields[i] = values[index[i] + 1];
+#endif
+    return result;
+}
+
+void PerfStats::setEnabled( bool enabled )
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    r.enabled = enabled;
+}
+
+bool PerfStats::isEnabled()
+{
+    return getRegistry().enabled;
+}
+
+void PerfStats::setTimingEnabled( bool enabled )
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    r.timing = enabled;
+}
+
+bool PerfStats::isTimingEnabled()
+{
+    return getRegistry().timing;
+}
+
+bool PerfStats::isAvailable()
+{
+    return getThreadCounters() != NULL;
+}
+
+const PerfCounters* PerfStats::getThreadCounters()
+{
+    if( !isEnabled() )
+	return NULL;
+
+    static boost::thread_specific_ptr<PerfCounters> counters;
+    if( !counters.get() )
+	counters.reset( new PerfCounters() );
+    return counters->isAvailable() ? counters.get() : NULL;
+}
+
+void PerfStats::add( const char* stage, const PerfCounts& counts, size_t items, size_t calls )
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    PerfStage &s( r.stages[stage] );
+    s.counts += counts;
+    s.calls += calls;
+    s.items += items;
+}
+
+void PerfStats::addDuration( const char* stage, double seconds )
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    r.stages[stage].durations.push_back( seconds );
+}
+
+std::map<std::string, PerfStage> PerfStats::getStages()
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    return r.stages;
+}
+
+void PerfStats::clear()
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    r.stages.clear();
+}
+
+void PerfStats::print( std::ostream& os )
+{
+    // stages which were only timed have no counts
+    std::map<std::string, PerfStage> stages = getStages();
+    for( std::map<std::string, PerfStage>::iterator it = stages.begin(); it != stages.end(); )
+    {
+	if( it->second.calls == 0 )
+	    stages.erase( it++ );
+	else
+	    ++it;
+    }
+
+    if( stages.empty() )
+    {
+	os << "no hardware counters recorded" << std::endl;
+	return;
+    }
+
+    const std::ios::fmtflags flags = os.flags();
+    const std::streamsize precision = os.precision();
+
+    os << std::setw( 22 ) << std::left << "stage" << std::right
+	<< std::setw( 8 ) << "calls"
+	<< std::setw( 14 ) << "cycles/call"
+	<< std::setw( 8 ) << "ipc"
+	<< std::setw( 14 ) << "llc/call"
+	<< std::setw( 14 ) << "branch/call"
+	<< std::setw( 14 ) << "cycles/item" << std::endl;
+
+    for( std::map<std::string, PerfStage>::const_iterator it = stages.begin(); it != stages.end(); it++ )
+    {
+	const PerfStage &s( it->second );
+	os << std::setw( 22 ) << std::left << it->first << std::right
+	    << std::setw( 8 ) << s.calls
+	    << std::fixed << std::setprecision( 0 )
+	    << std::setw( 14 ) << perUnit( s.counts.cycles, s.calls )
+	    << std::setprecision( 2 )
+	    << std::setw( 8 ) << perUnit( s.counts.instructions, std::max<size_t>( s.counts.cycles, 1 ) )
+	    << std::setprecision( 0 )
+	    << std::setw( 14 ) << perUnit( s.counts.llcMisses, s.calls )
+	    << std::setw( 14 ) << perUnit( s.counts.branchMisses, s.calls )
+	    << std::setw( 14 ) << perUnit( s.counts.cycles, s.items )
+	    << std::endl;
+    }
+    os.flags( flags );
+    os.precision( precision );
+}
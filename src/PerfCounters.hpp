@@ -0,0 +1,176 @@
+#ifndef __ESLAM_PERFCOUNTERS_HPP__
+#define __ESLAM_PERFCOUNTERS_HPP__
+
+#include "Trace.hpp"
+
+#include <boost/cstdint.hpp>
+
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace eslam
+{
+
+/** values of the hardware counters */
+struct PerfCounts
+{
+    PerfCounts()
+	: cycles( 0 ), instructions( 0 ), llcMisses( 0 ), branchMisses( 0 ) {}
+
+    boost::uint64_t cycles;
+    boost::uint64_t instructions;
+    /** misses of the last level cache */
+    boost::uint64_t llcMisses;
+    boost::uint64_t branchMisses;
+
+    PerfCounts& operator+=( const PerfCounts& other );
+    PerfCounts operator-( const PerfCounts& other ) const;
+};
+
+/**
+ * Hardware performance counters of the calling thread, using
+ * perf_event_open. Only user space events are counted.
+ *
+ * Counters which can not be opened, e.g. in containers or virtual machines
+ * without a PMU, or if perf_event_paranoid does not allow it, read as 0. If
+ * not even the cycle counter is available, isAvailable() is false.
+ */
+class PerfCounters
+{
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    bool isAvailable() const { return fds[0] >= 0; }
+
+    /** counts since construction */
+    PerfCounts read() const;
+
+private:
+    PerfCounters( const PerfCounters& );
+    PerfCounters& operator=( const PerfCounters& );
+
+    enum { COUNTERS = 4 };
+    int fds[COUNTERS];
+    /** position of each counter in the group read, or -1 */
+    int index[COUNTERS];
+    int opened;
+};
+
+/** accumulated counts of a stage */
+struct PerfStage
+{
+    PerfStage() : calls( 0 ), items( 0 ) {}
+
+    PerfCounts counts;
+    size_t calls;
+    /** number of items, e.g. particles, processed in the stage */
+    size_t items;
+    /** wall time of each call in seconds, if the timing is enabled */
+    std::vector<double> durations;
+};
+
+/**
+ * Collects the hardware counters per stage of the filter. The counters are
+ * opened for each thread on its first stage. They are disabled by default.
+ *
+ * A PerfScope only counts the thread which runs the stage. The parallel
+ * regions of a stage add the counts of their other threads with a
+ * PerfWorkerScope, so the counts cover all threads, while the wall time is
+ * that of the calling thread.
+ */
+class PerfStats
+{
+public:
+    static void setEnabled( bool enabled );
+    static bool isEnabled();
+
+    /** true if the counters are available for the calling thread */
+    static bool isAvailable();
+
+    /** counters of the calling thread, or NULL if disabled or not
+     * available */
+    static const PerfCounters* getThreadCounters();
+
+    /** 
+     * record the wall time of each call of a stage, independent of the
+     * hardware counters. Disabled by default.
+     */
+    static void setTimingEnabled( bool enabled );
+    static bool isTimingEnabled();
+
+    static void add( const char* stage, const PerfCounts& counts, size_t items, size_t calls = 1 );
+    static void addDuration( const char* stage, double seconds );
+
+    static std::map<std::string, PerfStage> getStages();
+    static void clear();
+
+    /** print a table with the counts per call and per item of each stage */
+    static void print( std::ostream& os );
+};
+
+/** adds the counts between its construction and destruction to a stage */
+class PerfScope
+{
+public:
+    explicit PerfScope( const char* name, size_t items = 0 )
+	: name( name ), items( items ), counters( PerfStats::getThreadCounters() ),
+	timed( PerfStats::isTimingEnabled() ), beginTime( 0 )
+    {
+	if( timed )
+	    beginTime = Trace::now();
+	if( counters )
+	    begin = counters->read();
+    }
+
+    ~PerfScope()
+    {
+	if( counters )
+	    PerfStats::add( name, counters->read() - begin, items );
+	if( timed )
+	    PerfStats::addDuration( name, ( Trace::now() - beginTime ) * 1e-6 );
+    }
+
+private:
+    const char* name;
+    size_t items;
+    const PerfCounters* counters;
+    PerfCounts begin;
+    bool timed;
+    boost::int64_t beginTime;
+};
+
+/**
+ * adds the counts of a thread of a parallel region to the stage of the
+ * enclosing PerfScope, without counting a call. The thread which opened
+ * the enclosing scope is already counted by it, so the scope is only active
+ * if worker is true, i.e. for the threads other than the first one of the
+ * team.
+ */
+class PerfWorkerScope
+{
+public:
+    PerfWorkerScope( const char* name, bool worker )
+	: name( name ), counters( worker ? PerfStats::getThreadCounters() : NULL )
+    {
+	if( counters )
+	    begin = counters->read();
+    }
+
+    ~PerfWorkerScope()
+    {
+	if( counters )
+	    PerfStats::add( name, counters->read() - begin, 0, 0 );
+    }
+
+private:
+    const char* name;
+    const PerfCounters* counters;
+    PerfCounts begin;
+};
+
+}
+
+#endif
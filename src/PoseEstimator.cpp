@@ -4,12 +4,94 @@
 
 #include <stdexcept>
 #include <set>
+#include <map>
+#include <sstream>
+
+#include "Checkpoint.hpp"
+#include "Trace.hpp"
+#include "PerfCounters.hpp"
+#include "NumaPlacement.hpp"
 
 #include <omp.h>
 #include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 
 using namespace eslam;
 
+namespace
+{
+
+/** grid cell of a particle for the cluster evaluation */
+struct ClusterKey
+{
+    boost::int64_t x, y, yaw;
+
+    bool operator==( const ClusterKey& other ) const
+    {
+	return x == other.x && y == other.y && yaw == other.yaw;
+    }
+};
+
+struct ClusterKeyHash
+{
+    size_t operator()( const ClusterKey& key ) const
+    {
+	size_t seed = 0;
+	boost::hash_combine( seed, key.x );
+	boost::hash_combine( seed, key.y );
+	boost::hash_combine( seed, key.yaw );
+	return seed;
+    }
+};
+
+/** orders particle indices by descending weight */
+struct HigherWeight
+{
+    explicit HigherWeight( const std::vector<double>& weights ) : weights( weights ) {}
+
+    bool operator()( size_t a, size_t b ) const
+    {
+	return weights[a] > weights[b];
+    }
+
+    const std::vector<double>& weights;
+};
+
+int getMaxThreads()
+{
+#ifdef USE_OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+int getThreadNum()
+{
+#ifdef USE_OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+size_t reverseBits( size_t value, unsigned int bits )
+{
+    size_t result = 0;
+    for( unsigned int i = 0; i < bits; i++ )
+    {
+	result = (result << 1) | (value & 1);
+	value >>= 1;
+    }
+    return result;
+}
+
+}
+
+const double GridAccess::LOOKUP_DISTANCE = 3.0;
+
 PoseEstimator::PoseEstimator( odometry::FootContact& odometry, const eslam::Configuration &config )
     : ParticleFilter<Particle>(config.seed), 
     rand_norm(rand_gen, boost::normal_distribution<>(0,1.0) ),
@@ -19,9 +101,27 @@ PoseEstimator::PoseEstimator( odometry::FootContact& odometry, const eslam::Conf
     odometry(odometry), 
     hash(NULL),
     env(NULL), 
-    max_weight(0)
+    useShared(false),
+    max_weight(0),
+    hashCount(0),
+    iteration(0),
+    effectiveCount(0),
+    informationGain(0),
+    evaluatedCount(0),
+    completedFraction(1.0),
+    islandUpdates(0),
+    numaNodes( !config.useNumaPlacement ? 1 : 
+	    config.numaNodeCount > 0 ? config.numaNodeCount : NumaPlacement::getNodeCount() )
 {
     contactModel.setConfiguration( config.contactModel );
+    likelihoodCache.setResolution( config.likelihoodCacheResolution, config.likelihoodCacheAngularResolution );
+
+    // the patches used for the contact points need to stay resident
+    if( config.pagingRadius > 0 && config.pagingRadius < GridAccess::LOOKUP_DISTANCE )
+	throw std::runtime_error( "the paging radius is smaller than the lookup distance of the contact points." );
+    pager.setRadius( config.pagingRadius );
+    pager.setBudget( config.pagingBudget );
+    pager.setSpillFile( config.pagingFile );
 }
 
 PoseEstimator::~PoseEstimator()
@@ -30,18 +130,223 @@ PoseEstimator::~PoseEstimator()
 
 void PoseEstimator::cloneMaps()
 {
+    ESLAM_TRACE_SCOPE( "cloneMaps" );
+    PerfScope perf( "cloneMaps", xi_k.size() );
+
     // this function will make sure that no two particles will point to the same map
     // this works by cloning maps if they are referenced more than once
-    std::set<envire::EnvironmentItem*> used;
+    std::set<envire::MLSMap*> used;
+    std::set<envire::MLSMap*> kept;
+    std::map<envire::MLSMap*, int> nodes;
+
+    for( size_t i = 0; i < xi_k.size(); i++ )
+    {
+	Particle &p( xi_k[i] );
+	envire::MLSMap* grid = p.grid.getMap();
+
+	// with NUMA placement, maps are also cloned if they are not on the
+	// node of their particle
+	const int node = getParticleNode( i );
+	bool local = true;
+	if( numaNodes > 1 )
+	{
+	    std::map<envire::MLSMap*, int>::const_iterator n = mapNodes.find( grid );
+	    local = n != mapNodes.end() && n->second == node;
+	}
+
+	// maps which were shared on purpose stay shared, otherwise the
+	// memory saved by shareMaps would be used again
+	const bool shared = local && sharedMaps.count( grid );
+	if( shared )
+	    kept.insert( grid );
 
+	if( (!used.insert( grid ).second && !shared) || !local )
+	{
+	    if( numaNodes > 1 )
+		NumaPlacement::setPreferred( node );
+
+	    p.grid.copy( p.grid ); 	
+	    used.insert( p.grid.getMap() );
+
+	    // spilled grids are cloned empty, so they share the record of
+	    // the original
+	    if( pager.isEnabled() )
+		pager.cloned( grid, p.grid.getMap() );
+	}
+
+	if( numaNodes > 1 )
+	    nodes[p.grid.getMap()] = node;
+    }
+
+    if( numaNodes > 1 )
+	NumaPlacement::setLocal();
+    mapNodes.swap( nodes );
+    // only keep the maps which are still used, since the memory of the
+    // others may be reused for new maps
+    sharedMaps.swap( kept );
+
+    // grids of released maps may be freed by now, and their memory reused
+    if( pager.isEnabled() )
+	pager.sweep( used );
+}
+
+void PoseEstimator::pageMaps()
+{
+    if( useShared || !pager.isEnabled() )
+	return;
+
+    pager.beginRound();
     for( std::vector<Particle>::iterator it = xi_k.begin(); it != xi_k.end(); it++ )
+	pager.update( it->grid.getMap(), base::Vector3d( it->position.x(), it->position.y(), it->zPos ) );
+    pager.enforceBudget();
+}
+
+size_t PoseEstimator::shareMaps( double distance, double angle )
+{
+    // sort the particles by weight, so the particle with the highest weight
+    // in each bin provides the map
+    typedef std::pair<double, size_t> weight_index;
+    std::vector<weight_index> widxs( xi_k.size() );
+    for(size_t i=0;i<xi_k.size();i++)
+	widxs[i] = weight_index( -xi_k[i].weight, i );
+    std::sort( widxs.begin(), widxs.end() );
+
+    typedef std::pair<std::pair<long, long>, long> Bin;
+    std::map<Bin, size_t> owners;
+    size_t shared = 0;
+    for(size_t i=0;i<widxs.size();i++)
     {
-	envire::EnvironmentItem* grid = it->grid.getMap();
-	if( !used.insert( grid ).second )
+	Particle &p( xi_k[widxs[i].second] );
+	const Bin bin( std::make_pair( 
+		    static_cast<long>( floor( p.position.x() / distance ) ),
+		    static_cast<long>( floor( p.position.y() / distance ) ) ),
+		static_cast<long>( floor( p.orientation / angle ) ) );
+
+	std::pair<std::map<Bin, size_t>::iterator, bool> res = 
+	    owners.insert( std::make_pair( bin, widxs[i].second ) );
+	if( !res.second )
 	{
-	    it->grid.copy( it->grid ); 	
+	    Particle &owner( xi_k[res.first->second] );
+	    if( owner.grid.getMap() != p.grid.getMap() )
+	    {
+		p.grid = owner.grid;
+		sharedMaps.insert( owner.grid.getMap() );
+		shared++;
+	    }
 	}
     }
+
+    return shared;
+}
+
+void PoseEstimator::reduceParticles( size_t count )
+{
+    if( count == 0 || count >= xi_k.size() )
+	return;
+
+    normalizeWeights();
+    resample_stratified( count );
+    placeSharedMaps();
+    if( !useShared )
+	cloneMaps();
+
+    // release the memory of the removed particles
+    std::vector<Particle>( xi_k ).swap( xi_k );
+}
+
+void PoseEstimator::setLogDebug( bool logDebug )
+{
+    config.logDebug = logDebug;
+}
+
+void PoseEstimator::writeState( std::ostream& os ) const
+{
+    // the distributions can hold state as well, e.g. the second value of
+    // the Box-Muller transform
+    std::ostringstream rng;
+    rng << rand_gen << ' ' << rand_norm.distribution() << ' ' << rand_uni.distribution()
+	<< ' ' << islandGens.size();
+    for( size_t j = 0; j < islandGens.size(); j++ )
+	rng << ' ' << islandGens[j];
+    checkpoint::writeString( os, rng.str() );
+
+    checkpoint::write( os, zCompensatedOrientation.coeffs() );
+    checkpoint::write( os, max_weight );
+    checkpoint::write( os, static_cast<boost::uint64_t>( hashCount ) );
+    checkpoint::write( os, static_cast<boost::uint64_t>( iteration ) );
+    checkpoint::write( os, static_cast<boost::uint64_t>( islandUpdates ) );
+
+    checkpoint::write( os, static_cast<boost::uint64_t>( xi_k.size() ) );
+    for( size_t i = 0; i < xi_k.size(); i++ )
+	checkpoint::writeParticle( os, xi_k[i] );
+}
+
+void PoseEstimator::readState( std::istream& is )
+{
+    std::string rngState;
+    checkpoint::readString( is, rngState );
+    std::istringstream rng( rngState );
+    size_t islands = 0;
+    rng >> rand_gen >> rand_norm.distribution() >> rand_uni.distribution() >> islands;
+    std::vector<boost::minstd_rand> gens;
+    for( size_t j = 0; j < islands && rng; j++ )
+    {
+	boost::minstd_rand gen;
+	rng >> gen;
+	gens.push_back( gen );
+    }
+    if( !rng )
+	throw std::runtime_error( "the checkpoint contains an invalid random generator state." );
+    islandGens.swap( gens );
+
+    checkpoint::read( is, zCompensatedOrientation.coeffs() );
+    checkpoint::read( is, max_weight );
+    boost::uint64_t value;
+    checkpoint::read( is, value );
+    hashCount = value;
+    checkpoint::read( is, value );
+    iteration = value;
+    checkpoint::read( is, value );
+    islandUpdates = value;
+
+    boost::uint64_t count;
+    checkpoint::read( is, count );
+    xi_k.clear();
+    xi_k.reserve( count );
+    for( size_t i = 0; i < count; i++ )
+    {
+	PoseParticle p;
+	checkpoint::readParticle( is, p );
+	xi_k.push_back( Particle( p ) );
+    }
+}
+
+void PoseEstimator::setMaps( envire::Environment *env, const std::vector<envire::MLSMap*>& maps )
+{
+    assert( env );
+    assert( maps.size() == xi_k.size() );
+
+    this->env = env;
+    this->useShared = false;
+
+    // particles which use the same map also share the reference to it, so
+    // it is detached once
+    std::map<envire::MLSMap*, boost::shared_ptr<envire::MLSMap> > refs;
+    sharedMaps.clear();
+    for( size_t i = 0; i < xi_k.size(); i++ )
+    {
+	boost::shared_ptr<envire::MLSMap> &ref( refs[maps[i]] );
+	if( !ref )
+	    ref.reset( maps[i], &GridAccess::detachItem );
+	else
+	    sharedMaps.insert( maps[i] );
+	xi_k[i].grid.setMap( ref );
+    }
+}
+
+void PoseEstimator::setSurfaceHash( const SurfaceHash *hash )
+{
+    this->hash = hash;
 }
 
 void PoseEstimator::setEnvironment(envire::Environment *env, envire::MLSMap::Ptr map, bool useShared )
@@ -51,16 +356,54 @@ void PoseEstimator::setEnvironment(envire::Environment *env, envire::MLSMap::Ptr
 
     this->env = env;
     this->useShared = useShared;
+    sharedMaps.clear();
 
-    boost::shared_ptr<envire::MLSMap> pMap( map.get(), &GridAccess::detachItem );
+    // the per particle maps are removed from the environment once they are
+    // not used anymore, while a shared map stays, since other filters might
+    // use it as well
+    boost::shared_ptr<envire::MLSMap> pMap( map.get(), 
+	    useShared ? &GridAccess::keepItem : &GridAccess::detachItem );
 
     for( std::vector<Particle>::iterator it = xi_k.begin(); it != xi_k.end(); it++ )
 	it->grid.setMap( pMap );
 
+    // the shared map is only read, so each node gets a copy of it
+    sharedReplicas.clear();
+    if( useShared && numaNodes > 1 )
+    {
+	for( int node = 0; node < numaNodes; node++ )
+	{
+	    NumaScope scope( node );
+	    envire::MLSMap::Ptr replica = map->cloneDeep();
+	    env->setFrameNode( replica.get(), map->getFrameNode() );
+	    sharedReplicas.push_back( 
+		    boost::shared_ptr<envire::MLSMap>( replica.get(), &GridAccess::detachItem ) );
+	}
+	placeSharedMaps();
+    }
+
     if( !useShared )
 	cloneMaps();
 }
 
+int PoseEstimator::getParticleNode( size_t index ) const
+{
+    return NumaPlacement::getBlockNode( index, xi_k.size(), numaNodes );
+}
+
+void PoseEstimator::placeSharedMaps()
+{
+    if( sharedReplicas.empty() )
+	return;
+
+    for( size_t i = 0; i < xi_k.size(); i++ )
+    {
+	const boost::shared_ptr<envire::MLSMap> &replica( sharedReplicas[getParticleNode( i )] );
+	if( xi_k[i].grid.getMap() != replica.get() )
+	    xi_k[i].grid.setMap( replica );
+    }
+}
+
 base::Pose2D PoseEstimator::samplePose2D( const base::Pose2D& mu, const base::Pose2D& sigma )
 {
     double x = rand_norm(), y = rand_norm(), theta = rand_norm();
@@ -72,12 +415,12 @@ base::Pose2D PoseEstimator::samplePose2D( const base::Pose2D& mu, const base::Po
 	    theta * sigma.orientation + mu.orientation );
 }
 
-void PoseEstimator::init( int numParticles, SurfaceHash* hash ) 
+void PoseEstimator::init( int numParticles, const SurfaceHash* hash ) 
 {
     this->hash = hash;
     for(int i=0;i<numParticles;i++)
     {
-	PoseParticle* pp = hash->sample(); 
+	const PoseParticle* pp = hash->sample( rand_gen ); 
 	if( pp )
 	    xi_k.push_back( Particle( *pp ) );
 	else
@@ -130,6 +473,9 @@ double weightingFunction( double x, double alpha = 0.1, double beta = 0.9, doubl
 void PoseEstimator::sampleFromHash( double replace_percentage, const odometry::BodyContactState& state, const base::Quaterniond& orientation )
 {
     assert( hash );
+    ESLAM_TRACE_SCOPE( "sampleFromHash" );
+    PerfScope perf( "sampleFromHash" );
+
     // use the hash function to spawn new particles 
     // if we have a single map
 
@@ -158,12 +504,12 @@ void PoseEstimator::sampleFromHash( double replace_percentage, const odometry::B
     if( relevance_factor < 0.8 )
 	replace_count = 0;
 
-    std::cout << "replacing : " << replace_count << " relevance: " << relevance_factor << std::endl;
+    ESLAM_TRACE_MESSAGE( "replacing: " << replace_count << " relevance: " << relevance_factor );
     double weight = getWeightAvg() * hash->config.avgFactor * relevance_factor;
     //std::cerr << "resampling " << replace_count << " particles using hash...";
     for(size_t i=0;i<replace_count;i++)
     {
-	PoseParticle* pp = hash->sample( params ); 
+	const PoseParticle* pp = hash->sample( params, rand_gen ); 
 	if( pp )
 	{
 	    Particle &pose(xi_k[widxs[i].second]);
@@ -183,6 +529,9 @@ void PoseEstimator::sampleFromHash( double replace_percentage, const odometry::B
 
 void PoseEstimator::project(const odometry::BodyContactState& state, const base::Quaterniond& orientation)
 {
+    ESLAM_TRACE_SCOPE( "project" );
+    PerfScope perf( "project", xi_k.size() );
+
     double yaw = base::getYaw( orientation );
     zCompensatedOrientation = base::removeYaw( orientation );
     Eigen::Affine3d dtrans = orientation * odometry.getPoseDelta().toTransform();
@@ -236,94 +585,294 @@ void PoseEstimator::project(const odometry::BodyContactState& state, const base:
 	}
     }
 
-    static int count = 0;
-    if( hash && (((count++) % hash->config.period) == 0) )
+    if( hash && (((hashCount++) % hash->config.period) == 0) )
 	sampleFromHash( hash->config.percentage, state, orientation );
+
+    updateOrder();
+    placeSharedMaps();
+}
+
+void PoseEstimator::updateOrder()
+{
+    if( config.useSpatialOrder )
+	spatialOrder.update( xi_k, config.gridResolution );
+    else
+	spatialOrder.setIdentity( xi_k.size() );
+}
+
+const std::vector<size_t>& PoseEstimator::getOrder()
+{
+    // the number of particles may have changed since the last update
+    if( spatialOrder.getOrder().size() != xi_k.size() )
+	updateOrder();
+    return spatialOrder.getOrder();
 }
 
-void PoseEstimator::update(const odometry::BodyContactState& state, const base::Quaterniond& orientation, const std::vector<terrain_estimator::TerrainClassification>& ltc )
+void PoseEstimator::update(const odometry::BodyContactState& state, const base::Quaterniond& orientation, const std::vector<terrain_estimator::TerrainClassification>& ltc, const base::Time& deadline )
 {
     contactModel.setTerrainClassification( ltc );
-    updateWeights(state, orientation);
-    double eff = normalizeWeights();
-    if( eff < config.minEffective )
+    pageMaps();
+
+    const double priorSum = getWeightsSum();
+    priorWeights.resize( xi_k.size() );
+    for( size_t i = 0; i < xi_k.size(); i++ )
+	priorWeights[i] = priorSum > 0 ? xi_k[i].weight / priorSum : 1.0 / xi_k.size();
+
+    updateWeights(state, orientation, deadline);
+    const bool useIslands = getIslandCount() > 1;
+    double eff;
+    {
+	ESLAM_TRACE_SCOPE( "normalizeWeights" );
+	PerfScope perf( "normalizeWeights", xi_k.size() );
+	eff = useIslands ? normalizeIslands() : normalizeWeights();
+    }
+    effectiveCount = eff;
+
+    informationGain = 0;
+    for( size_t i = 0; i < xi_k.size(); i++ )
+    {
+	const double w = xi_k[i].weight;
+	if( w > 0 && priorWeights[i] > 0 )
+	    informationGain += w * log( w / priorWeights[i] );
+    }
+
+    // resampling and cloning the maps is deferred to a later update if the
+    // deadline has passed already
+    if( !deadline.isNull() && base::Time::now() >= deadline )
+	return;
+
+    if( useIslands )
+    {
+	bool resampled;
+	{
+	    ESLAM_TRACE_SCOPE( "resample" );
+	    PerfScope perf( "resample", xi_k.size() );
+	    resampled = resampleIslands();
+	}
+
+	const bool migrate = config.islandMigrationPeriod > 0 
+	    && (++islandUpdates % config.islandMigrationPeriod) == 0;
+	if( migrate )
+	    migrateIslands();
+
+	if( resampled || migrate )
+	{
+	    updateOrder();
+	    placeSharedMaps();
+	}
+	if( resampled && !useShared )
+	    cloneMaps();
+    }
+    else if( eff < config.minEffective )
     {
-	resample();
+	{
+	    ESLAM_TRACE_SCOPE( "resample" );
+	    PerfScope perf( "resample", xi_k.size() );
+	    resample();
+	}
+	updateOrder();
+	placeSharedMaps();
 	if( !useShared )
 	    cloneMaps();
     }
 }
 
-void PoseEstimator::updateWeights(const odometry::BodyContactState& state, const base::Quaterniond& orientation)
+size_t PoseEstimator::getIslandCount() const
 {
-    if( !env )
-	throw std::runtime_error("No environment attached.");
-
-    contactModel.setContactPoints( state, orientation );
+    return std::max<size_t>( 1, std::min( config.islandCount, xi_k.size() ) );
+}
 
-    size_t total_points = 0;
-    size_t data_particles = 0;
-    double sum_data_weights = 0.0;
+size_t PoseEstimator::getIslandBegin( size_t island ) const
+{
+    return island * xi_k.size() / getIslandCount();
+}
 
-    double last_max_weight = max_weight;
-    max_weight = 0;
+double PoseEstimator::normalizeIslands()
+{
+    const int islands = getIslandCount();
 
-    // now update the weights of the particles by calculating the variance of the contact points 
+    // the islands sum up their weights independently, and only the sums
+    // are combined. The sums are combined in the order of the islands, so
+    // that the result does not depend on the number of threads.
+    std::vector<double> islandSums( islands, 0.0 );
 #ifdef USE_OPENMP
-#warning "using OpenMP"
 #pragma omp parallel for
 #endif
-    for(size_t i=0;i<xi_k.size();i++)
+    for( int j = 0; j < islands; j++ )
     {
-	Particle &pose(xi_k[i]);
-	base::Vector3d pos( pose.position.x(), pose.position.y(), pose.zPos );
-	base::Affine3d t = 
-	    Eigen::Translation3d( pos ) 
-	    * Eigen::AngleAxisd( pose.orientation, Eigen::Vector3d::UnitZ() );
+	const size_t end = getIslandBegin( j + 1 );
+	for( size_t i = getIslandBegin( j ); i < end; i++ )
+	    islandSums[j] += xi_k[i].weight;
+    }
 
-	// store some debug information in the particle
-	pose.meas_pos = pos; 
-	pose.meas_theta = pose.orientation;
+    double sumWeights = 0;
+    for( int j = 0; j < islands; j++ )
+	sumWeights += islandSums[j];
 
-	if( contactModel.evaluatePose( 
-		t, 
-		pow(pose.zSigma,2) + pow(config.measurementError,2), 
-		boost::bind( &GridAccess::get, pose.grid, _1, _2 ) ) )
+    if( sumWeights <= 0.0 )
+	return normalizeWeights();
+
+#ifdef USE_OPENMP
+#pragma omp parallel for
+#endif
+    for( int j = 0; j < islands; j++ )
+    {
+	const size_t end = getIslandBegin( j + 1 );
+	islandSums[j] = 0;
+	for( size_t i = getIslandBegin( j ); i < end; i++ )
 	{
-	    // update z position and sigma
-	    double zVar = pow( pose.zSigma, 2 );
-	    contactModel.updateZPositionEstimate( pose.zPos, zVar );
-	    pose.zSigma = sqrt( zVar );
-
-	    // use some measurement of the variance as the weight 
-	    const double weight = contactModel.getWeight();
-	    xi_k[i].weight *= weight;
-	    xi_k[i].mprob = weight;
-	    xi_k[i].floating = false;
-
-	    // store the current maximum weight
-	    max_weight = std::max( max_weight, weight );
-	    
-	    data_particles ++;
-	    const size_t found_points = contactModel.getContactPoints().size();
-	    sum_data_weights += pow( weight, 1.0/found_points );
-	    total_points += found_points;
+	    double &w( xi_k[i].weight );
+	    w /= sumWeights;
+	    islandSums[j] += w*w;
 	}
-	else
+    }
+
+    double sumSquares = 0;
+    for( int j = 0; j < islands; j++ )
+	sumSquares += islandSums[j];
+
+    return 1.0 / sumSquares;
+}
+
+bool PoseEstimator::resampleIslands()
+{
+    const int islands = getIslandCount();
+
+    // each island has its own random generator, so the result does not
+    // depend on the order in which the islands are processed
+    if( islandGens.size() != static_cast<size_t>( islands ) )
+    {
+	islandGens.clear();
+	for( int j = 0; j < islands; j++ )
+	    islandGens.push_back( boost::minstd_rand( config.seed + j + 1 ) );
+    }
+
+    std::vector<std::vector<size_t> > selections( islands );
+#ifdef USE_OPENMP
+#pragma omp parallel for
+#endif
+    for( int j = 0; j < islands; j++ )
+    {
+	const size_t begin = getIslandBegin( j ), end = getIslandBegin( j + 1 );
+
+	double sum = 0, sumSquares = 0;
+	for( size_t i = begin; i < end; i++ )
 	{
-	    // slowly reduce likelyhood of particles with no measurements
-	    // and mark them as floating
-	    xi_k[i].floating = true;
-	    xi_k[i].mprob = 1.0;
-	    //xi_k[i].w *= 0.99;
+	    const double w = xi_k[i].weight;
+	    sum += w;
+	    sumSquares += w*w;
 	}
 
-	// make logging of debug data optional, since it really makes the logs quite big
-	pose.cpoints.swap( contactModel.getContactPoints() );
-	if( config.logDebug )
-	    std::copy( contactModel.getSlipPoints().begin(), contactModel.getSlipPoints().end(), std::back_inserter( pose.spoints ) );
+	// the threshold for the effective count is scaled to the island size
+	const double eff = sumSquares > 0 ? sum*sum / sumSquares : 0;
+	if( sumSquares > 0 && eff * xi_k.size() < config.minEffective * (end - begin) )
+	    select_stratified( begin, end, islandGens[j], selections[j] );
+    }
+
+    // replacing the particles releases the maps which were not selected,
+    // which detaches them from the environment, so this is done serially
+    bool resampled = false;
+    for( int j = 0; j < islands; j++ )
+    {
+	if( selections[j].empty() )
+	    continue;
+	apply_selection( getIslandBegin( j ), getIslandBegin( j + 1 ), selections[j] );
+	resampled = true;
+    }
+
+    return resampled;
+}
+
+void PoseEstimator::migrateIslands()
+{
+    const size_t islands = getIslandCount();
+    size_t count = config.islandMigrationCount;
+    for( size_t j = 0; j < islands; j++ )
+	count = std::min( count, getIslandBegin( j + 1 ) - getIslandBegin( j ) );
+    if( count == 0 )
+	return;
+
+    std::vector<double> weights( xi_k.size() );
+    for( size_t i = 0; i < xi_k.size(); i++ )
+	weights[i] = xi_k[i].weight;
+
+    // indices of the best particles of each island
+    std::vector<std::vector<size_t> > best( islands );
+    for( size_t j = 0; j < islands; j++ )
+    {
+	for( size_t i = getIslandBegin( j ); i < getIslandBegin( j + 1 ); i++ )
+	    best[j].push_back( i );
+	std::partial_sort( best[j].begin(), best[j].begin() + count, best[j].end(), 
+		HigherWeight( weights ) );
+	best[j].resize( count );
+    }
+
+    // the best particles move on to the next island in a ring, together
+    // with their weights, so the particle set as a whole stays the same
+    std::vector<Particle> last;
+    for( size_t r = 0; r < count; r++ )
+	last.push_back( xi_k[best[islands-1][r]] );
+    for( size_t j = islands - 1; j > 0; j-- )
+	for( size_t r = 0; r < count; r++ )
+	    xi_k[best[j][r]] = xi_k[best[j-1][r]];
+    for( size_t r = 0; r < count; r++ )
+	xi_k[best[0][r]] = last[r];
+}
+
+void PoseEstimator::updateWeights(const odometry::BodyContactState& state, const base::Quaterniond& orientation, const base::Time& deadline)
+{
+    if( !env )
+	throw std::runtime_error("No environment attached.");
+
+    ESLAM_TRACE_SCOPE( "updateWeights" );
+    PerfScope perf( "updateWeights", xi_k.size() );
+
+    contactModel.setContactPoints( state, orientation );
+
+    // the evaluation changes the state of the contact model, so each thread
+    // uses its own copy
+    threadModels.assign( getMaxThreads(), contactModel );
+
+    double last_max_weight = max_weight;
+    max_weight = 0;
+
+    const std::vector<size_t> &order( getOrder() );
+
+    // the evaluations can only be reused if all particles see the same map
+    const bool useCache = useShared && config.useLikelihoodCache;
+    if( useCache )
+	likelihoodCache.clear();
+
+    // now update the weights of the particles by calculating the variance of the contact points 
+    completedFraction = 1.0;
+    if( !deadline.isNull() )
+	evaluateUntil( deadline, order, useCache );
+    else if( config.useClusterEvaluation )
+	evaluateClusters( order, useCache );
+    else if( numaNodes > 1 )
+	evaluateOnNodes( order, useCache );
+    else
+    {
+	evaluateParticles( order, useCache );
+	evaluatedCount = xi_k.size();
+    }
+
+    size_t total_points = 0;
+    size_t data_particles = 0;
+    double sum_data_weights = 0.0;
+    for(size_t i=0;i<xi_k.size();i++)
+    {
+	const Particle &pose( xi_k[i] );
+	if( pose.floating )
+	    continue;
+
+	// store the current maximum weight
+	max_weight = std::max( max_weight, pose.mprob );
 
-	contactModel.getSlipPoints().clear();
+	data_particles ++;
+	const size_t found_points = pose.cpoints.size();
+	sum_data_weights += pow( pose.mprob, 1.0/found_points );
+	total_points += found_points;
     }
 
     const double floating_weight = data_particles>0 ? sum_data_weights/data_particles : 1.0;
@@ -347,8 +896,386 @@ void PoseEstimator::updateWeights(const odometry::BodyContactState& state, const
     if( total_points == 0 )
 	max_weight = last_max_weight * config.discountFactor;
 
-    static int iter = 0;
-    std::cerr << "iteration: " << iter++ << "\tfound: " << total_points << "\tmax: " << xi_k.size() << "       \r";
+    ESLAM_TRACE_MESSAGE( "iteration: " << iteration << " found: " << total_points << " max: " << xi_k.size() 
+	    << " evaluated: " << evaluatedCount << " completed: " << completedFraction );
+    if( useCache )
+	ESLAM_TRACE_MESSAGE( "likelihood cache hit rate: " << likelihoodCache.getHitRate() );
+    iteration++;
+}
+
+ContactModel& PoseEstimator::getThreadModel()
+{
+    return threadModels[getThreadNum()];
+}
+
+bool PoseEstimator::evaluateParticle( Particle& pose, ContactModel& model, bool useCache )
+{
+    base::Vector3d pos( pose.position.x(), pose.position.y(), pose.zPos );
+    base::Affine3d t = 
+	Eigen::Translation3d( pos ) 
+	* Eigen::AngleAxisd( pose.orientation, Eigen::Vector3d::UnitZ() );
+
+    // store some debug information in the particle
+    pose.meas_pos = pos; 
+    pose.meas_theta = pose.orientation;
+
+    LikelihoodCache::Key key;
+    LikelihoodCache::Entry cached;
+    bool hit = false;
+    if( useCache )
+    {
+	key = likelihoodCache.getKey( pose.position.x(), pose.position.y(), pose.orientation, pose.zPos, pose.zSigma );
+#ifdef USE_OPENMP
+#pragma omp critical(likelihoodCache)
+#endif
+	hit = likelihoodCache.find( key, cached );
+    }
+
+    bool found;
+    if( hit )
+    {
+	found = cached.found;
+	model.setResult( cached.result );
+    }
+    else
+    {
+	found = model.evaluatePose( 
+		t, 
+		pow(pose.zSigma,2) + pow(config.measurementError,2), 
+		boost::bind( &GridAccess::get, pose.grid, _1, _2 ) );
+
+	if( useCache )
+	{
+	    LikelihoodCache::Entry entry;
+	    entry.found = found;
+	    model.getResult( entry.result );
+#ifdef USE_OPENMP
+#pragma omp critical(likelihoodCache)
+#endif
+	    likelihoodCache.insert( key, entry );
+	}
+    }
+
+    if( found )
+    {
+	// update z position and sigma
+	double zVar = pow( pose.zSigma, 2 );
+	model.updateZPositionEstimate( pose.zPos, zVar );
+	pose.zSigma = sqrt( zVar );
+
+	// use some measurement of the variance as the weight 
+	const double weight = model.getWeight();
+	pose.weight *= weight;
+	pose.mprob = weight;
+	pose.floating = false;
+    }
+    else
+    {
+	// slowly reduce likelyhood of particles with no measurements
+	// and mark them as floating
+	pose.floating = true;
+	pose.mprob = 1.0;
+	//pose.w *= 0.99;
+    }
+
+    // make logging of debug data optional, since it really makes the logs quite big
+    pose.cpoints.swap( model.getContactPoints() );
+    if( config.logDebug )
+	std::copy( model.getSlipPoints().begin(), model.getSlipPoints().end(), std::back_inserter( pose.spoints ) );
+
+    model.getSlipPoints().clear();
+
+    return found;
+}
+
+void PoseEstimator::copyEvaluation( const Particle& from, double zPos, double zSigma, Particle& to )
+{
+    to.meas_pos = base::Vector3d( to.position.x(), to.position.y(), to.zPos );
+    to.meas_theta = to.orientation;
+
+    // apply the weight and the height correction of the evaluation,
+    // relative to the height of the particle
+    if( !from.floating )
+    {
+	to.zPos += from.zPos - zPos;
+	if( zSigma > 0 )
+	    to.zSigma *= from.zSigma / zSigma;
+	else
+	    to.zSigma = from.zSigma;
+
+	to.weight *= from.mprob;
+    }
+    to.mprob = from.mprob;
+    to.floating = from.floating;
+    to.cpoints = from.cpoints;
+}
+
+void PoseEstimator::evaluateClusters( const std::vector<size_t>& order, bool useCache )
+{
+    // group the particles on a grid over position and heading. Since the
+    // particles are visited in spatial order, the members of a cluster are
+    // mostly consecutive.
+    typedef boost::unordered_map<ClusterKey, size_t, ClusterKeyHash> ClusterIndex;
+    ClusterIndex clusterIndex;
+    std::vector<std::vector<size_t> > clusters;
+    std::vector<size_t> reps;
+
+    for( size_t k = 0; k < order.size(); k++ )
+    {
+	const size_t i = order[k];
+	const Particle &p( xi_k[i] );
+	ClusterKey key;
+	key.x = static_cast<boost::int64_t>( floor( p.position.x() / config.clusterResolution ) );
+	key.y = static_cast<boost::int64_t>( floor( p.position.y() / config.clusterResolution ) );
+	key.yaw = static_cast<boost::int64_t>( floor( p.orientation / config.clusterAngularResolution ) );
+
+	std::pair<ClusterIndex::iterator, bool> res = 
+	    clusterIndex.insert( std::make_pair( key, clusters.size() ) );
+	if( res.second )
+	{
+	    clusters.push_back( std::vector<size_t>() );
+	    reps.push_back( i );
+	}
+
+	// the representative is the particle with the highest weight
+	const size_t c = res.first->second;
+	clusters[c].push_back( i );
+	if( p.weight > xi_k[reps[c]].weight )
+	    reps[c] = i;
+    }
+
+    // evaluate the representatives, keeping their height before the
+    // evaluation for the members which take their result
+    std::vector<double> repZPos( reps.size() ), repZSigma( reps.size() );
+    for( size_t c = 0; c < reps.size(); c++ )
+    {
+	repZPos[c] = xi_k[reps[c]].zPos;
+	repZSigma[c] = xi_k[reps[c]].zSigma;
+    }
+    evaluateParticles( reps, useCache );
+
+    double maxProb = 0;
+    for( size_t c = 0; c < reps.size(); c++ )
+	if( !xi_k[reps[c]].floating )
+	    maxProb = std::max( maxProb, xi_k[reps[c]].mprob );
+
+    // the members of clusters with a likely representative are evaluated
+    // as well, the others take the result of the representative. A
+    // representative without contact counts as a likelihood of 0, so a
+    // threshold of 0 evaluates all particles.
+    std::vector<size_t> refine;
+    for( size_t c = 0; c < clusters.size(); c++ )
+    {
+	const Particle &rep( xi_k[reps[c]] );
+	const double repProb = rep.floating ? 0.0 : rep.mprob;
+	const bool likely = repProb >= config.clusterThreshold * maxProb;
+
+	for( size_t m = 0; m < clusters[c].size(); m++ )
+	{
+	    const size_t i = clusters[c][m];
+	    if( i == reps[c] )
+		continue;
+	    if( likely )
+		refine.push_back( i );
+	    else
+		copyEvaluation( rep, repZPos[c], repZSigma[c], xi_k[i] );
+	}
+    }
+
+    evaluateParticles( refine, useCache );
+
+    evaluatedCount = reps.size() + refine.size();
+}
+
+void PoseEstimator::evaluateOnNodes( const std::vector<size_t>& order, bool useCache )
+{
+    // with the cache, the particles which fill it are evaluated in a first
+    // pass, see evaluateParticles
+    std::vector<std::vector<size_t> > passes( 1 );
+    if( useCache )
+    {
+	passes.resize( 2 );
+	splitCacheOwners( order, passes[0], passes[1] );
+    }
+    else
+	passes[0] = order;
+
+    for( size_t pass = 0; pass < passes.size(); pass++ )
+    {
+	// the particles of each node, in spatial order
+	std::vector<std::vector<size_t> > nodeOrder( numaNodes );
+	for( size_t k = 0; k < passes[pass].size(); k++ )
+	    nodeOrder[getParticleNode( passes[pass][k] )].push_back( passes[pass][k] );
+
+#ifdef USE_OPENMP
+#pragma omp parallel
+#endif
+	{
+#ifdef USE_OPENMP
+	    const int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+#else
+	    const int threads = 1, thread = 0;
+#endif
+	    PerfWorkerScope perf( "updateWeights", thread > 0 );
+
+	    // the threads are split evenly over the nodes, and run on the node
+	    // whose particles they evaluate. If there are less threads than
+	    // nodes, a thread handles several nodes.
+	    for( int node = 0; node < numaNodes; node++ )
+	    {
+		int first, last;
+		NumaPlacement::getNodeThreads( node, numaNodes, threads, first, last );
+		if( thread < first || thread >= last )
+		    continue;
+
+		NumaBinding binding( node );
+		const std::vector<size_t> &particles( nodeOrder[node] );
+		const size_t begin = (thread - first) * particles.size() / (last - first);
+		const size_t end = (thread - first + 1) * particles.size() / (last - first);
+		for( size_t k = begin; k < end; k++ )
+		    evaluateParticle( xi_k[particles[k]], getThreadModel(), useCache );
+	    }
+	}
+    }
+
+    evaluatedCount = xi_k.size();
+}
+
+void PoseEstimator::splitCacheOwners( const std::vector<size_t>& indices, 
+	std::vector<size_t>& owners, std::vector<size_t>& others ) const
+{
+    typedef boost::unordered_set<LikelihoodCache::Key, LikelihoodCache::KeyHash> KeySet;
+    KeySet keys;
+    owners.clear();
+    others.clear();
+    for( size_t k = 0; k < indices.size(); k++ )
+    {
+	const Particle &p( xi_k[indices[k]] );
+	const LikelihoodCache::Key key = likelihoodCache.getKey( 
+		p.position.x(), p.position.y(), p.orientation, p.zPos, p.zSigma );
+	if( !likelihoodCache.contains( key ) && keys.insert( key ).second )
+	    owners.push_back( indices[k] );
+	else
+	    others.push_back( indices[k] );
+    }
+}
+
+void PoseEstimator::evaluateParticles( const std::vector<size_t>& indices, bool useCache )
+{
+    // with the cache, the first particle of each bin is evaluated in a
+    // first pass, and the others use its result in a second one. Otherwise
+    // the particle which fills a bin, and with it the result, would depend
+    // on the timing of the threads.
+    std::vector<size_t> owners, others;
+    if( useCache )
+	splitCacheOwners( indices, owners, others );
+    const std::vector<size_t> *passes[2] = { useCache ? &owners : &indices, &others };
+
+    for( int pass = 0; pass < 2; pass++ )
+    {
+	const std::vector<size_t> &list( *passes[pass] );
+#ifdef USE_OPENMP
+#warning "using OpenMP"
+#pragma omp parallel
+#endif
+	{
+	    // the evaluation is part of the updateWeights stage
+	    PerfWorkerScope perf( "updateWeights", getThreadNum() > 0 );
+#ifdef USE_OPENMP
+#pragma omp for
+#endif
+	    for( size_t k = 0; k < list.size(); k++ )
+		evaluateParticle( xi_k[list[k]], getThreadModel(), useCache );
+	}
+    }
+}
+
+void PoseEstimator::getPriorityOrder( const std::vector<size_t>& order, 
+	const std::vector<double>& weights, double priorityFraction, 
+	std::vector<size_t>& sequence )
+{
+    const size_t n = order.size();
+
+    // the particles with the highest weight come first
+    const size_t priority = std::min( n, 
+	    static_cast<size_t>( ceil( n * priorityFraction ) ) );
+    std::vector<size_t> byWeight( order );
+    std::partial_sort( byWeight.begin(), byWeight.begin() + priority, byWeight.end(), 
+	    HigherWeight( weights ) );
+
+    sequence.assign( byWeight.begin(), byWeight.begin() + priority );
+    std::vector<char> selected( n, 0 );
+    for( size_t k = 0; k < priority; k++ )
+	selected[sequence[k]] = 1;
+
+    // the other particles follow in bit reversed order along the spatial
+    // order, so that the particles of any prefix are spread evenly over
+    // the distribution
+    std::vector<size_t> rest;
+    rest.reserve( n - priority );
+    for( size_t k = 0; k < n; k++ )
+	if( !selected[order[k]] )
+	    rest.push_back( order[k] );
+
+    unsigned int bits = 0;
+    while( (static_cast<size_t>( 1 ) << bits) < rest.size() )
+	bits++;
+    for( size_t j = 0; j < (static_cast<size_t>( 1 ) << bits); j++ )
+    {
+	const size_t r = reverseBits( j, bits );
+	if( r < rest.size() )
+	    sequence.push_back( rest[r] );
+    }
+}
+
+void PoseEstimator::evaluateUntil( const base::Time& deadline, const std::vector<size_t>& order, bool useCache )
+{
+    const size_t n = xi_k.size();
+
+    std::vector<size_t> sequence;
+    getPriorityOrder( order, priorWeights, config.deadlinePriorityFraction, sequence );
+    std::vector<char> evaluated( n, 0 );
+
+    // a parallel loop can not be left early, so the remaining iterations
+    // are skipped once the deadline has passed
+#ifdef USE_OPENMP
+#pragma omp parallel
+#endif
+    {
+	PerfWorkerScope perf( "updateWeights", getThreadNum() > 0 );
+#ifdef USE_OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+	for( size_t k = 0; k < sequence.size(); k++ )
+	{
+	    if( base::Time::now() >= deadline )
+		continue;
+	    evaluateParticle( xi_k[sequence[k]], getThreadModel(), useCache );
+	    evaluated[sequence[k]] = 1;
+	}
+    }
+
+    // the particles which were not evaluated are treated like particles
+    // without contact, with an additional discount
+    evaluatedCount = 0;
+    for( size_t i = 0; i < n; i++ )
+    {
+	if( evaluated[i] )
+	{
+	    evaluatedCount++;
+	    continue;
+	}
+
+	Particle &pose( xi_k[i] );
+	pose.meas_pos = base::Vector3d( pose.position.x(), pose.position.y(), pose.zPos );
+	pose.meas_theta = pose.orientation;
+	pose.floating = true;
+	pose.mprob = 1.0;
+	pose.cpoints.clear();
+	pose.weight *= config.deadlineWeightFactor;
+    }
+
+    completedFraction = n > 0 ? static_cast<double>( evaluatedCount ) / n : 1.0;
 }
 
 base::Pose PoseEstimator::getCentroid()
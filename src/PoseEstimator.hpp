@@ -12,6 +12,7 @@
 #include <Eigen/Geometry>
 
 #include <base/Pose.hpp>
+#include <base/Time.hpp>
 #include <odometry/ContactOdometry.hpp>
 
 #include <envire/Core.hpp>
@@ -19,8 +20,14 @@
 
 #include <eslam/ContactModel.hpp>
 #include "SurfaceHash.hpp"
+#include "GridPager.hpp"
+#include "MortonOrder.hpp"
+#include "LikelihoodCache.hpp"
 
 #include <limits>
+#include <map>
+#include <set>
+#include <iostream>
 
 namespace eslam
 {
@@ -33,6 +40,10 @@ class GridAccess
     MapPtr map;
 
 public:
+    /** maximum distance in m of a patch from a contact point, which is
+     * used for the likelihood of the contact point */
+    static const double LOOKUP_DISTANCE;
+
     static void detachItem( envire::MLSMap* item )
     {
 	if(item && item->isAttached() ) 
@@ -65,6 +76,12 @@ public:
 	}
     }
 
+    /** deleter for maps which are owned by the environment, like a shared
+     * map which might be used by other filters as well */
+    static void keepItem( envire::MLSMap* item )
+    {
+    }
+
     void setMap( MapPtr _map ) 
     {
 	envire::Environment *env = _map->getEnvironment();
@@ -86,6 +103,13 @@ public:
 	return map.get();
     }
 
+    /** true if no other GridAccess uses the map, so it is released together
+     * with this one */
+    bool isUnique() const
+    {
+	return map.unique();
+    }
+
     void copy( const GridAccess& other )
     {
 	envire::MLSMap::Ptr new_map = other.map->cloneDeep();
@@ -98,7 +122,7 @@ public:
     {
 	if( map )
 	{
-	    if( map->getPatch( C_global2local * position, patch, 3.0 ) )
+	    if( map->getPatch( C_global2local * position, patch, LOOKUP_DISTANCE ) )
 		return true;
 	}
 	return false;
@@ -123,18 +147,171 @@ public:
     PoseEstimator(odometry::FootContact& odometry, const eslam::Configuration &config);
     ~PoseEstimator();
 
-    void init( int numParticles, SurfaceHash *hash );
+    /** 
+     * sample the initial particles from the hash. The hash is not modified
+     * and can be shared with other filters.
+     */
+    void init( int numParticles, const SurfaceHash *hash );
     void init(int numParticles, const base::Pose2D& mu, const base::Pose2D& sigma, double zpos = 0, double zsigma = 0);
     void project(const odometry::BodyContactState& state, const base::Quaterniond& orientation);
-    void update(const odometry::BodyContactState& state, const base::Quaterniond& orientation, const std::vector<terrain_estimator::TerrainClassification>& ltc );
+    /** 
+     * update the particle weights with the contact state.
+     *
+     * @param deadline - if not null, the particles are evaluated in the
+     *                   order of their priority until the deadline has
+     *                   passed, see Configuration::deadlinePriorityFraction.
+     *                   The particles which could not be evaluated in time
+     *                   are treated like particles without contact. If the
+     *                   deadline has passed after the evaluation, the
+     *                   resampling is deferred to a later update.
+     */
+    void update(const odometry::BodyContactState& state, const base::Quaterniond& orientation, const std::vector<terrain_estimator::TerrainClassification>& ltc, const base::Time& deadline = base::Time() );
 
     void setEnvironment(envire::Environment *env, envire::MLSMap::Ptr map, bool useShared );
     void cloneMaps();
 
+    /** 
+     * page the grids of the per particle maps in and out, based on the
+     * particle positions. Does nothing if paging is disabled or a shared map
+     * is used.
+     */
+    void pageMaps();
+    GridPager& getPager() { return pager; }
+
+    /** 
+     * let particles which are within the given distance and angle of each
+     * other use the same map, which is the one of the particle with the
+     * highest weight. The particles keep sharing the map when they are
+     * resampled, unless NUMA placement moves them to another node.
+     *
+     * @result the number of particles which now use another map
+     */
+    size_t shareMaps( double distance, double angle );
+
+    /** resample the particles to the given number of particles */
+    void reduceParticles( size_t count );
+
+    /** switch the generation of debug data in the particles on or off */
+    void setLogDebug( bool logDebug );
+
+    /** 
+     * write the particles, the state of the random generators and
+     * distributions and the counters to a checkpoint. The particle maps
+     * and the debug data of the particles are not written.
+     */
+    void writeState( std::ostream& os ) const;
+    /** restore the state written by writeState. The maps of the particles
+     * need to be set afterwards, using setEnvironment or setMaps. */
+    void readState( std::istream& is );
+
+    /** 
+     * set the per particle maps, where maps[i] is used by particle i. The
+     * same map can be given for more than one particle, in which case it
+     * stays shared like the maps of shareMaps.
+     */
+    void setMaps( envire::Environment *env, const std::vector<envire::MLSMap*>& maps );
+
+    /** set the hash that is used for sampling new particles */
+    void setSurfaceHash( const SurfaceHash *hash );
+
     base::Pose getCentroid();
 
+    /** effective number of particles after the last weight update, before
+     * resampling */
+    double getEffectiveCount() const { return effectiveCount; }
+    /** 
+     * information gain of the last weight update in nats, which is the
+     * Kullback-Leibler divergence of the particle weights after the update
+     * from the ones before.
+     */
+    double getInformationGain() const { return informationGain; }
+
+    /** 
+     * indices of the particles in the order they should be processed in.
+     * If useSpatialOrder is set, this is the order along a space filling
+     * curve, which is updated after projection and resampling. Otherwise
+     * it is the identity.
+     */
+    const std::vector<size_t>& getOrder();
+
+    /** cache of the contact model evaluations, see
+     * Configuration::useLikelihoodCache */
+    const LikelihoodCache& getLikelihoodCache() const { return likelihoodCache; }
+
+    /** number of particles which were evaluated with the contact model in
+     * the last weight update. This is less than the number of particles
+     * if Configuration::useClusterEvaluation is set. */
+    size_t getEvaluatedCount() const { return evaluatedCount; }
+
+    /** fraction of the particles which were evaluated before the deadline
+     * of the last weight update, 1.0 if there was no deadline */
+    double getCompletedFraction() const { return completedFraction; }
+
+    /**
+     * order in which the particles are evaluated if there is a deadline.
+     *
+     * @param order - indices of the particles in spatial order
+     * @param weights - prior weights of the particles
+     * @param priorityFraction - fraction of the particles with the highest
+     *                           weight which come first
+     * @param sequence [out] - the priority particles ordered by weight,
+     *                         followed by the other particles in bit
+     *                         reversed spatial order
+     */
+    static void getPriorityOrder( const std::vector<size_t>& order, 
+	    const std::vector<double>& weights, double priorityFraction, 
+	    std::vector<size_t>& sequence );
+
+    /** number of islands the particles are split into, see
+     * Configuration::islandCount */
+    size_t getIslandCount() const;
+    /** index of the first particle of the island. The island ends at the
+     * beginning of the next one. */
+    size_t getIslandBegin( size_t island ) const;
+
 private:
-    void updateWeights(const odometry::BodyContactState& state, const base::Quaterniond& orientation);
+    void updateWeights(const odometry::BodyContactState& state, const base::Quaterniond& orientation, const base::Time& deadline);
+    void updateOrder();
+
+    /** copy of the contact model for the calling thread */
+    ContactModel& getThreadModel();
+    /** evaluate the contact model for a single particle and update its
+     * weight, height and contact points. 
+     * @result true if there was a measurement for the particle */
+    bool evaluateParticle( Particle& pose, ContactModel& model, bool useCache );
+    /** apply the evaluation of the particle from to the particle to,
+     * including the change of the height estimate from zPos and zSigma,
+     * which are the height of from before its evaluation */
+    void copyEvaluation( const Particle& from, double zPos, double zSigma, Particle& to );
+    /** evaluate the particles in parallel. With the cache, the particles
+     * which fill it are evaluated before the others. */
+    void evaluateParticles( const std::vector<size_t>& indices, bool useCache );
+    /** split the particles into the first particle of each cache bin
+     * which is not in the cache yet, and the others */
+    void splitCacheOwners( const std::vector<size_t>& indices, 
+	    std::vector<size_t>& owners, std::vector<size_t>& others ) const;
+    /** evaluate the representatives of the particle clusters first, and
+     * the other particles only for clusters with a high likelihood */
+    void evaluateClusters( const std::vector<size_t>& order, bool useCache );
+    /** evaluate the particles with the highest prior weight first, followed
+     * by a stratified sample of the others, until the deadline */
+    void evaluateUntil( const base::Time& deadline, const std::vector<size_t>& order, bool useCache );
+
+    /** normalize the weights with a reduction over the island sums
+     * @result the global effective particle count */
+    double normalizeIslands();
+    /** resample the islands whose effective count is too low
+     * @result true if any island was resampled */
+    bool resampleIslands();
+    /** pass the best particles of each island on to the next one */
+    void migrateIslands();
+
+    /** NUMA node of the particle, see Configuration::useNumaPlacement */
+    int getParticleNode( size_t index ) const;
+    /** let the particles use the copy of the shared map on their node */
+    void placeSharedMaps();
+    /** evaluate the particles with threads running on their node */
+    void evaluateOnNodes( const std::vector<size_t>& order, bool useCache );
 
     boost::variate_generator<boost::minstd_rand&, boost::normal_distribution<> > rand_norm;
     boost::variate_generator<boost::minstd_rand&, boost::uniform_real<> > rand_uni;
@@ -143,15 +320,47 @@ private:
 
     eslam::Configuration config;
     ContactModel contactModel;
+    /** copies of the contact model for each thread of the weight update */
+    std::vector<ContactModel> threadModels;
     odometry::FootContact &odometry;
 
-    SurfaceHash *hash;
+    const SurfaceHash *hash;
     
     envire::Environment *env;
     bool useShared;
+    GridPager pager;
 
     base::Quaterniond zCompensatedOrientation;
     double max_weight;
+
+    /** number of projection steps, used for the hash sampling period */
+    size_t hashCount;
+    /** number of weight updates */
+    size_t iteration;
+
+    /** normalized weights before the last weight update */
+    std::vector<double> priorWeights;
+    double effectiveCount;
+    double informationGain;
+
+    MortonOrder spatialOrder;
+    LikelihoodCache likelihoodCache;
+    size_t evaluatedCount;
+    double completedFraction;
+
+    std::vector<boost::minstd_rand> islandGens;
+    size_t islandUpdates;
+
+    /** number of NUMA nodes the particles are placed on */
+    int numaNodes;
+    /** node of each per particle map */
+    std::map<envire::MLSMap*, int> mapNodes;
+    /** copy of the shared map for each node */
+    std::vector<boost::shared_ptr<envire::MLSMap> > sharedReplicas;
+
+    /** per particle maps which are used by several particles on purpose,
+     * see shareMaps. cloneMaps does not clone them apart. */
+    std::set<envire::MLSMap*> sharedMaps;
 };
 
 }
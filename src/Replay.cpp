@@ -0,0 +1,550 @@
+#include "Replay.hpp"
+#include "PerfCounters.hpp"
+
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+
+using namespace eslam;
+
+namespace
+{
+const char LOG_MAGIC[] = "ESLAMLOG";
+const boost::uint32_t LOG_VERSION = 1;
+
+template <class T>
+void writeValue( std::ostream& os, const T& value )
+{
+    os.write( reinterpret_cast<const char*>( &value ), sizeof( T ) );
+}
+
+template <class T>
+void readValue( std::istream& is, T& value )
+{
+    is.read( reinterpret_cast<char*>( &value ), sizeof( T ) );
+    if( !is )
+	throw std::runtime_error( "the log is truncated." );
+}
+
+template <class T>
+void writeVector( std::ostream& os, const std::vector<T>& values )
+{
+    writeValue( os, static_cast<boost::uint32_t>( values.size() ) );
+    if( !values.empty() )
+	os.write( reinterpret_cast<const char*>( &values[0] ), values.size() * sizeof( T ) );
+}
+
+template <class T>
+void readVector( std::istream& is, std::vector<T>& values )
+{
+    boost::uint32_t size;
+    readValue( is, size );
+    values.resize( size );
+    if( size )
+    {
+	is.read( reinterpret_cast<char*>( &values[0] ), size * sizeof( T ) );
+	if( !is )
+	    throw std::runtime_error( "the log is truncated." );
+    }
+}
+
+void writeTransform( std::ostream& os, const Eigen::Affine3d& t )
+{
+    const Eigen::Quaterniond q( t.linear() );
+    writeValue( os, t.translation().x() );
+    writeValue( os, t.translation().y() );
+    writeValue( os, t.translation().z() );
+    writeValue( os, q.x() );
+    writeValue( os, q.y() );
+    writeValue( os, q.z() );
+    writeValue( os, q.w() );
+}
+
+void readTransform( std::istream& is, Eigen::Affine3d& t )
+{
+    double v[7];
+    for( size_t i = 0; i < 7; i++ )
+	readValue( is, v[i] );
+    t = Eigen::Translation3d( v[0], v[1], v[2] )
+	* Eigen::Quaterniond( v[6], v[3], v[4], v[5] );
+}
+
+double normalizeAngle( double angle )
+{
+    return atan2( sin( angle ), cos( angle ) );
+}
+
+/** enables the stage timing of PerfStats during its lifetime */
+class TimingScope
+{
+public:
+    TimingScope()
+	: previous( PerfStats::isTimingEnabled() )
+    {
+	PerfStats::setTimingEnabled( true );
+    }
+
+    ~TimingScope()
+    {
+	PerfStats::setTimingEnabled( previous );
+    }
+
+private:
+    bool previous;
+};
+}
+
+LogWriter::LogWriter( const std::string& path )
+    : os( path.c_str(), std::ios::binary )
+{
+    if( !os )
+	throw std::runtime_error( "could not open the log " + path + " for writing." );
+
+    os.write( LOG_MAGIC, sizeof( LOG_MAGIC ) - 1 );
+    writeValue( os, LOG_VERSION );
+}
+
+void LogWriter::write( const LogRecord& record )
+{
+    writeValue( os, static_cast<boost::uint8_t>( record.type ) );
+    writeValue( os, static_cast<boost::int64_t>( record.time.toMicroseconds() ) );
+    writeTransform( os, record.body2odometry );
+
+    switch( record.type )
+    {
+	case LogRecord::CONTACT_STATE:
+	{
+	    const std::vector<odometry::BodyContactPoint> &points( record.contactState.points );
+	    writeValue( os, static_cast<boost::uint32_t>( points.size() ) );
+	    for( size_t i = 0; i < points.size(); i++ )
+	    {
+		writeValue( os, points[i].position.x() );
+		writeValue( os, points[i].position.y() );
+		writeValue( os, points[i].position.z() );
+		writeValue( os, points[i].contact );
+		writeValue( os, points[i].slip );
+		writeValue( os, static_cast<boost::int32_t>( points[i].groupId ) );
+	    }
+	    break;
+	}
+	case LogRecord::LASER_SCAN:
+	{
+	    const base::samples::LaserScan &scan( record.scan );
+	    writeTransform( os, record.sensor2body );
+	    writeValue( os, scan.start_angle );
+	    writeValue( os, scan.angular_resolution );
+	    writeValue( os, scan.speed );
+	    writeValue( os, static_cast<boost::uint32_t>( scan.minRange ) );
+	    writeValue( os, static_cast<boost::uint32_t>( scan.maxRange ) );
+	    std::vector<boost::uint32_t> ranges( scan.ranges.begin(), scan.ranges.end() );
+	    writeVector( os, ranges );
+	    break;
+	}
+	case LogRecord::DISTANCE_IMAGE:
+	{
+	    const base::samples::DistanceImage &dimage( record.dimage );
+	    writeTransform( os, record.sensor2body );
+	    writeValue( os, static_cast<boost::uint32_t>( dimage.width ) );
+	    writeValue( os, static_cast<boost::uint32_t>( dimage.height ) );
+	    writeValue( os, static_cast<float>( dimage.scale_x ) );
+	    writeValue( os, static_cast<float>( dimage.scale_y ) );
+	    writeValue( os, static_cast<float>( dimage.center_x ) );
+	    writeValue( os, static_cast<float>( dimage.center_y ) );
+	    std::vector<float> data( dimage.data.begin(), dimage.data.end() );
+	    writeVector( os, data );
+	    break;
+	}
+	case LogRecord::GROUND_TRUTH:
+	    break;
+	default:
+	    throw std::runtime_error( "unknown log record type." );
+    }
+
+    if( !os )
+	throw std::runtime_error( "could not write to the log." );
+}
+
+void LogWriter::writeContactState( const base::Time& time, const Eigen::Affine3d& body2odometry, const odometry::BodyContactState& bs )
+{
+    LogRecord record;
+    record.type = LogRecord::CONTACT_STATE;
+    record.time = time;
+    record.body2odometry = body2odometry;
+    record.contactState = bs;
+    write( record );
+}
+
+void LogWriter::writeLaserScan( const base::Time& time, const Eigen::Affine3d& body2odometry, const base::samples::LaserScan& scan, const Eigen::Affine3d& laser2body )
+{
+    LogRecord record;
+    record.type = LogRecord::LASER_SCAN;
+    record.time = time;
+    record.body2odometry = body2odometry;
+    record.sensor2body = laser2body;
+    record.scan = scan;
+    write( record );
+}
+
+void LogWriter::writeDistanceImage( const base::Time& time, const Eigen::Affine3d& body2odometry, const base::samples::DistanceImage& dimage, const Eigen::Affine3d& camera2body )
+{
+    LogRecord record;
+    record.type = LogRecord::DISTANCE_IMAGE;
+    record.time = time;
+    record.body2odometry = body2odometry;
+    record.sensor2body = camera2body;
+    record.dimage = dimage;
+    write( record );
+}
+
+void LogWriter::writeGroundTruth( const base::Time& time, const Eigen::Affine3d& body2world )
+{
+    LogRecord record;
+    record.type = LogRecord::GROUND_TRUTH;
+    record.time = time;
+    record.body2odometry = body2world;
+    write( record );
+}
+
+LogReader::LogReader( const std::string& path )
+    : is( path.c_str(), std::ios::binary )
+{
+    if( !is )
+	throw std::runtime_error( "could not open the log " + path + "." );
+
+    char magic[sizeof( LOG_MAGIC ) - 1];
+    is.read( magic, sizeof( magic ) );
+    boost::uint32_t version = 0;
+    if( is )
+	readValue( is, version );
+    if( !is || memcmp( magic, LOG_MAGIC, sizeof( magic ) ) != 0 )
+	throw std::runtime_error( path + " is not a filter log." );
+    if( version != LOG_VERSION )
+	throw std::runtime_error( "the log version is not supported." );
+
+    start = is.tellg();
+}
+
+bool LogReader::read( LogRecord& record )
+{
+    boost::uint8_t type;
+    is.read( reinterpret_cast<char*>( &type ), sizeof( type ) );
+    if( !is )
+	return false;
+
+    boost::int64_t time;
+    readValue( is, time );
+    record.type = static_cast<LogRecord::Type>( type );
+    record.time = base::Time::fromMicroseconds( time );
+    readTransform( is, record.body2odometry );
+
+    switch( record.type )
+    {
+	case LogRecord::CONTACT_STATE:
+	{
+	    boost::uint32_t count;
+	    readValue( is, count );
+	    record.contactState.time = record.time;
+	    std::vector<odometry::BodyContactPoint> &points( record.contactState.points );
+	    points.resize( count );
+	    for( size_t i = 0; i < count; i++ )
+	    {
+		boost::int32_t groupId;
+		readValue( is, points[i].position.x() );
+		readValue( is, points[i].position.y() );
+		readValue( is, points[i].position.z() );
+		readValue( is, points[i].contact );
+		readValue( is, points[i].slip );
+		readValue( is, groupId );
+		points[i].groupId = groupId;
+	    }
+	    break;
+	}
+	case LogRecord::LASER_SCAN:
+	{
+	    base::samples::LaserScan &scan( record.scan );
+	    boost::uint32_t minRange, maxRange;
+	    std::vector<boost::uint32_t> ranges;
+	    readTransform( is, record.sensor2body );
+	    readValue( is, scan.start_angle );
+	    readValue( is, scan.angular_resolution );
+	    readValue( is, scan.speed );
+	    readValue( is, minRange );
+	    readValue( is, maxRange );
+	    readVector( is, ranges );
+	    scan.time = record.time;
+	    scan.minRange = minRange;
+	    scan.maxRange = maxRange;
+	    scan.ranges.assign( ranges.begin(), ranges.end() );
+	    scan.remission.clear();
+	    break;
+	}
+	case LogRecord::DISTANCE_IMAGE:
+	{
+	    base::samples::DistanceImage &dimage( record.dimage );
+	    boost::uint32_t width, height;
+	    float scale_x, scale_y, center_x, center_y;
+	    std::vector<float> data;
+	    readTransform( is, record.sensor2body );
+	    readValue( is, width );
+	    readValue( is, height );
+	    readValue( is, scale_x );
+	    readValue( is, scale_y );
+	    readValue( is, center_x );
+	    readValue( is, center_y );
+	    readVector( is, data );
+	    if( data.size() != static_cast<size_t>( width ) * height )
+		throw std::runtime_error( "the log contains an invalid distance image." );
+	    dimage.time = record.time;
+	    dimage.width = width;
+	    dimage.height = height;
+	    dimage.scale_x = scale_x;
+	    dimage.scale_y = scale_y;
+	    dimage.center_x = center_x;
+	    dimage.center_y = center_y;
+	    dimage.data.assign( data.begin(), data.end() );
+	    break;
+	}
+	case LogRecord::GROUND_TRUTH:
+	    break;
+	default:
+	    throw std::runtime_error( "the log contains an unknown record type." );
+    }
+
+    return true;
+}
+
+void LogReader::rewind()
+{
+    is.clear();
+    is.seekg( start );
+}
+
+double LatencyStats::total() const
+{
+    double sum = 0;
+    for( size_t i = 0; i < samples.size(); i++ )
+	sum += samples[i];
+    return sum;
+}
+
+double LatencyStats::mean() const
+{
+    return samples.empty() ? 0.0 : total() / samples.size();
+}
+
+double LatencyStats::percentile( double p ) const
+{
+    if( samples.empty() )
+	return 0.0;
+
+    // nearest rank on a sorted copy
+    std::vector<double> sorted( samples );
+    std::sort( sorted.begin(), sorted.end() );
+    const double rank = std::ceil( std::min( std::max( p, 0.0 ), 100.0 ) / 100.0 * sorted.size() );
+    const size_t idx = rank > 0 ? static_cast<size_t>( rank ) - 1 : 0;
+    return sorted[idx];
+}
+
+namespace
+{
+void printLatency( std::ostream& os, const std::string& name, const LatencyStats& stats )
+{
+    os << std::setw( 24 ) << std::left << name << std::right
+	<< std::setw( 8 ) << stats.count()
+	<< std::setw( 12 ) << stats.mean() * 1e3
+	<< std::setw( 12 ) << stats.percentile( 50 ) * 1e3
+	<< std::setw( 12 ) << stats.percentile( 90 ) * 1e3
+	<< std::setw( 12 ) << stats.percentile( 99 ) * 1e3
+	<< std::setw( 12 ) << stats.percentile( 100 ) * 1e3
+	<< std::endl;
+}
+}
+
+void ReplayResult::print( std::ostream& os ) const
+{
+    std::ios::fmtflags flags( os.flags() );
+    os << std::fixed << std::setprecision( 3 );
+
+    os << "records: " << records << " in " << wallTime << " s" << std::endl;
+    os << std::setw( 24 ) << std::left << "stage [ms]" << std::right
+	<< std::setw( 8 ) << "count"
+	<< std::setw( 12 ) << "mean"
+	<< std::setw( 12 ) << "p50"
+	<< std::setw( 12 ) << "p90"
+	<< std::setw( 12 ) << "p99"
+	<< std::setw( 12 ) << "max"
+	<< std::endl;
+    printLatency( os, "update", update );
+    for( std::map<std::string, LatencyStats>::const_iterator it = stages.begin(); it != stages.end(); it++ )
+	printLatency( os, "  " + it->first, it->second );
+
+    if( groundTruthCount > 0 )
+    {
+	os << "final position error: " << finalPositionError << " m" << std::endl;
+	os << "final heading error: " << finalHeadingError * 180.0 / M_PI << " deg" << std::endl;
+	os << "mean position error: " << meanPositionError << " m" << std::endl;
+    }
+
+    if( cacheLookups > 0 )
+	os << "likelihood cache: " << cacheHits << " hits of " << cacheLookups 
+	    << " lookups (" << 100.0 * cacheHits / cacheLookups << " %)" << std::endl;
+
+    os << "state digest: " << std::hex << std::setw( 16 ) << std::setfill( '0' )
+	<< stateDigest << std::setfill( ' ' ) << std::endl;
+
+    os.flags( flags );
+}
+
+Replay::Replay( const odometry::Configuration& odometryConfig,
+	const eslam::Configuration& eslamConfig )
+    : odometryConfig( odometryConfig ),
+    eslamConfig( eslamConfig ),
+    realTimeFactor( 0 )
+{
+    // mapping in a background thread would make the result depend on the
+    // timing of the threads
+    this->eslamConfig.asyncMapping = false;
+}
+
+void Replay::setRealTimeFactor( double factor )
+{
+    realTimeFactor = factor;
+}
+
+EmbodiedSlamFilter* Replay::getFilter()
+{
+    return filter.get();
+}
+
+void Replay::clear()
+{
+    filter.reset();
+}
+
+ReplayResult Replay::run( LogReader& log, envire::Environment* env )
+{
+    ReplayResult result;
+    filter.reset( new EmbodiedSlamFilter( odometryConfig, eslamConfig ) );
+
+    const bool useSharedMap = !env->getItems<envire::MLSGrid>().empty();
+    const std::vector<terrain_estimator::TerrainClassification> ltc;
+
+    Eigen::Affine3d groundTruth( Eigen::Affine3d::Identity() );
+    bool initialized = false;
+    double sumPositionError = 0;
+
+    TimingScope timing;
+    const std::map<std::string, PerfStage> stagesBefore = PerfStats::getStages();
+
+    LogRecord record;
+    base::Time logStart, wallStart = base::Time::now();
+    while( log.read( record ) )
+    {
+	if( result.records == 0 )
+	    logStart = record.time;
+	result.records++;
+
+	if( realTimeFactor > 0 )
+	{
+	    const double wait =
+		( record.time - logStart ).toSeconds() / realTimeFactor
+		- ( base::Time::now() - wallStart ).toSeconds();
+	    if( wait > 0 )
+		boost::this_thread::sleep( boost::posix_time::microseconds( static_cast<long>( wait * 1e6 ) ) );
+	}
+
+	if( record.type == LogRecord::GROUND_TRUTH )
+	{
+	    groundTruth = record.body2odometry;
+	    if( initialized )
+	    {
+		const Eigen::Affine3d centroid = filter->getCentroid();
+		result.finalPositionError =
+		    ( centroid.translation() - groundTruth.translation() ).norm();
+		result.finalHeadingError = fabs( normalizeAngle(
+			    base::getYaw( Eigen::Quaterniond( centroid.linear() ) )
+			    - base::getYaw( Eigen::Quaterniond( groundTruth.linear() ) ) ) );
+		sumPositionError += result.finalPositionError;
+		result.groundTruthCount++;
+	    }
+	    continue;
+	}
+
+	if( !initialized )
+	{
+	    filter->init( env, base::Pose( groundTruth ), useSharedMap );
+	    initialized = true;
+	}
+
+	const base::Time start = base::Time::now();
+	switch( record.type )
+	{
+	    case LogRecord::CONTACT_STATE:
+		filter->update( record.body2odometry, record.contactState, ltc );
+		break;
+	    case LogRecord::LASER_SCAN:
+		filter->update( record.body2odometry, record.scan, record.sensor2body );
+		break;
+	    case LogRecord::DISTANCE_IMAGE:
+		filter->update( record.body2odometry, record.dimage, record.sensor2body );
+		break;
+	    default:
+		break;
+	}
+	result.update.add( ( base::Time::now() - start ).toSeconds() );
+    }
+
+    // the durations of the stages which were recorded during the run
+    const std::map<std::string, PerfStage> stages = PerfStats::getStages();
+    for( std::map<std::string, PerfStage>::const_iterator it = stages.begin(); it != stages.end(); it++ )
+    {
+	std::map<std::string, PerfStage>::const_iterator prev = stagesBefore.find( it->first );
+	const size_t first = prev != stagesBefore.end() ? prev->second.durations.size() : 0;
+	for( size_t i = first; i < it->second.durations.size(); i++ )
+	    result.stages[it->first].add( it->second.durations[i] );
+    }
+
+    result.wallTime = ( base::Time::now() - wallStart ).toSeconds();
+    if( result.groundTruthCount > 0 )
+	result.meanPositionError = sumPositionError / result.groundTruthCount;
+    if( initialized )
+    {
+	result.stateDigest = computeDigest( filter->getParticles() );
+	result.cacheLookups = filter->getLikelihoodCache().getLookups();
+	result.cacheHits = filter->getLikelihoodCache().getHits();
+    }
+
+    return result;
+}
+
+namespace
+{
+void hashBytes( boost::uint64_t& hash, const void* data, size_t size )
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>( data );
+    for( size_t i = 0; i < size; i++ )
+    {
+	hash ^= bytes[i];
+	hash *= 1099511628211ULL;
+    }
+}
+}
+
+boost::uint64_t Replay::computeDigest( const std::vector<PoseEstimator::Particle>& particles )
+{
+    boost::uint64_t hash = 14695981039346656037ULL;
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	const PoseEstimator::Particle &p( particles[i] );
+	hashBytes( hash, p.position.data(), sizeof( double ) * 2 );
+	hashBytes( hash, &p.orientation, sizeof( p.orientation ) );
+	hashBytes( hash, &p.zPos, sizeof( p.zPos ) );
+	hashBytes( hash, &p.zSigma, sizeof( p.zSigma ) );
+	hashBytes( hash, &p.weight, sizeof( p.weight ) );
+    }
+    return hash;
+}
@@ -0,0 +1,218 @@
+#ifndef __ESLAM_REPLAY_HPP__
+#define __ESLAM_REPLAY_HPP__
+
+#include "EmbodiedSlamFilter.hpp"
+
+#include <base/samples/LaserScan.hpp>
+#include <base/samples/DistanceImage.hpp>
+#include <base/Time.hpp>
+#include <base/Pose.hpp>
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace eslam
+{
+
+/**
+ * A single entry of a recorded sensor stream. Depending on the type, only
+ * some of the fields are used.
+ */
+struct LogRecord
+{
+    enum Type
+    {
+	CONTACT_STATE = 1,
+	LASER_SCAN = 2,
+	DISTANCE_IMAGE = 3,
+	GROUND_TRUTH = 4
+    };
+
+    LogRecord()
+	: type( CONTACT_STATE ),
+	body2odometry( Eigen::Affine3d::Identity() ),
+	sensor2body( Eigen::Affine3d::Identity() ) {}
+
+    Type type;
+    base::Time time;
+
+    /** odometry pose for sensor data, or pose in the world frame for the
+     * ground truth */
+    Eigen::Affine3d body2odometry;
+    /** sensor pose for laser scans and distance images */
+    Eigen::Affine3d sensor2body;
+
+    odometry::BodyContactState contactState;
+    base::samples::LaserScan scan;
+    base::samples::DistanceImage dimage;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/**
+ * Writes a sensor stream in the binary log format. Transforms are stored as
+ * translation and quaternion, and the sample data without the fields the
+ * filter does not use. Like the checkpoints, values are stored in their native
+ * representation.
+ */
+class LogWriter
+{
+public:
+    explicit LogWriter( const std::string& path );
+
+    void write( const LogRecord& record );
+
+    void writeContactState( const base::Time& time, const Eigen::Affine3d& body2odometry, const odometry::BodyContactState& bs );
+    void writeLaserScan( const base::Time& time, const Eigen::Affine3d& body2odometry, const base::samples::LaserScan& scan, const Eigen::Affine3d& laser2body );
+    void writeDistanceImage( const base::Time& time, const Eigen::Affine3d& body2odometry, const base::samples::DistanceImage& dimage, const Eigen::Affine3d& camera2body );
+    void writeGroundTruth( const base::Time& time, const Eigen::Affine3d& body2world );
+
+private:
+    std::ofstream os;
+};
+
+/**
+ * Reads a log written by LogWriter.
+ */
+class LogReader
+{
+public:
+    explicit LogReader( const std::string& path );
+
+    /**
+     * read the next record.
+     * @result false at the end of the log
+     */
+    bool read( LogRecord& record );
+
+    /** start reading from the first record again */
+    void rewind();
+
+private:
+    std::ifstream is;
+    std::streampos start;
+};
+
+/**
+ * Collects latency samples and computes percentiles over them.
+ */
+class LatencyStats
+{
+public:
+    void add( double seconds ) { samples.push_back( seconds ); }
+    size_t count() const { return samples.size(); }
+    double total() const;
+    double mean() const;
+    /** @param p - percentile in the range [0,100] */
+    double percentile( double p ) const;
+
+private:
+    std::vector<double> samples;
+};
+
+/**
+ * Result of a replay run.
+ */
+struct ReplayResult
+{
+    ReplayResult()
+	: records( 0 ), wallTime( 0 ),
+	finalPositionError( 0 ), finalHeadingError( 0 ),
+	meanPositionError( 0 ), groundTruthCount( 0 ),
+	cacheLookups( 0 ), cacheHits( 0 ),
+	stateDigest( 0 ) {}
+
+    /** latency of each filter update, over all record types */
+    LatencyStats update;
+    /** latency of the stages of the filter, by the names of their
+     * PerfScope, e.g. project, updateWeights or projectLaserScan */
+    std::map<std::string, LatencyStats> stages;
+
+    size_t records;
+    /** total wall time of the run in seconds */
+    double wallTime;
+
+    /** error of the filter centroid against the last ground truth pose */
+    double finalPositionError;
+    double finalHeadingError;
+    /** position error averaged over all ground truth records */
+    double meanPositionError;
+    size_t groundTruthCount;
+
+    /** lookups and hits of the likelihood cache */
+    size_t cacheLookups, cacheHits;
+
+    /**
+     * hash over the final particle states. Two runs with the same log,
+     * configuration and seed give the same digest.
+     */
+    boost::uint64_t stateDigest;
+
+    void print( std::ostream& os ) const;
+};
+
+/**
+ * Runs a recorded sensor stream through the EmbodiedSlamFilter without any
+ * visualization.
+ *
+ * The replay is reproducible: the filter only uses the random generator
+ * seeded with Configuration::seed, and the asynchronous mapping is switched
+ * off, so the order of the updates only depends on the log. This also holds
+ * if the library is built with USE_OPENMP, as the parallel parts of the
+ * filter write to separate particles and combine their sums in a fixed
+ * order, independent of the number of threads.
+ *
+ * The stage latencies are taken with the timing of PerfStats, which is
+ * enabled during a run.
+ */
+class Replay
+{
+public:
+    Replay( const odometry::Configuration& odometryConfig,
+	    const eslam::Configuration& eslamConfig );
+
+    /**
+     * speed of the replay relative to the timestamps of the log. 0 replays
+     * as fast as possible, which is the default.
+     */
+    void setRealTimeFactor( double factor );
+
+    /**
+     * run the log through a new filter.
+     *
+     * The filter is initialized with the first record which is not a ground
+     * truth record, using the last ground truth pose before it as the start
+     * pose, or the identity if there is none.
+     *
+     * @param env - environment for the filter. If it contains a MLS grid, it
+     *              is used as the shared prior map.
+     */
+    ReplayResult run( LogReader& log, envire::Environment* env );
+
+    /** the filter of the last run */
+    EmbodiedSlamFilter* getFilter();
+
+    /** delete the filter of the last run. As the filter uses the
+     * environment of the run, this needs to be called before the
+     * environment is deleted. */
+    void clear();
+
+    /** FNV-1a hash over the pose and weight of the particles */
+    static boost::uint64_t computeDigest( const std::vector<PoseEstimator::Particle>& particles );
+
+private:
+    odometry::Configuration odometryConfig;
+    eslam::Configuration eslamConfig;
+    double realTimeFactor;
+
+    boost::scoped_ptr<EmbodiedSlamFilter> filter;
+};
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "Replay.hpp"
+#include "Trace.hpp"
+#include "PerfCounters.hpp"
+
+#include <envire/Core.hpp>
+
+#include <boost/lexical_cast.hpp>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace eslam;
+
+namespace
+{
+void usage()
+{
+    std::cerr
+	<< "usage: eslam_replay <log> [options]" << std::endl
+	<< "  --env <path>       environment with the prior map" << std::endl
+	<< "  --rate <factor>    replay speed relative to the log, 0 for maximum speed" << std::endl
+	<< "  --seed <seed>      seed of the filter" << std::endl
+	<< "  --particles <n>    number of particles" << std::endl
+	<< "  --repeat <n>       replay n times and check that the results are identical" << std::endl
+	<< "  --trace <path>     write a chrome trace of the filter stages" << std::endl
+	<< "  --perf <0|1>       count cycles, instructions and misses per filter stage" << std::endl;
+}
+}
+
+int main( int argc, char **argv )
+{
+    if( argc < 2 )
+    {
+	usage();
+	return 1;
+    }
+
+    std::string logPath = argv[1], envPath, tracePath;
+    double rate = 0;
+    size_t repeat = 1;
+    eslam::Configuration eslamConfig;
+    odometry::Configuration odometryConfig;
+
+    for( int i = 2; i < argc; i++ )
+    {
+	const std::string arg = argv[i];
+	if( i + 1 >= argc )
+	{
+	    usage();
+	    return 1;
+	}
+	const std::string value = argv[++i];
+
+	if( arg == "--env" )
+	    envPath = value;
+	else if( arg == "--rate" )
+	    rate = boost::lexical_cast<double>( value );
+	else if( arg == "--seed" )
+	    eslamConfig.seed = boost::lexical_cast<unsigned long>( value );
+	else if( arg == "--particles" )
+	    eslamConfig.particleCount = boost::lexical_cast<size_t>( value );
+	else if( arg == "--repeat" )
+	    repeat = boost::lexical_cast<size_t>( value );
+	else if( arg == "--trace" )
+	    tracePath = value;
+	else if( arg == "--perf" )
+	    PerfStats::setEnabled( boost::lexical_cast<int>( value ) != 0 );
+	else
+	{
+	    usage();
+	    return 1;
+	}
+    }
+
+    try
+    {
+	LogReader log( logPath );
+	Replay replay( odometryConfig, eslamConfig );
+	replay.setRealTimeFactor( rate );
+
+	boost::uint64_t digest = 0;
+	for( size_t run = 0; run < repeat; run++ )
+	{
+	    // every run gets a fresh environment, as the filter adds its maps
+	    // to it
+	    boost::scoped_ptr<envire::Environment> env( envPath.empty() ?
+		    new envire::Environment() : envire::Environment::unserialize( envPath ) );
+
+	    log.rewind();
+	    ReplayResult result = replay.run( log, env.get() );
+	    result.print( std::cout );
+	    replay.clear();
+
+	    if( run > 0 && result.stateDigest != digest )
+	    {
+		std::cerr << "run " << run << " differs from the first run." << std::endl;
+		return 2;
+	    }
+	    digest = result.stateDigest;
+	}
+
+	if( PerfStats::isEnabled() )
+	{
+	    if( !PerfStats::isAvailable() )
+		std::cerr << "hardware counters are not available." << std::endl;
+	    PerfStats::print( std::cout );
+	}
+
+	if( !tracePath.empty() )
+	{
+	    if( !Trace::isCompiledIn() )
+		std::cerr << "the filter was built without ESLAM_TRACE, the trace is empty." << std::endl;
+	    else if( Trace::getDropped() > 0 )
+		std::cerr << Trace::getDropped() << " trace events were dropped." << std::endl;
+	    Trace::writeChromeTrace( tracePath );
+	}
+    }
+    catch( const std::exception& e )
+    {
+	std::cerr << e.what() << std::endl;
+	return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+#include "ScanProjection.hpp"
+
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+using namespace eslam;
+
+ScanProjection::ScanProjection()
+    : maxRange( std::numeric_limits<double>::infinity() ),
+    sensorNoise( 0.01 ),
+    resolution( 0 ),
+    pyramidLevels( 4 ),
+    grid( NULL ),
+    blockCount( 0 )
+{
+}
+
+void ScanProjection::setMaxRange( double range )
+{
+    maxRange = range;
+}
+
+void ScanProjection::setSensorNoise( double sigma )
+{
+    sensorNoise = sigma;
+}
+
+void ScanProjection::setResolution( double resolution )
+{
+    this->resolution = resolution;
+}
+
+void ScanProjection::setPyramidLevels( int levels )
+{
+    pyramidLevels = std::max( 0, levels );
+}
+
+size_t ScanProjection::getMemoryUsage() const
+{
+    size_t bytes = pyramid.capacity() * sizeof( PyramidLevel );
+    for( size_t l = 0; l < pyramid.size(); l++ )
+	bytes += pyramid[l].depth.capacity() * sizeof( float ) 
+	    + pyramid[l].index.capacity() * sizeof( boost::uint32_t );
+    return bytes;
+}
+
+void ScanProjection::begin( const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid )
+{
+    this->grid = &grid;
+    const Eigen::Affine3d C_s2g = sensor2grid.getTransform();
+    R = C_s2g.linear();
+    t = C_s2g.translation();
+    cov = sensor2grid.getCovariance();
+    blockCount = 0;
+}
+
+void ScanProjection::addPoint( const Eigen::Vector3d& point )
+{
+    block.col( blockCount++ ) = point;
+    if( blockCount == BLOCK_SIZE )
+	flush();
+}
+
+void ScanProjection::flush()
+{
+    if( blockCount == 0 )
+	return;
+
+    // rotate all points of the block at once
+    Eigen::Matrix<double, 3, Eigen::Dynamic, 0, 3, BLOCK_SIZE> rotated = 
+	R * block.leftCols( blockCount );
+
+    // The height variance of a point q = R*p + t is J * cov * J^T, with the
+    // z-row of the jacobian with respect to (rotation, translation) being
+    // J = [ (Rp).y, -(Rp).x, 0, 0, 0, 1 ].
+    const Eigen::Array<double, 1, Eigen::Dynamic, Eigen::RowMajor, 1, BLOCK_SIZE> 
+	a = rotated.row( 1 ).array(), b = -rotated.row( 0 ).array();
+    Eigen::Array<double, 1, Eigen::Dynamic, Eigen::RowMajor, 1, BLOCK_SIZE> var = 
+	a * a * cov(0,0) + b * b * cov(1,1) + 2.0 * a * b * cov(0,1)
+	+ 2.0 * a * cov(0,5) + 2.0 * b * cov(1,5) + cov(5,5) + sensorNoise * sensorNoise;
+
+    for( int i = 0; i < blockCount; i++ )
+    {
+	const Eigen::Vector3d q = rotated.col( i ) + t;
+
+	envire::MLSGrid::Position pos;
+	if( grid->toGrid( q.head<2>(), pos ) )
+	{
+	    envire::MLSGrid::SurfacePatch patch( q.z(), std::sqrt( var[i] ) );
+	    grid->updateCell( pos, patch );
+	}
+    }
+
+    blockCount = 0;
+}
+
+void ScanProjection::project( const base::samples::LaserScan& scan,
+	const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid )
+{
+    begin( sensor2grid, grid );
+
+    for( size_t i = 0; i < scan.ranges.size(); i++ )
+    {
+	if( !scan.isRangeValid( scan.ranges[i] ) )
+	    continue;
+
+	// ranges are given in mm
+	const double range = scan.ranges[i] * 1e-3;
+	if( range > maxRange )
+	    continue;
+
+	const double angle = scan.start_angle + i * scan.angular_resolution;
+	addPoint( Eigen::Vector3d( std::cos( angle ) * range, std::sin( angle ) * range, 0 ) );
+    }
+
+    flush();
+}
+
+void ScanProjection::addPixel( const base::samples::DistanceImage& dimage, size_t index )
+{
+    const double d = dimage.data[index];
+    // this also rejects NaN and infinite values
+    if( !(d > 0 && d <= maxRange) )
+	return;
+
+    const size_t x = index % dimage.width, y = index / dimage.width;
+    const double xp = x * dimage.scale_x + dimage.center_x;
+    const double yp = y * dimage.scale_y + dimage.center_y;
+    const Eigen::Vector3d p( xp * d, yp * d, d );
+    if( p.squaredNorm() <= maxRange * maxRange )
+	addPoint( p );
+}
+
+bool ScanProjection::isValidDepth( float depth ) const
+{
+    // the maximum range can be infinite, but a region without valid pixels
+    // has no index to project
+    return depth < std::numeric_limits<float>::infinity() && depth <= maxRange;
+}
+
+void ScanProjection::buildPyramid( const base::samples::DistanceImage& dimage )
+{
+    pyramid.resize( pyramidLevels );
+
+    size_t width = dimage.width, height = dimage.height;
+    for( int l = 0; l < pyramidLevels; l++ )
+    {
+	PyramidLevel &level( pyramid[l] );
+	level.width = (width + 1) / 2;
+	level.height = (height + 1) / 2;
+	level.depth.resize( level.width * level.height );
+	level.index.resize( level.width * level.height );
+
+	for( size_t y = 0; y < level.height; y++ )
+	{
+	    for( size_t x = 0; x < level.width; x++ )
+	    {
+		float minDepth = std::numeric_limits<float>::infinity();
+		boost::uint32_t minIndex = 0;
+		for( size_t cy = 2*y; cy < std::min( 2*y+2, height ); cy++ )
+		{
+		    for( size_t cx = 2*x; cx < std::min( 2*x+2, width ); cx++ )
+		    {
+			float d;
+			boost::uint32_t idx;
+			if( l == 0 )
+			{
+			    // the image itself is used as the finest level
+			    idx = cy * width + cx;
+			    d = dimage.data[idx];
+			}
+			else
+			{
+			    const PyramidLevel &child( pyramid[l-1] );
+			    d = child.depth[cy * width + cx];
+			    idx = child.index[cy * width + cx];
+			}
+
+			if( d > 0 && d < minDepth )
+			{
+			    minDepth = d;
+			    minIndex = idx;
+			}
+		    }
+		}
+		level.depth[y * level.width + x] = minDepth;
+		level.index[y * level.width + x] = minIndex;
+	    }
+	}
+
+	width = level.width;
+	height = level.height;
+    }
+}
+
+void ScanProjection::project( const base::samples::DistanceImage& dimage,
+	const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid )
+{
+    begin( sensor2grid, grid );
+
+    if( resolution <= 0 || pyramidLevels == 0 )
+    {
+	for( size_t i = 0; i < dimage.data.size(); i++ )
+	    addPixel( dimage, i );
+	flush();
+	return;
+    }
+
+    // The image is processed in blocks given by the coarsest level of the
+    // pyramid. For each block, the level is chosen so that the footprint of
+    // a pixel at the smallest depth in the block is about the target
+    // resolution. From that level only the pixel with the smallest depth of
+    // each 2^l x 2^l region is projected.
+    buildPyramid( dimage );
+
+    const double pixelSize = std::min( std::fabs( dimage.scale_x ), std::fabs( dimage.scale_y ) );
+    const PyramidLevel &top( pyramid.back() );
+    for( size_t by = 0; by < top.height; by++ )
+    {
+	for( size_t bx = 0; bx < top.width; bx++ )
+	{
+	    const float minDepth = top.depth[by * top.width + bx];
+	    if( !isValidDepth( minDepth ) )
+		continue;
+
+	    int level = 0;
+	    const double ratio = resolution / (minDepth * pixelSize);
+	    if( ratio >= 2.0 )
+		level = std::min( pyramidLevels, static_cast<int>( std::floor( std::log( ratio ) / std::log( 2.0 ) ) ) );
+
+	    // size of the block at the chosen level
+	    const size_t scale = 1 << (pyramidLevels - level);
+	    if( level == 0 )
+	    {
+		for( size_t y = by * scale; y < std::min( (by+1) * scale, dimage.height ); y++ )
+		    for( size_t x = bx * scale; x < std::min( (bx+1) * scale, dimage.width ); x++ )
+			addPixel( dimage, y * dimage.width + x );
+	    }
+	    else
+	    {
+		const PyramidLevel &l( pyramid[level-1] );
+		for( size_t y = by * scale; y < std::min( (by+1) * scale, l.height ); y++ )
+		    for( size_t x = bx * scale; x < std::min( (bx+1) * scale, l.width ); x++ )
+		    {
+			if( isValidDepth( l.depth[y * l.width + x] ) )
+			    addPixel( dimage, l.index[y * l.width + x] );
+		    }
+	    }
+	}
+    }
+
+    flush();
+}
+
+void ScanProjection::project( const std::vector<Eigen::Vector3d>& points,
+	const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid )
+{
+    begin( sensor2grid, grid );
+
+    const double maxRange2 = maxRange * maxRange;
+    for( size_t i = 0; i < points.size(); i++ )
+    {
+	if( points[i].squaredNorm() <= maxRange2 )
+	    addPoint( points[i] );
+    }
+
+    flush();
+}
@@ -0,0 +1,139 @@
+#ifndef __ESLAM_SCANPROJECTION_HPP__
+#define __ESLAM_SCANPROJECTION_HPP__
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <envire/Core.hpp>
+#include <envire/maps/MLSGrid.hpp>
+
+#include <base/samples/LaserScan.hpp>
+#include <base/samples/DistanceImage.hpp>
+
+#include <vector>
+#include <boost/cstdint.hpp>
+
+namespace eslam
+{
+
+/**
+ * Projects sensor data directly into a MLSGrid.
+ *
+ * This is a fused version of the LaserScan -> ScanMeshing -> TriMesh ->
+ * MLSProjection and DistanceGrid -> DistanceGridToPointcloud -> TriMesh ->
+ * MLSProjection chains. No intermediate envire items are created. The points
+ * are transformed in blocks, and the height uncertainty of each point is
+ * calculated in closed form from the uncertainty of the sensor transform,
+ * instead of composing a TransformWithUncertainty for every point.
+ */
+class ScanProjection
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    ScanProjection();
+
+    /** points further away from the sensor than this are ignored */
+    void setMaxRange( double range );
+
+    /** standard deviation of the range measurement, which is added to the
+     * height uncertainty of each point
+     */
+    void setSensorNoise( double sigma );
+
+    /** 
+     * set the sample spacing in m that is aimed for when projecting distance
+     * images. Usually this is the resolution of the target grid. A value of
+     * 0 will project all pixels. 
+     */
+    void setResolution( double resolution );
+
+    /** 
+     * number of levels of the depth pyramid used for distance images. The
+     * coarsest level combines blocks of 2^levels x 2^levels pixels.
+     *
+     * Only the pixel with the smallest depth of each region of the chosen
+     * level is projected. A farther surface which is visible in the same
+     * region, e.g. the ground behind an obstacle edge, is dropped.
+     */
+    void setPyramidLevels( int levels );
+
+    /**
+     * project a laser scan into the grid
+     *
+     * @param scan - the scan in the sensor frame
+     * @param sensor2grid - transform from the sensor to the grid frame
+     * @param grid - target grid
+     */
+    void project( const base::samples::LaserScan& scan,
+	    const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid );
+
+    /**
+     * project a distance image into the grid
+     *
+     * @param dimage - distance image in the sensor frame
+     * @param sensor2grid - transform from the sensor to the grid frame
+     * @param grid - target grid
+     */
+    void project( const base::samples::DistanceImage& dimage,
+	    const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid );
+
+    /**
+     * project a set of points into the grid
+     *
+     * @param points - points in the sensor frame
+     * @param sensor2grid - transform from the sensor to the grid frame
+     * @param grid - target grid
+     */
+    void project( const std::vector<Eigen::Vector3d>& points,
+	    const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid );
+
+    /** number of bytes used by the depth pyramid */
+    size_t getMemoryUsage() const;
+
+protected:
+    /** number of points which are transformed together */
+    static const int BLOCK_SIZE = 256;
+
+    /** 
+     * level of the depth pyramid. Each pixel holds the smallest depth of the
+     * corresponding 2x2 pixels of the next finer level, together with the
+     * index of that pixel in the original image. Pixels without a valid
+     * depth have an infinite depth.
+     */
+    struct PyramidLevel
+    {
+	size_t width, height;
+	std::vector<float> depth;
+	std::vector<boost::uint32_t> index;
+    };
+
+    void buildPyramid( const base::samples::DistanceImage& dimage );
+    /** true if a depth of the pyramid is within the range */
+    bool isValidDepth( float depth ) const;
+    void addPixel( const base::samples::DistanceImage& dimage, size_t index );
+
+    void begin( const envire::TransformWithUncertainty& sensor2grid, envire::MLSGrid& grid );
+    void addPoint( const Eigen::Vector3d& point );
+    void flush();
+
+    double maxRange;
+    double sensorNoise;
+    double resolution;
+    int pyramidLevels;
+
+    /** levels 1..n of the depth pyramid, level 0 is the image itself */
+    std::vector<PyramidLevel> pyramid;
+
+    envire::MLSGrid *grid;
+    Eigen::Matrix3d R;
+    Eigen::Vector3d t;
+    Eigen::Matrix<double,6,6> cov;
+
+    Eigen::Matrix<double, 3, BLOCK_SIZE> block;
+    int blockCount;
+};
+
+}
+
+#endif
@@ -2,51 +2,22 @@
 #define ESLAM_SURFACEHASH_HPP__ 
 
 #include <base/Pose.hpp>
+#include <limits>
+#include <cmath>
+#include <algorithm>
 #include <envire/maps/MLSGrid.hpp>
 
+#include <boost/random/linear_congruential.hpp>
+#include <boost/random/uniform_int.hpp>
+#include <boost/random/variate_generator.hpp>
+
 #include "PoseParticle.hpp"
 #include "Configuration.hpp"
+#include "Trace.hpp"
 
 namespace eslam
 {
 
-template <class T>
-struct Buckets
-{
-    int count;
-    double min_val, max_val;
-    std::vector<T> buckets;
-
-    Buckets( int count, double min_val, double max_val, const T& initial = T() )
-	: count( count ), min_val( min_val ), max_val( max_val ), buckets( count, initial )
-    {
-    }
-
-    int bucketIndex( double value ) const
-    {
-	int idx = (value - min_val) / (max_val - min_val) * count;
-	return std::min( count-1, std::max( 0, idx ) );
-    }
-
-    T& operator[]( double value )
-    {
-	return buckets[ bucketIndex( value ) ];
-    }
-
-    size_t size() const
-    {
-	size_t sum = 0;
-	for( typename std::vector<T>::const_iterator it = buckets.begin(); it != buckets.end(); it++ )
-	{
-	    sum += it->size();
-	    //std::cout << sum << " " << std::endl; 
-	}
-	//std::cout << std::endl; 
-	return sum;
-    }
-    
-};
-
 struct SurfaceParam
 {
     double slope_x;
@@ -110,13 +81,165 @@ struct SurfaceParam
     }
 };
 
-struct SurfaceHash
+/**
+ * Closed form least squares plane fit for a footprint with fixed x/y
+ * positions.
+ *
+ * With fixed x/y offsets, the normal equations used in
+ * SurfaceParam::fromPoints only depend on the footprint, so the solution
+ * reduces to a projection matrix which is applied to the sampled heights.
+ * Separate projections are precomputed for the cases where a single point of
+ * the footprint has no height value.
+ */
+struct FootprintFit
 {
-    typedef Buckets< std::vector<PoseParticle> > SlopeYHash;
-    typedef Buckets< SlopeYHash > SlopeXHash;
+    static const int POINTS = 4;
+
+    typedef Eigen::Matrix<double, 2, POINTS> Projection;
+    typedef Eigen::Matrix<double, POINTS, 1> Heights;
+
+    /** projection[0] maps all heights to the slopes, projection[i+1] is
+     * used if point i is missing. The column of the missing point is zero.
+     */
+    Projection projection[POINTS+1];
+
+    FootprintFit() {}
+
+    explicit FootprintFit( const std::vector<base::Vector3d>& footprint )
+    {
+	setFootprint( footprint );
+    }
+
+    void setFootprint( const std::vector<base::Vector3d>& footprint )
+    {
+	assert( footprint.size() == POINTS );
+
+	Eigen::Matrix<double, POINTS, 3> A;
+	for( int i = 0; i < POINTS; i++ )
+	    A.row( i ) << footprint[i].x(), footprint[i].y(), 1.0;
+
+	for( int k = 0; k <= POINTS; k++ )
+	{
+	    // removing a point is the same as setting its row to zero
+	    Eigen::Matrix<double, POINTS, 3> Ak = A;
+	    if( k > 0 )
+		Ak.row( k-1 ).setZero();
+
+	    Eigen::Matrix3d AtA = Ak.transpose() * Ak;
+	    Eigen::Matrix<double, 3, POINTS> P = AtA.ldlt().solve( Ak.transpose() );
+	    projection[k] = P.topRows<2>();
+	}
+    }
+
+    /** 
+     * calculate the slope parameters from the heights of the footprint
+     * points. Missing heights are given as NaN. 
+     *
+     * @result false if less than three valid heights are available
+     */
+    bool fit( const Heights& heights, SurfaceParam& param ) const
+    {
+	int missing = -1;
+	Heights h = heights;
+	for( int i = 0; i < POINTS; i++ )
+	{
+	    if( h[i] != h[i] )
+	    {
+		if( missing >= 0 )
+		    return false;
+		missing = i;
+		h[i] = 0;
+	    }
+	}
+
+	Eigen::Vector2d slope = projection[missing+1] * h;
+	param.slope_x = slope.x();
+	param.slope_y = slope.y();
+	return true;
+    }
+};
+
+/**
+ * Single level of the slope index. 
+ *
+ * Each level partitions the (slope_x, slope_y) plane into bins x bins
+ * buckets, which store indices into the pose list of the SurfaceHash.
+ * The bin boundaries are either uniform over [-1, 1] or follow the
+ * distribution of the slopes in the map.
+ */
+struct SlopeIndexLevel
+{
+    /** inner boundaries of the bins, so there are size()+1 bins */
+    std::vector<double> boundsX, boundsY;
+    std::vector< std::vector<size_t> > buckets;
+
+    size_t bins() const
+    {
+	return boundsX.size() + 1;
+    }
+
+    /** create uniform bins over the interval [min_val, max_val] */
+    void setUniform( size_t bins, double min_val, double max_val )
+    {
+	boundsX.resize( bins - 1 );
+	for( size_t i = 1; i < bins; i++ )
+	    boundsX[i-1] = min_val + (max_val - min_val) * i / bins;
+	boundsY = boundsX;
+	buckets.assign( bins * bins, std::vector<size_t>() );
+    }
+
+    /** create bins, so that each bin will receive approximately the same
+     * number of values along each axis. 
+     *
+     * @param sortedX sorted slope_x values of the map
+     * @param sortedY sorted slope_y values of the map
+     */
+    void setAdaptive( size_t bins, const std::vector<double>& sortedX, const std::vector<double>& sortedY )
+    {
+	assert( sortedX.size() == sortedY.size() && !sortedX.empty() );
+	boundsX.resize( bins - 1 );
+	boundsY.resize( bins - 1 );
+	for( size_t i = 1; i < bins; i++ )
+	{
+	    const size_t idx = i * sortedX.size() / bins;
+	    boundsX[i-1] = sortedX[idx];
+	    boundsY[i-1] = sortedY[idx];
+	}
+	buckets.assign( bins * bins, std::vector<size_t>() );
+    }
+
+    static size_t binIndex( const std::vector<double>& bounds, double value )
+    {
+	return std::upper_bound( bounds.begin(), bounds.end(), value ) - bounds.begin();
+    }
+
+    std::vector<size_t>& operator[]( const SurfaceParam& param )
+    {
+	return buckets[ binIndex( boundsX, param.slope_x ) * bins() + binIndex( boundsY, param.slope_y ) ];
+    }
+
+    const std::vector<size_t>& operator[]( const SurfaceParam& param ) const
+    {
+	return buckets[ binIndex( boundsX, param.slope_x ) * bins() + binIndex( boundsY, param.slope_y ) ];
+    }
+    /** number of bytes used by the bins and buckets */
+    size_t getMemoryUsage() const
+    {
+	size_t bytes = (boundsX.capacity() + boundsY.capacity()) * sizeof( double )
+	    + buckets.capacity() * sizeof( std::vector<size_t> );
+	for( size_t i = 0; i < buckets.size(); i++ )
+	    bytes += buckets[i].capacity() * sizeof( size_t );
+	return bytes;
+    }
+};
 
-    boost::shared_ptr<SlopeXHash> hash;
+struct SurfaceHash
+{
+    /** index levels from coarse to fine */
+    std::vector<SlopeIndexLevel> levels;
     std::vector<PoseParticle> poses;
+    /** surface parameters for each entry in poses */
+    std::vector<SurfaceParam> params;
     
     SurfaceHashConfig config;
 
@@ -125,39 +248,123 @@ struct SurfaceHash
 	config = c;
     }
 
-    PoseParticle* sample()
+    /** number of bytes used by the poses and the index */
+    size_t getMemoryUsage() const
     {
-	size_t idx = rand() % poses.size();
-	return &poses[ idx ];
+	size_t bytes = poses.capacity() * sizeof( PoseParticle ) 
+	    + params.capacity() * sizeof( SurfaceParam );
+	for( size_t l = 0; l < levels.size(); l++ )
+	    bytes += levels[l].getMemoryUsage();
+	return bytes;
     }
 
-    double getRelevance( const SurfaceParam& param ) const 
+    /** 
+     * sample a random pose from the hash. The random generator is provided
+     * by the caller, so that a hash can be shared between filters. 
+     */
+    const PoseParticle* sample( boost::minstd_rand& rand_gen ) const
     {
-	std::cout << hash->size() << std::endl;
-	const std::vector<PoseParticle> &ps( (*hash)[param.slope_x][param.slope_y] );
-	return 1.0 - 1.0 * ps.size() / poses.size();
+	if( poses.empty() )
+	    return NULL;
+
+	return &poses[ randomIndex( rand_gen, poses.size() ) ];
     }
 
-    PoseParticle* sample( const SurfaceParam& param )
+    /**
+     * descend the index from the coarsest level, until the bucket for the
+     * given surface parameters is small enough, or the next level does not
+     * have any candidates.
+     *
+     * @result the bucket with the candidate pose indices or NULL if there are
+     *         no candidates
+     */
+    const std::vector<size_t>* lookup( const SurfaceParam& param ) const
     {
-	std::vector<PoseParticle> &ps( (*hash)[param.slope_x][param.slope_y] );
-	if( ps.size() > 0 )
+	const std::vector<size_t> *result = NULL;
+	for( size_t l = 0; l < levels.size(); l++ )
 	{
-	    size_t idx = rand() % ps.size();
-	    return &ps[ idx ];
+	    const std::vector<size_t> &bucket( levels[l][param] );
+	    if( bucket.empty() )
+		break;
+
+	    result = &bucket;
+	    if( bucket.size() <= config.maxBucketSize )
+		break;
 	}
+	return result;
+    }
+
+    double getRelevance( const SurfaceParam& param ) const 
+    {
+	const std::vector<size_t> *ps = lookup( param );
+	const size_t count = ps ? ps->size() : 0;
+	return 1.0 - 1.0 * count / poses.size();
+    }
+
+    /** sample a random pose with surface parameters similar to param */
+    const PoseParticle* sample( const SurfaceParam& param, boost::minstd_rand& rand_gen ) const
+    {
+	const std::vector<size_t> *ps = lookup( param );
+	if( ps )
+	    return &poses[ (*ps)[randomIndex( rand_gen, ps->size() )] ];
 
 	// TODO instead of giving up, we could try returning 
 	// close matches
 	return NULL;
     }
 
+    static size_t randomIndex( boost::minstd_rand& rand_gen, size_t size )
+    {
+	boost::variate_generator<boost::minstd_rand&, boost::uniform_int<size_t> > 
+	    rand( rand_gen, boost::uniform_int<size_t>( 0, size - 1 ) );
+	return rand();
+    }
+
+    /**
+     * (re)build the index levels from the poses and params.
+     *
+     * Level i has slopeBins / 2^(pyramidLevels-1-i) bins along each slope
+     * axis, so that the last level has slopeBins bins.
+     */
+    void buildIndex()
+    {
+	assert( poses.size() == params.size() );
+
+	std::vector<double> sortedX, sortedY;
+	if( config.adaptiveBins && !params.empty() )
+	{
+	    sortedX.reserve( params.size() );
+	    sortedY.reserve( params.size() );
+	    for( size_t i = 0; i < params.size(); i++ )
+	    {
+		sortedX.push_back( params[i].slope_x );
+		sortedY.push_back( params[i].slope_y );
+	    }
+	    std::sort( sortedX.begin(), sortedX.end() );
+	    std::sort( sortedY.begin(), sortedY.end() );
+	}
+
+	const size_t numLevels = std::max<size_t>( 1, config.pyramidLevels );
+	levels.resize( numLevels );
+	for( size_t l = 0; l < numLevels; l++ )
+	{
+	    const size_t bins = std::max<size_t>( 1, config.slopeBins >> (numLevels - 1 - l) );
+	    if( sortedX.empty() )
+		levels[l].setUniform( bins, -1.0, 1.0 );
+	    else
+		levels[l].setAdaptive( bins, sortedX, sortedY );
+
+	    for( size_t i = 0; i < params.size(); i++ )
+		levels[l][params[i]].push_back( i );
+	}
+    }
+
     void create( envire::MLSGrid *gridTemplate )
     {
-	// create metadata which includes some information on slope and
-	// roughness
-	hash = boost::shared_ptr<SlopeXHash>(
-		new SlopeXHash( config.slopeBins, -1.0, 1.0, SlopeYHash( config.slopeBins, -1.0, 1.0 ) ) );
+	ESLAM_TRACE_SCOPE( "SurfaceHash::create" );
+
+	poses.clear();
+	params.clear();
 
 	const double base = 0.5;
 
@@ -167,13 +374,46 @@ struct SurfaceHash
 	opoints.push_back( base::Vector3d( base/2.0, -base, 0 ) );
 	opoints.push_back( base::Vector3d( -base/2.0, -base, 0 ) );
 
+	// the plane is always fitted in the rotated footprint frame, so the
+	// projection is the same for all angles
+	const FootprintFit footprintFit( opoints );
+	const FootprintFit::Projection &P( footprintFit.projection[0] );
+
 	std::vector<base::Vector3d> points = opoints;
 
 	Eigen::Affine3d grid2world = 
 	    gridTemplate->getFrameNode()->relativeTransform( gridTemplate->getEnvironment()->getRootNode() );
 	double yaw_offset = base::getYaw( Eigen::Quaterniond( grid2world.linear()) );
 
-	std::cerr << "starting hashing... ";
+	const size_t width = gridTemplate->getWidth();
+	const size_t height = gridTemplate->getHeight();
+	const double scale_x = gridTemplate->getScaleX();
+	const double scale_y = gridTemplate->getScaleY();
+
+	// dense raster of the height values of the grid. Each column holds the
+	// cells for one m value, so that a whole row of footprint points can
+	// be sampled as a contiguous segment. The raster is padded with NaN,
+	// which marks cells without data, so the footprint does not need
+	// bounds checks.
+	double radius = 0;
+	for( size_t i = 0; i < opoints.size(); i++ )
+	    radius = std::max( radius, opoints[i].head<2>().norm() );
+	const int pad = static_cast<int>( std::ceil( radius / std::min( scale_x, scale_y ) ) ) + 1;
+
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+	Eigen::ArrayXXd heights = Eigen::ArrayXXd::Constant( height + 2*pad, width + 2*pad, nan );
+	for( size_t m = 0; m < width; m ++ )
+	{
+	    for( size_t n = 0; n < height; n ++ )
+	    {
+		envire::MLSGrid::iterator it = gridTemplate->beginCell( m, n );
+		if( it != gridTemplate->endCell() )
+		    heights( n + pad, m + pad ) = it->mean;
+	    }
+	}
+
+	Eigen::ArrayXd h[FootprintFit::POINTS];
+	Eigen::ArrayXd slope_x, slope_y;
 
 	const size_t angle_segments = config.angularSteps;
 	for( size_t a = 0; a < angle_segments; a ++ )
@@ -183,51 +423,69 @@ struct SurfaceHash
 	    for( size_t n = 0; n < points.size(); n++ )
 		points[n] = rot * points[n];
 
-	    for( size_t m = 0; m < gridTemplate->getWidth(); m ++ )
+	    // the footprint points are at a fixed cell offset from the
+	    // current cell for the given angle
+	    int ox[FootprintFit::POINTS], oy[FootprintFit::POINTS];
+	    for( int i = 0; i < FootprintFit::POINTS; i++ )
+	    {
+		ox[i] = static_cast<int>( std::floor( 0.5 + points[i].x() / scale_x ) );
+		oy[i] = static_cast<int>( std::floor( 0.5 + points[i].y() / scale_y ) );
+	    }
+
+	    for( size_t m = 0; m < width; m ++ )
 	    {
-		for( size_t n = 0; n < gridTemplate->getHeight(); n ++ )
+		// evaluate the slopes for the whole row at once. Cells with
+		// missing points will result in NaN here, and are handled
+		// separately below.
+		for( int i = 0; i < FootprintFit::POINTS; i++ )
+		    h[i] = heights.col( m + pad + ox[i] ).segment( pad + oy[i], height );
+
+		slope_x = P(0,0) * h[0] + P(0,1) * h[1] + P(0,2) * h[2] + P(0,3) * h[3];
+		slope_y = P(1,0) * h[0] + P(1,1) * h[1] + P(1,2) * h[2] + P(1,3) * h[3];
+
+		for( size_t n = 0; n < height; n ++ )
 		{
-		    double x, y;
-		    gridTemplate->fromGrid( m, n, x, y );
-		    double mean_z = 0;
+		    SurfaceParam surface;
+		    surface.slope_x = slope_x[n];
+		    surface.slope_y = slope_y[n];
 
-		    std::vector<base::Vector3d> gpoints;
-		    for( size_t i = 0; i < points.size(); i++ )
+		    FootprintFit::Heights fh;
+		    double mean_z = 0;
+		    int count = 0;
+		    for( int i = 0; i < FootprintFit::POINTS; i++ )
 		    {
-			base::Vector3d &p( points[i] );
-			size_t mx, nx;
-			gridTemplate->toGrid( x + p.x(), y + p.y(), mx, nx );
-
-			envire::MLSGrid::iterator it = gridTemplate->beginCell( mx, nx );
-			if( it != gridTemplate->endCell() )
+			fh[i] = h[i][n];
+			if( fh[i] == fh[i] )
 			{
-			    double zval = it->mean;
-			    mean_z += zval;
-			    gpoints.push_back( opoints[i] + base::Vector3d( 0, 0, zval ) );
+			    mean_z += fh[i];
+			    count++;
 			}
 		    }
-		    mean_z /= gpoints.size();
 
-		    if( gpoints.size() >= 3 )
-		    {
-			SurfaceParam params;
-			params.fromPoints( gpoints );
+		    if( count < 3 )
+			continue;
 
-			Eigen::Vector3d pose = grid2world * Eigen::Vector3d( x, y, mean_z );
+		    mean_z /= count;
 
-			PoseParticle particle( base::Vector2d( pose.x(), pose.y() ), angle + yaw_offset, pose.z() + 0.18 );
+		    if( count < FootprintFit::POINTS )
+			footprintFit.fit( fh, surface );
 
-			(*hash)[params.slope_x][params.slope_y].push_back( particle );
-			poses.push_back( particle );
+		    double x, y;
+		    gridTemplate->fromGrid( m, n, x, y );
+		    Eigen::Vector3d pose = grid2world * Eigen::Vector3d( x, y, mean_z );
 
-			//std::cout << angle << " " << m << " " << n << " " 
-			//	<< params.slope << " " << params.roughness << std::endl;
-		    }
+		    PoseParticle particle( base::Vector2d( pose.x(), pose.y() ), angle + yaw_offset, pose.z() + 0.18 );
+
+		    poses.push_back( particle );
+		    params.push_back( surface );
 		}
 	    }
-	    std::cerr << a << " ";
 	}
-	std::cerr << " done. size: " << poses.size() << std::endl;
+	// create metadata which includes some information on slope and
+	// roughness
+	buildIndex();
+
+	ESLAM_TRACE_MESSAGE( "surface hash size: " << poses.size() );
     }
 };
 
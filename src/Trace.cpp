@@ -0,0 +1,225 @@
+#include "Trace.hpp"
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <time.h>
+
+using namespace eslam;
+
+namespace
+{
+
+struct TraceEvent
+{
+    const char* name;
+    boost::int64_t begin;
+    /** negative for messages */
+    boost::int64_t duration;
+    std::string message;
+};
+
+/**
+ * Events of a single thread. Only the owning thread writes, and it publishes
+ * an event by incrementing count after the event is complete, so readers can
+ * access all events below count.
+ */
+struct ThreadBuffer
+{
+    ThreadBuffer( size_t size, int tid )
+	: events( size ), count( 0 ), dropped( 0 ), tid( tid ) {}
+
+    std::vector<TraceEvent> events;
+    boost::atomic<size_t> count;
+    boost::atomic<size_t> dropped;
+    int tid;
+
+    TraceEvent* next()
+    {
+	const size_t c = count.load( boost::memory_order_relaxed );
+	if( c >= events.size() )
+	{
+	    dropped.fetch_add( 1, boost::memory_order_relaxed );
+	    return NULL;
+	}
+	return &events[c];
+    }
+
+    void commit()
+    {
+	count.fetch_add( 1, boost::memory_order_release );
+    }
+};
+
+/** the buffers are owned by the registry, so they outlive their threads */
+struct Registry
+{
+    Registry() : bufferSize( 1 << 16 ) {}
+
+    boost::mutex mutex;
+    std::vector<boost::shared_ptr<ThreadBuffer> > buffers;
+    size_t bufferSize;
+};
+
+Registry& getRegistry()
+{
+    static Registry registry;
+    return registry;
+}
+
+void noCleanup( ThreadBuffer* )
+{
+}
+
+ThreadBuffer& getBuffer()
+{
+    static boost::thread_specific_ptr<ThreadBuffer> buffer( &noCleanup );
+    ThreadBuffer *b = buffer.get();
+    if( !b )
+    {
+	Registry &r( getRegistry() );
+	boost::lock_guard<boost::mutex> lock( r.mutex );
+	boost::shared_ptr<ThreadBuffer> nb( new ThreadBuffer( r.bufferSize, r.buffers.size() + 1 ) );
+	r.buffers.push_back( nb );
+	b = nb.get();
+	buffer.reset( b );
+    }
+    return *b;
+}
+
+void writeEscaped( std::ostream& os, const std::string& s )
+{
+    os << '"';
+    for( size_t i = 0; i < s.size(); i++ )
+    {
+	const char c = s[i];
+	if( c == '"' || c == '\\' )
+	    os << '\\' << c;
+	else if( c == '\n' )
+	    os << "\\n";
+	else if( c == '\r' || c == '\t' )
+	    os << ' ';
+	else if( static_cast<unsigned char>( c ) >= 0x20 )
+	    os << c;
+    }
+    os << '"';
+}
+
+}
+
+bool Trace::isCompiledIn()
+{
+#ifdef ESLAM_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+boost::int64_t Trace::now()
+{
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return static_cast<boost::int64_t>( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Trace::scope( const char* name, boost::int64_t begin, boost::int64_t end )
+{
+    ThreadBuffer &b( getBuffer() );
+    TraceEvent *e = b.next();
+    if( !e )
+	return;
+    e->name = name;
+    e->begin = begin;
+    e->duration = end - begin;
+    e->message.clear();
+    b.commit();
+}
+
+void Trace::message( const std::string& msg )
+{
+    ThreadBuffer &b( getBuffer() );
+    TraceEvent *e = b.next();
+    if( !e )
+	return;
+    e->name = "message";
+    e->begin = now();
+    e->duration = -1;
+    e->message = msg;
+    b.commit();
+}
+
+void Trace::setBufferSize( size_t events )
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    r.bufferSize = events;
+}
+
+size_t Trace::getDropped()
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    size_t dropped = 0;
+    for( size_t i = 0; i < r.buffers.size(); i++ )
+	dropped += r.buffers[i]->dropped.load( boost::memory_order_relaxed );
+    return dropped;
+}
+
+void Trace::writeChromeTrace( std::ostream& os )
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+
+    os << "{\"traceEvents\":[";
+    bool first = true;
+    for( size_t i = 0; i < r.buffers.size(); i++ )
+    {
+	const ThreadBuffer &b( *r.buffers[i] );
+	const size_t count = b.count.load( boost::memory_order_acquire );
+	for( size_t j = 0; j < count; j++ )
+	{
+	    const TraceEvent &e( b.events[j] );
+	    os << (first ? "\n" : ",\n");
+	    first = false;
+
+	    os << "{\"name\":";
+	    writeEscaped( os, e.name );
+	    os << ",\"pid\":1,\"tid\":" << b.tid << ",\"ts\":" << e.begin;
+	    if( e.duration >= 0 )
+		os << ",\"ph\":\"X\",\"dur\":" << e.duration << "}";
+	    else
+	    {
+		os << ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"msg\":";
+		writeEscaped( os, e.message );
+		os << "}}";
+	    }
+	}
+    }
+    os << "\n]}" << std::endl;
+}
+
+void Trace::writeChromeTrace( const std::string& path )
+{
+    std::ofstream os( path.c_str() );
+    writeChromeTrace( os );
+    if( !os )
+	throw std::runtime_error( "could not write trace " + path );
+}
+
+void Trace::clear()
+{
+    Registry &r( getRegistry() );
+    boost::lock_guard<boost::mutex> lock( r.mutex );
+    for( size_t i = 0; i < r.buffers.size(); i++ )
+    {
+	r.buffers[i]->count.store( 0, boost::memory_order_release );
+	r.buffers[i]->dropped.store( 0, boost::memory_order_relaxed );
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef __ESLAM_TRACE_HPP__
+#define __ESLAM_TRACE_HPP__
+
+#include <boost/cstdint.hpp>
+
+#include <iosfwd>
+#include <sstream>
+#include <string>
+
+namespace eslam
+{
+
+/**
+ * Records the time spent in the stages of the filter, and the diagnostic
+ * messages of the filter, as a timeline which can be viewed in
+ * chrome://tracing or Perfetto.
+ *
+ * Each thread writes to its own buffer without locking. The buffers have a
+ * fixed size, and events are dropped once a buffer is full.
+ *
+ * The instrumentation is only compiled in if ESLAM_TRACE is defined (cmake
+ * option ESLAM_TRACE). Otherwise the ESLAM_TRACE_SCOPE and
+ * ESLAM_TRACE_MESSAGE macros are empty, and the filter prints nothing.
+ */
+class Trace
+{
+public:
+    /** true if the library was built with ESLAM_TRACE */
+    static bool isCompiledIn();
+
+    /** time in microseconds of a monotonic clock */
+    static boost::int64_t now();
+
+    /** record a completed scope. name needs to be a string literal. */
+    static void scope( const char* name, boost::int64_t begin, boost::int64_t end );
+    /** record a message at the current time */
+    static void message( const std::string& msg );
+
+    /** number of events per thread buffer. Only affects threads which
+     * record their first event after the call. */
+    static void setBufferSize( size_t events );
+
+    /** number of events which were dropped because a buffer was full */
+    static size_t getDropped();
+
+    /**
+     * write all recorded events in the chrome trace event format. Can be
+     * called while events are recorded, in which case those are not
+     * included.
+     */
+    static void writeChromeTrace( std::ostream& os );
+    static void writeChromeTrace( const std::string& path );
+
+    /** drop all recorded events. Must not be called while events are
+     * recorded. */
+    static void clear();
+};
+
+/** records the time between its construction and destruction */
+class TraceScope
+{
+public:
+    explicit TraceScope( const char* name )
+	: name( name ), begin( Trace::now() ) {}
+
+    ~TraceScope()
+    {
+	Trace::scope( name, begin, Trace::now() );
+    }
+
+private:
+    const char* name;
+    boost::int64_t begin;
+};
+
+}
+
+#define ESLAM_TRACE_CONCAT2( a, b ) a ## b
+#define ESLAM_TRACE_CONCAT( a, b ) ESLAM_TRACE_CONCAT2( a, b )
+
+#ifdef ESLAM_TRACE
+/** trace the rest of the enclosing block under the given name */
+#define ESLAM_TRACE_SCOPE( name ) \
+    eslam::TraceScope ESLAM_TRACE_CONCAT( eslam_trace_scope_, __LINE__ )( name )
+/** record a message, which can be composed with operator<< */
+#define ESLAM_TRACE_MESSAGE( msg ) \
+    do { std::ostringstream eslam_trace_os; eslam_trace_os << msg; eslam::Trace::message( eslam_trace_os.str() ); } while( 0 )
+#else
+#define ESLAM_TRACE_SCOPE( name ) do {} while( 0 )
+#define ESLAM_TRACE_MESSAGE( msg ) do {} while( 0 )
+#endif
+
+#endif
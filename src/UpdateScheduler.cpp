@@ -0,0 +1,62 @@
+#include "UpdateScheduler.hpp"
+
+using namespace eslam;
+
+UpdateScheduler::UpdateScheduler( const UpdateSchedulerConfig& config, const UpdateThreshold& minThreshold )
+    : config( config ),
+    minThreshold( minThreshold ),
+    ambiguous( true ),
+    spread( 0 ),
+    angularSpread( 0 ),
+    credit( 0 ),
+    updates( 0 ),
+    skipped( 0 )
+{
+}
+
+bool UpdateScheduler::test( const Eigen::Affine3d& pdelta, const base::Time& time )
+{
+    const double distance = pdelta.translation().norm();
+    const double angle = Eigen::AngleAxisd( pdelta.linear() ).angle();
+
+    // the credit grows with the time of the inputs, and is limited to one
+    // second worth of budget, so a long converged phase does not allow a
+    // long burst of updates afterwards
+    if( usesBudget() )
+    {
+	if( !lastTime.isNull() && time > lastTime )
+	    credit = std::min( credit + config.cpuBudget * (time - lastTime).toSeconds(), config.cpuBudget );
+	lastTime = time;
+    }
+
+    if( config.maxThreshold.test( distance, angle ) )
+	return true;
+
+    if( !minThreshold.test( distance, angle ) )
+	return false;
+
+    if( !ambiguous || (usesBudget() && credit <= 0) )
+    {
+	skipped++;
+	return false;
+    }
+
+    return true;
+}
+
+void UpdateScheduler::setFilterState( double spread, double angularSpread, double effectiveRatio, double gain, double duration )
+{
+    this->spread = spread;
+    this->angularSpread = angularSpread;
+
+    ambiguous = 
+	spread > config.spreadThreshold 
+	|| angularSpread > config.angularSpreadThreshold
+	|| effectiveRatio < config.effectiveThreshold
+	|| gain > config.gainThreshold;
+
+    if( usesBudget() )
+	credit -= duration;
+
+    updates++;
+}
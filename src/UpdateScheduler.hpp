@@ -0,0 +1,113 @@
+#ifndef __ESLAM_UPDATESCHEDULER_HPP__
+#define __ESLAM_UPDATESCHEDULER_HPP__
+
+#include "Configuration.hpp"
+
+#include <base/Time.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace eslam
+{
+
+/**
+ * Decides when to run the measurement update of the filter.
+ *
+ * Updates are done densely, at the measurementThreshold, while the filter is
+ * ambiguous: the particles are spread out, the effective number of particles
+ * is low, or the last update changed the weights noticeably. Once the filter
+ * has converged and the updates carry little information, e.g. on flat
+ * terrain, updates are only done at the maxThreshold of the
+ * UpdateSchedulerConfig. Optionally, the time spent on the updates between
+ * those two thresholds is limited by a CPU budget.
+ */
+class UpdateScheduler
+{
+public:
+    UpdateScheduler( const UpdateSchedulerConfig& config, const UpdateThreshold& minThreshold );
+
+    /**
+     * @param pdelta - motion since the last measurement update
+     * @param time - time of the input
+     * @result true if a measurement update should be done
+     */
+    bool test( const Eigen::Affine3d& pdelta, const base::Time& time );
+
+    /**
+     * pass the state of the filter after a measurement update.
+     *
+     * @param particles - particles after the update
+     * @param effective - effective number of particles after the weight
+     *                    update, before resampling
+     * @param gain - information gain of the weight update in nats
+     * @param duration - time the update took in seconds. Only used if a
+     *                   CPU budget is set.
+     */
+    template <class Particle>
+    void updated( const std::vector<Particle>& particles, double effective, double gain, double duration )
+    {
+	// weighted spread of the positions, and circular spread of the
+	// headings
+	double sumWeights = 0, sx = 0, sy = 0, sxx = 0, syy = 0, sc = 0, ss = 0;
+	for( size_t i = 0; i < particles.size(); i++ )
+	{
+	    const Particle &p( particles[i] );
+	    const double w = p.weight;
+	    sumWeights += w;
+	    sx += w * p.position.x();
+	    sy += w * p.position.y();
+	    sxx += w * p.position.x() * p.position.x();
+	    syy += w * p.position.y() * p.position.y();
+	    sc += w * cos( p.orientation );
+	    ss += w * sin( p.orientation );
+	}
+
+	double spread = 0, angularSpread = 0;
+	if( sumWeights > 0 )
+	{
+	    const double mx = sx / sumWeights, my = sy / sumWeights;
+	    spread = sqrt( std::max( 0.0, sxx / sumWeights - mx * mx + syy / sumWeights - my * my ) );
+	    const double r = std::min( 1.0, sqrt( sc * sc + ss * ss ) / sumWeights );
+	    angularSpread = r > 0 ? sqrt( -2.0 * log( r ) ) : M_PI;
+	}
+
+	setFilterState( spread, angularSpread, 
+		particles.empty() ? 1.0 : effective / particles.size(), gain, duration );
+    }
+
+    /** true if a CPU budget is set, in which case the caller needs to
+     * measure the duration of the updates */
+    bool usesBudget() const { return config.cpuBudget > 0; }
+
+    /** true if the filter was ambiguous after the last update */
+    bool isAmbiguous() const { return ambiguous; }
+    double getSpread() const { return spread; }
+    double getAngularSpread() const { return angularSpread; }
+
+    /** number of updates which were done */
+    size_t getUpdates() const { return updates; }
+    /** number of inputs which passed the measurementThreshold, but were
+     * skipped because the filter was converged or out of budget */
+    size_t getSkipped() const { return skipped; }
+
+private:
+    void setFilterState( double spread, double angularSpread, double effectiveRatio, double gain, double duration );
+
+    UpdateSchedulerConfig config;
+    UpdateThreshold minThreshold;
+
+    bool ambiguous;
+    double spread, angularSpread;
+
+    base::Time lastTime;
+    /** time in seconds that can be spent on updates */
+    double credit;
+
+    size_t updates, skipped;
+};
+
+}
+
+#endif
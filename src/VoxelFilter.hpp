@@ -0,0 +1,118 @@
+#ifndef __ESLAM_VOXELFILTER_HPP__
+#define __ESLAM_VOXELFILTER_HPP__
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <boost/unordered_map.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/math/special_functions/fpclassify.hpp>
+#include <vector>
+#include <cmath>
+
+namespace eslam
+{
+
+/**
+ * Downsampling of point sets using a voxel grid.
+ *
+ * All points which fall into the same voxel are replaced by their centroid.
+ * The voxel grid is sparse, so there is no limit on the extent of the
+ * points.
+ */
+class VoxelFilter
+{
+public:
+    explicit VoxelFilter( double voxelSize = 0.05 )
+	: voxelSize( voxelSize )
+    {
+    }
+
+    void setVoxelSize( double size )
+    {
+	voxelSize = size;
+    }
+
+    double getVoxelSize() const
+    {
+	return voxelSize;
+    }
+
+    /**
+     * @param points - input points
+     * @param result - centroids of the occupied voxels. The order is given
+     *                 by the first point in each voxel.
+     */
+    template <class Vector, class Alloc>
+    void filter( const std::vector<Vector, Alloc>& points, std::vector<Eigen::Vector3d>& result )
+    {
+	result.clear();
+	if( voxelSize <= 0 )
+	{
+	    result.reserve( points.size() );
+	    for( size_t i = 0; i < points.size(); i++ )
+		result.push_back( points[i].template cast<double>() );
+	    return;
+	}
+
+	const double scale = 1.0 / voxelSize;
+	voxels.clear();
+	counts.clear();
+
+	for( size_t i = 0; i < points.size(); i++ )
+	{
+	    const Eigen::Vector3d p = points[i].template cast<double>();
+	    if( !boost::math::isfinite( p.x() ) || !boost::math::isfinite( p.y() ) || !boost::math::isfinite( p.z() ) )
+		continue;
+
+	    const boost::uint64_t key = 
+		voxelKey( std::floor( p.x() * scale ), std::floor( p.y() * scale ), std::floor( p.z() * scale ) );
+
+	    std::pair<VoxelMap::iterator, bool> res = 
+		voxels.insert( std::make_pair( key, result.size() ) );
+	    if( res.second )
+	    {
+		result.push_back( p );
+		counts.push_back( 1 );
+	    }
+	    else
+	    {
+		const size_t idx = res.first->second;
+		result[idx] += p;
+		counts[idx]++;
+	    }
+	}
+
+	for( size_t i = 0; i < result.size(); i++ )
+	    result[i] /= counts[i];
+    }
+
+    /** approximate number of bytes used by the voxel table */
+    size_t getMemoryUsage() const
+    {
+	return voxels.bucket_count() * sizeof( void* ) 
+	    + voxels.size() * (sizeof( VoxelMap::value_type ) + sizeof( void* ))
+	    + counts.capacity() * sizeof( size_t );
+    }
+
+protected:
+    /** pack the voxel indices into a single key, using 21 bits per axis */
+    static boost::uint64_t voxelKey( double x, double y, double z )
+    {
+	const boost::int64_t offset = 1 << 20;
+	const boost::uint64_t mask = (1 << 21) - 1;
+	return 
+	    ((static_cast<boost::uint64_t>( static_cast<boost::int64_t>( x ) + offset ) & mask) << 42) |
+	    ((static_cast<boost::uint64_t>( static_cast<boost::int64_t>( y ) + offset ) & mask) << 21) |
+	    (static_cast<boost::uint64_t>( static_cast<boost::int64_t>( z ) + offset ) & mask);
+    }
+
+    typedef boost::unordered_map<boost::uint64_t, size_t> VoxelMap;
+
+    double voxelSize;
+    VoxelMap voxels;
+    std::vector<size_t> counts;
+};
+
+}
+
+#endif
@@ -6,6 +6,29 @@
 #include <eslam/ParticleFilter.hpp>
 
 #include <eslam/SurfaceHash.hpp>
+#include <eslam/VoxelFilter.hpp>
+#include <eslam/GridPager.hpp>
+#include <eslam/Checkpoint.hpp>
+#include <eslam/Replay.hpp>
+#include <eslam/UpdateScheduler.hpp>
+#include <eslam/CompactDistribution.hpp>
+#include <eslam/Trace.hpp>
+#include <eslam/PerfCounters.hpp>
+#include <eslam/MortonOrder.hpp>
+#include <eslam/LikelihoodCache.hpp>
+#include <eslam/PoseEstimator.hpp>
+#include <eslam/NumaPlacement.hpp>
+#include <eslam/ScanProjection.hpp>
+#include <envire/operators/ScanMeshing.hpp>
+#include <envire/operators/MLSProjection.hpp>
+#include "../viz/ParticleGeometry.hpp"
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
 
 using namespace std;
 using namespace eslam;
@@ -143,3 +166,1420 @@ BOOST_AUTO_TEST_CASE( surface_param )
 }
 
 
+
+BOOST_AUTO_TEST_CASE( footprint_fit )
+{
+    std::vector<base::Vector3d> footprint;
+    footprint.push_back( Eigen::Vector3d( 0.25, 0, 0 ) );
+    footprint.push_back( Eigen::Vector3d( -0.25, 0, 0 ) );
+    footprint.push_back( Eigen::Vector3d( 0.25, -0.5, 0 ) );
+    footprint.push_back( Eigen::Vector3d( -0.25, -0.5, 0 ) );
+
+    FootprintFit fit( footprint );
+
+    // compare the closed form solution with the generic plane fit, 
+    // for the full footprint and for each missing point 
+    for( int missing = -1; missing < FootprintFit::POINTS; missing++ )
+    {
+	FootprintFit::Heights heights( 0.1, -0.3, 0.25, 0.7 );
+	std::vector<base::Vector3d> points;
+	for( int i = 0; i < FootprintFit::POINTS; i++ )
+	{
+	    if( i == missing )
+		heights[i] = std::numeric_limits<double>::quiet_NaN();
+	    else
+		points.push_back( footprint[i] + Eigen::Vector3d( 0, 0, heights[i] ) );
+	}
+
+	SurfaceParam expected, params;
+	expected.fromPoints( points );
+	BOOST_CHECK( fit.fit( heights, params ) );
+
+	BOOST_CHECK_SMALL( expected.slope_x - params.slope_x, 1e-9 );
+	BOOST_CHECK_SMALL( expected.slope_y - params.slope_y, 1e-9 );
+    }
+
+    // less than three points can't be fitted
+    FootprintFit::Heights heights( 0.1, -0.3, 0.25, 0.7 );
+    heights[0] = heights[1] = std::numeric_limits<double>::quiet_NaN();
+    SurfaceParam params;
+    BOOST_CHECK( !fit.fit( heights, params ) );
+}
+
+BOOST_AUTO_TEST_CASE( surface_hash_index )
+{
+    SurfaceHashConfig config;
+    config.slopeBins = 8;
+    config.pyramidLevels = 3;
+    config.adaptiveBins = true;
+    config.maxBucketSize = 10;
+
+    SurfaceHash hash;
+    hash.setConfiguration( config );
+
+    // mostly flat terrain, with a few steep cells
+    for( size_t i = 0; i < 1000; i++ )
+    {
+	SurfaceParam param;
+	param.slope_x = (i % 100) * 1e-3;
+	param.slope_y = (i % 10 == 0) ? 0.8 : (i % 7) * 1e-3;
+	hash.poses.push_back( PoseParticle( base::Vector2d( i, 0 ), 0 ) );
+	hash.params.push_back( param );
+    }
+    hash.buildIndex();
+
+    BOOST_REQUIRE_EQUAL( hash.levels.size(), 3 );
+    BOOST_CHECK_EQUAL( hash.levels[0].bins(), 2 );
+    BOOST_CHECK_EQUAL( hash.levels[2].bins(), 8 );
+
+    // each level contains all the poses
+    for( size_t l = 0; l < hash.levels.size(); l++ )
+    {
+	size_t sum = 0;
+	for( size_t b = 0; b < hash.levels[l].buckets.size(); b++ )
+	    sum += hash.levels[l].buckets[b].size();
+	BOOST_CHECK_EQUAL( sum, 1000 );
+    }
+
+    // the memory accounting includes the poses and three levels of indices
+    BOOST_CHECK( hash.getMemoryUsage() >= 1000 * (sizeof( PoseParticle ) + sizeof( SurfaceParam ) + 3 * sizeof( size_t )) );
+
+    // a lookup should return a bucket which contains the query
+    SurfaceParam query = hash.params[42];
+    const std::vector<size_t> *candidates = hash.lookup( query );
+    BOOST_REQUIRE( candidates );
+    BOOST_CHECK( std::find( candidates->begin(), candidates->end(), 42 ) != candidates->end() );
+    BOOST_CHECK( candidates->size() < 1000 );
+
+    boost::minstd_rand rand_gen( 42u );
+    const PoseParticle *pp = hash.sample( query, rand_gen );
+    BOOST_CHECK( pp );
+
+    // sampling only depends on the random generator that is passed in
+    boost::minstd_rand rand_a( 7u ), rand_b( 7u );
+    for( int i = 0; i < 10; i++ )
+	BOOST_CHECK_EQUAL( hash.sample( rand_a ), hash.sample( rand_b ) );
+}
+
+BOOST_AUTO_TEST_CASE( voxel_filter )
+{
+    std::vector<Eigen::Vector3d> points;
+    points.push_back( Eigen::Vector3d( 0.01, 0.01, 0.0 ) );
+    points.push_back( Eigen::Vector3d( 0.03, 0.01, 0.0 ) );
+    points.push_back( Eigen::Vector3d( -0.01, 0.01, 0.0 ) );
+    points.push_back( Eigen::Vector3d( 0.01, 0.01, 1.0 ) );
+    points.push_back( Eigen::Vector3d( std::numeric_limits<double>::quiet_NaN(), 0, 0 ) );
+
+    VoxelFilter filter( 0.05 );
+    std::vector<Eigen::Vector3d> result;
+    filter.filter( points, result );
+
+    BOOST_REQUIRE_EQUAL( result.size(), 3 );
+    BOOST_CHECK_SMALL( (result[0] - Eigen::Vector3d( 0.02, 0.01, 0.0 )).norm(), 1e-9 );
+    BOOST_CHECK_SMALL( (result[1] - points[2]).norm(), 1e-9 );
+    BOOST_CHECK_SMALL( (result[2] - points[3]).norm(), 1e-9 );
+}
+
+BOOST_AUTO_TEST_CASE( grid_pager )
+{
+    envire::Environment env;
+    envire::MLSMap *map = new envire::MLSMap();
+    env.setFrameNode( map, env.getRootNode() );
+
+    // two grids which are 100m apart
+    envire::MLSGrid *grids[2];
+    for( int i=0; i<2; i++ )
+    {
+	grids[i] = new envire::MLSGrid( 20, 20, 0.5, 0.5, -5.0, -5.0 );
+	envire::FrameNode *gridNode = new envire::FrameNode();
+	gridNode->setTransform( Eigen::Affine3d( Eigen::Translation3d( i * 100.0, 0, 0 ) ) );
+	env.addChild( env.getRootNode(), gridNode );
+	env.setFrameNode( grids[i], gridNode );
+	map->addGrid( grids[i] );
+    }
+    grids[1]->insertTail( 3, 4, envire::MLSGrid::SurfacePatch( 1.0, 0.1 ) );
+    grids[1]->insertTail( 3, 4, envire::MLSGrid::SurfacePatch( 2.0, 0.1 ) );
+
+    eslam::GridPager pager;
+    pager.setRadius( 10.0 );
+
+    // the far grid is spilled and cleared
+    pager.beginRound();
+    pager.update( map, Eigen::Vector3d::Zero() );
+    BOOST_CHECK_EQUAL( pager.getEvictions(), 1 );
+    BOOST_CHECK( grids[1]->beginCell( 3, 4 ) == grids[1]->endCell() );
+
+    // and restored when the position is close again
+    pager.beginRound();
+    pager.update( map, Eigen::Vector3d( 100.0, 0, 0 ) );
+    BOOST_CHECK_EQUAL( pager.getMisses(), 1 );
+    envire::MLSGrid::iterator it = grids[1]->beginCell( 3, 4 );
+    BOOST_REQUIRE( it != grids[1]->endCell() );
+    BOOST_CHECK_CLOSE( it->mean, 1.0, 1e-6 );
+    it++;
+    BOOST_REQUIRE( it != grids[1]->endCell() );
+    BOOST_CHECK_CLOSE( it->mean, 2.0, 1e-6 );
+
+    // a modified grid is written to a new record, and the file is compacted
+    // before the old records take more space than the used ones
+    pager.beginRound();
+    pager.update( map, Eigen::Vector3d::Zero() );
+    const size_t fileSize = pager.getSpillFileSize();
+    for( int i = 0; i < 5; i++ )
+    {
+	pager.require( grids[1] );
+	grids[1]->beginCell( 3, 4 )->stdev = 0.2 + i;
+	pager.beginRound();
+	pager.update( map, Eigen::Vector3d::Zero() );
+	BOOST_CHECK_EQUAL( pager.getSpillFileSize(), fileSize );
+    }
+    pager.require( grids[1], false );
+    it = grids[1]->beginCell( 3, 4 );
+    BOOST_REQUIRE( it != grids[1]->endCell() );
+    BOOST_CHECK_CLOSE( it->stdev, 4.2, 1e-4 );
+}
+
+BOOST_AUTO_TEST_CASE( checkpoint_format )
+{
+    PoseParticle p( base::Vector2d( 1.0, 2.0 ), 0.5, 3.0, 0.1, false );
+    p.mprob = 0.7;
+    p.weight = 0.25;
+    p.meas_pos = base::Vector3d( 1.0, 2.0, 3.0 );
+    p.meas_theta = 0.5;
+    p.cpoints.resize( 3 );
+
+    std::vector<double> values( 10, 4.0 );
+
+    std::stringstream ss;
+    checkpoint::writeHeader( ss );
+    checkpoint::writeParticle( ss, p );
+    checkpoint::writeVector( ss, values );
+    checkpoint::writeString( ss, "state" );
+
+    PoseParticle r;
+    std::vector<double> rvalues;
+    std::string rstring;
+    checkpoint::readHeader( ss );
+    checkpoint::readParticle( ss, r );
+    checkpoint::readVector( ss, rvalues );
+    checkpoint::readString( ss, rstring );
+
+    BOOST_CHECK( r.position == p.position );
+    BOOST_CHECK_EQUAL( r.orientation, p.orientation );
+    BOOST_CHECK_EQUAL( r.zPos, p.zPos );
+    BOOST_CHECK_EQUAL( r.zSigma, p.zSigma );
+    BOOST_CHECK_EQUAL( r.mprob, p.mprob );
+    BOOST_CHECK_EQUAL( r.floating, p.floating );
+    BOOST_CHECK( r.meas_pos == p.meas_pos );
+    BOOST_CHECK_EQUAL( r.weight, p.weight );
+    // debug data is not part of the checkpoint
+    BOOST_CHECK( r.cpoints.empty() );
+    BOOST_CHECK( rvalues == values );
+    BOOST_CHECK_EQUAL( rstring, "state" );
+
+    // reading past the end fails
+    BOOST_CHECK_THROW( checkpoint::readParticle( ss, r ), std::runtime_error );
+
+    std::stringstream invalid( "not a checkpoint" );
+    BOOST_CHECK_THROW( checkpoint::readHeader( invalid ), std::runtime_error );
+}
+
+/** path of a new empty file in the temp directory, which the caller
+ * removes */
+std::string createTempFile()
+{
+    char path[] = "/tmp/eslam_test_XXXXXX";
+    const int fd = mkstemp( path );
+    BOOST_REQUIRE( fd >= 0 );
+    close( fd );
+    return path;
+}
+
+BOOST_AUTO_TEST_CASE( replay_log )
+{
+    const std::string path = createTempFile();
+
+    odometry::BodyContactState bs;
+    bs.points.resize( 2 );
+    bs.points[0].position = base::Vector3d( 0.1, 0.2, -0.3 );
+    bs.points[0].contact = 1.0;
+    bs.points[0].slip = 0.0;
+    bs.points[0].groupId = 0;
+    bs.points[1] = bs.points[0];
+    bs.points[1].groupId = 1;
+
+    base::samples::LaserScan scan;
+    scan.start_angle = -1.0;
+    scan.angular_resolution = 0.01;
+    scan.speed = 0;
+    scan.minRange = 20;
+    scan.maxRange = 30000;
+    scan.ranges.resize( 200, 1500 );
+
+    const Eigen::Affine3d body2odometry( 
+	    Eigen::Translation3d( 1.0, 2.0, 0.5 ) 
+	    * Eigen::AngleAxisd( 0.3, Eigen::Vector3d::UnitZ() ) );
+
+    {
+	LogWriter writer( path );
+	writer.writeGroundTruth( base::Time::fromSeconds( 1.0 ), body2odometry );
+	writer.writeContactState( base::Time::fromSeconds( 1.1 ), body2odometry, bs );
+	writer.writeLaserScan( base::Time::fromSeconds( 1.2 ), body2odometry, scan, Eigen::Affine3d::Identity() );
+    }
+
+    LogReader reader( path );
+    LogRecord record;
+    for( int pass = 0; pass < 2; pass++ )
+    {
+	BOOST_REQUIRE( reader.read( record ) );
+	BOOST_CHECK_EQUAL( record.type, LogRecord::GROUND_TRUTH );
+	BOOST_CHECK( record.body2odometry.isApprox( body2odometry ) );
+
+	BOOST_REQUIRE( reader.read( record ) );
+	BOOST_CHECK_EQUAL( record.type, LogRecord::CONTACT_STATE );
+	BOOST_CHECK_EQUAL( record.time.toMicroseconds(), 1100000 );
+	BOOST_REQUIRE_EQUAL( record.contactState.points.size(), 2u );
+	BOOST_CHECK( record.contactState.points[0].position == bs.points[0].position );
+	BOOST_CHECK_EQUAL( record.contactState.points[1].groupId, 1 );
+
+	BOOST_REQUIRE( reader.read( record ) );
+	BOOST_CHECK_EQUAL( record.type, LogRecord::LASER_SCAN );
+	BOOST_CHECK_EQUAL( record.scan.start_angle, scan.start_angle );
+	BOOST_CHECK_EQUAL( record.scan.maxRange, scan.maxRange );
+	BOOST_CHECK( record.scan.ranges == scan.ranges );
+
+	BOOST_CHECK( !reader.read( record ) );
+	reader.rewind();
+    }
+
+    remove( path.c_str() );
+
+    LatencyStats stats;
+    for( int i = 100; i > 0; i-- )
+	stats.add( i );
+    BOOST_CHECK_EQUAL( stats.percentile( 50 ), 50 );
+    BOOST_CHECK_EQUAL( stats.percentile( 99 ), 99 );
+    BOOST_CHECK_EQUAL( stats.percentile( 100 ), 100 );
+    BOOST_CHECK_CLOSE( stats.mean(), 50.5, 1e-9 );
+}
+
+BOOST_AUTO_TEST_CASE( update_scheduler )
+{
+    UpdateThreshold threshold( 0.1, 0.2 );
+    BOOST_CHECK( !threshold.test( Eigen::Affine3d( Eigen::Translation3d( 0.05, 0, 0 ) ) ) );
+    BOOST_CHECK( threshold.test( Eigen::Affine3d( Eigen::Translation3d( 0.15, 0, 0 ) ) ) );
+    BOOST_CHECK( !threshold.test( Eigen::Affine3d( Eigen::AngleAxisd( 0.15, Eigen::Vector3d::UnitZ() ) ) ) );
+    BOOST_CHECK( threshold.test( Eigen::Affine3d( Eigen::AngleAxisd( 0.25, Eigen::Vector3d::UnitZ() ) ) ) );
+
+    UpdateSchedulerConfig config;
+    config.maxThreshold = UpdateThreshold( 1.0, 1.0 );
+    UpdateScheduler scheduler( config, threshold );
+
+    const base::Time time;
+    const Eigen::Affine3d small( Eigen::Translation3d( 0.05, 0, 0 ) );
+    const Eigen::Affine3d medium( Eigen::Translation3d( 0.5, 0, 0 ) );
+    const Eigen::Affine3d large( Eigen::Translation3d( 2.0, 0, 0 ) );
+
+    // initially the filter is considered ambiguous
+    BOOST_CHECK( !scheduler.test( small, time ) );
+    BOOST_CHECK( scheduler.test( medium, time ) );
+
+    // converged particles
+    std::vector<PoseParticle> particles( 100, PoseParticle( base::Vector2d( 1.0, 2.0 ), 0.5 ) );
+    for( size_t i = 0; i < particles.size(); i++ )
+	particles[i].weight = 1.0 / particles.size();
+
+    scheduler.updated( particles, 100.0, 0.0, 0.0 );
+    BOOST_CHECK( !scheduler.isAmbiguous() );
+    BOOST_CHECK_SMALL( scheduler.getSpread(), 1e-6 );
+    BOOST_CHECK( !scheduler.test( medium, time ) );
+    BOOST_CHECK( scheduler.test( large, time ) );
+    BOOST_CHECK_EQUAL( scheduler.getSkipped(), 1u );
+
+    // high information gain
+    scheduler.updated( particles, 100.0, 0.5, 0.0 );
+    BOOST_CHECK( scheduler.isAmbiguous() );
+    BOOST_CHECK( scheduler.test( medium, time ) );
+
+    // spread out particles
+    for( size_t i = 0; i < particles.size(); i++ )
+	particles[i].position.x() = i * 0.01;
+    scheduler.updated( particles, 100.0, 0.0, 0.0 );
+    BOOST_CHECK( scheduler.isAmbiguous() );
+    BOOST_CHECK_CLOSE( scheduler.getSpread(), 0.2887, 0.1 );
+}
+
+BOOST_AUTO_TEST_CASE( particle_geometry )
+{
+    PoseDistribution dist;
+    dist.particles.resize( 100, PoseParticle( base::Vector2d( 1.0, 2.0 ), 0.5, 0.1 ) );
+    for( size_t i = 0; i < dist.particles.size(); i++ )
+    {
+	PoseParticle &p( dist.particles[i] );
+	p.weight = 1.0 / dist.particles.size();
+	p.floating = i % 2;
+	for( size_t j = 0; j < 50; j++ )
+	    p.cpoints.push_back( ContactPoint( base::Vector3d( i, j, 0 ), 0.1, 0.01 ) );
+    }
+
+    vizkit3d::ParticleGeometry geometry;
+    geometry.setData( dist );
+
+    // without inspected particle and contacts, only the glyphs are built
+    geometry.build( -1, false, 1000 );
+    BOOST_REQUIRE_EQUAL( geometry.getGlyphs().size(), 100u );
+    BOOST_CHECK_CLOSE( geometry.getGlyphs()[0].height, 0.2, 1e-4 );
+    BOOST_CHECK_EQUAL( geometry.getGlyphs()[0].style, vizkit3d::ParticleGlyph::NORMAL );
+    BOOST_CHECK_EQUAL( geometry.getGlyphs()[1].style, vizkit3d::ParticleGlyph::FLOATING );
+    BOOST_CHECK( geometry.getPointVertices().empty() );
+
+    // all contacts of the inspected particle are shown
+    geometry.build( 3, false, 1000 );
+    BOOST_CHECK_EQUAL( geometry.getGlyphs()[3].style, vizkit3d::ParticleGlyph::INSPECTED );
+    BOOST_CHECK_EQUAL( geometry.getPointVertices().size(), 50u );
+    BOOST_CHECK_EQUAL( geometry.getLineVertices().size(), 100u );
+    BOOST_CHECK_EQUAL( geometry.getPointVertices()[0].x(), 3.0f );
+
+    // the contacts of the other particles are decimated
+    geometry.build( 3, true, 1000 );
+    BOOST_CHECK_LE( geometry.getPointVertices().size(), 50u + 1000u );
+    BOOST_CHECK_GT( geometry.getPointVertices().size(), 50u + 500u );
+    BOOST_CHECK_EQUAL( geometry.getPointVertices().size(), geometry.getPointColors().size() );
+}
+
+BOOST_AUTO_TEST_CASE( compact_distribution )
+{
+    PoseDistribution dist;
+    dist.time = base::Time::fromMicroseconds( 1000 );
+    dist.orientation = base::Quaterniond::Identity();
+    for( size_t i = 0; i < 100; i++ )
+    {
+	PoseParticle p( base::Vector2d( 10.0 + i * 0.01, -5.0 ), M_PI - 0.0005, 0.2, 0, i % 2 );
+	p.weight = (i + 1) / 5050.0;
+	dist.particles.push_back( p );
+    }
+
+    CompactDistributionConfig config;
+    config.keyframePeriod = 5;
+    PoseDistributionEncoder encoder( config );
+    PoseDistributionDecoder decoder;
+
+    CompactPoseDistribution compact;
+    PoseDistribution result;
+    size_t keyframeSize = 0;
+    for( size_t step = 0; step < 3; step++ )
+    {
+	encoder.encode( dist, compact );
+	BOOST_CHECK_EQUAL( compact.delta, step > 0 );
+	if( step == 0 )
+	    keyframeSize = compact.data.size();
+	else
+	    BOOST_CHECK_LT( compact.data.size(), keyframeSize );
+
+	BOOST_REQUIRE( decoder.decode( compact, result ) );
+	BOOST_REQUIRE_EQUAL( result.particles.size(), dist.particles.size() );
+	for( size_t i = 0; i < dist.particles.size(); i++ )
+	{
+	    const PoseParticle &a( dist.particles[i] ), &b( result.particles[i] );
+	    BOOST_CHECK_SMALL( (a.position - b.position).norm(), config.positionResolution );
+	    BOOST_CHECK_SMALL( a.zPos - b.zPos, config.positionResolution );
+	    const double dh = a.orientation - b.orientation;
+	    BOOST_CHECK_SMALL( atan2( sin( dh ), cos( dh ) ), config.headingResolution );
+	    BOOST_CHECK_SMALL( a.weight - b.weight, 1e-5 );
+	    BOOST_CHECK_EQUAL( a.floating, b.floating );
+	}
+
+	// move the particles across the heading discontinuity
+	for( size_t i = 0; i < dist.particles.size(); i++ )
+	{
+	    dist.particles[i].position.x() += 0.05;
+	    const double h = dist.particles[i].orientation + 0.001;
+	    dist.particles[i].orientation = atan2( sin( h ), cos( h ) );
+	}
+    }
+
+    // a missing sample invalidates the delta chain until the next keyframe
+    encoder.encode( dist, compact );
+    encoder.encode( dist, compact );
+    BOOST_CHECK( compact.delta );
+    BOOST_CHECK( !decoder.decode( compact, result ) );
+
+    // top-k and subsampling
+    config.mode = CompactPoseDistribution::TOP_K;
+    config.topK = 10;
+    config.particlePeriod = 2;
+    PoseDistributionEncoder topk( config );
+    topk.encode( dist, compact );
+    BOOST_CHECK_EQUAL( compact.mode, CompactPoseDistribution::TOP_K );
+    BOOST_REQUIRE( decoder.decode( compact, result ) );
+    BOOST_REQUIRE_EQUAL( result.particles.size(), 10u );
+    BOOST_CHECK_SMALL( result.particles[9].weight - dist.particles[99].weight, 1e-5 );
+    topk.encode( dist, compact );
+    BOOST_CHECK_EQUAL( compact.mode, CompactPoseDistribution::GMM_ONLY );
+    BOOST_CHECK( compact.data.empty() );
+}
+
+BOOST_AUTO_TEST_CASE( trace_export )
+{
+    Trace::clear();
+    Trace::scope( "stage", 100, 150 );
+    Trace::message( "a \"quoted\" message" );
+
+    std::ostringstream os;
+    Trace::writeChromeTrace( os );
+    const std::string json = os.str();
+    BOOST_CHECK( json.find( "{\"name\":\"stage\",\"pid\":1" ) != std::string::npos );
+    BOOST_CHECK( json.find( "\"ts\":100,\"ph\":\"X\",\"dur\":50" ) != std::string::npos );
+    BOOST_CHECK( json.find( "a \\\"quoted\\\" message" ) != std::string::npos );
+
+    Trace::clear();
+    std::ostringstream empty;
+    Trace::writeChromeTrace( empty );
+    BOOST_CHECK( empty.str().find( "stage" ) == std::string::npos );
+}
+
+BOOST_AUTO_TEST_CASE( perf_counters )
+{
+    // disabled stages are not recorded
+    PerfStats::clear();
+    {
+	PerfScope perf( "disabled" );
+    }
+    BOOST_CHECK( PerfStats::getStages().empty() );
+
+    PerfStats::setEnabled( true );
+    volatile double sum = 0;
+    {
+	PerfScope perf( "loop", 1000 );
+	for( int i = 0; i < 1000; i++ )
+	    sum += sqrt( static_cast<double>( i ) );
+    }
+    // the counts of a worker thread are added without a call, and the
+    // first thread of a team is left to the enclosing scope
+    {
+	PerfWorkerScope worker( "loop", true );
+	for( int i = 0; i < 1000; i++ )
+	    sum += sqrt( static_cast<double>( i ) );
+    }
+    {
+	PerfWorkerScope first( "first", false );
+    }
+    PerfStats::setEnabled( false );
+
+    // counters are not available everywhere, e.g. in containers
+    const std::map<std::string, PerfStage> stages = PerfStats::getStages();
+    if( !stages.empty() )
+    {
+	const PerfStage &s( stages.find( "loop" )->second );
+	BOOST_CHECK_EQUAL( s.calls, 1u );
+	BOOST_CHECK_EQUAL( s.items, 1000u );
+	BOOST_CHECK_GT( s.counts.cycles, 0u );
+	BOOST_CHECK_GT( s.counts.instructions, 2000u );
+	BOOST_CHECK( stages.find( "first" ) == stages.end() );
+    }
+    PerfStats::clear();
+
+    // the timing works without the counters
+    PerfStats::setTimingEnabled( true );
+    for( int i = 0; i < 2; i++ )
+    {
+	PerfScope perf( "timed" );
+    }
+    PerfStats::setTimingEnabled( false );
+    std::map<std::string, PerfStage> timedStages = PerfStats::getStages();
+    const PerfStage &timed( timedStages["timed"] );
+    BOOST_CHECK_EQUAL( timed.durations.size(), 2u );
+    BOOST_CHECK_EQUAL( timed.calls, 0u );
+    PerfStats::clear();
+}
+
+BOOST_AUTO_TEST_CASE( morton_order )
+{
+    BOOST_CHECK_EQUAL( MortonOrder::getKey( 0, 0 ), 0u );
+    BOOST_CHECK_EQUAL( MortonOrder::getKey( 1, 0 ), 1u );
+    BOOST_CHECK_EQUAL( MortonOrder::getKey( 0, 1 ), 2u );
+    BOOST_CHECK_EQUAL( MortonOrder::getKey( 3, 5 ), 0x27u );
+    BOOST_CHECK_EQUAL( MortonOrder::getKey( 0xFFFF, 0xFFFF ), 0xFFFFFFFFu );
+
+    // particles on a 4x4 grid, in reverse row order
+    std::vector<PoseParticle> particles;
+    for( int y = 3; y >= 0; y-- )
+	for( int x = 3; x >= 0; x-- )
+	    particles.push_back( PoseParticle( base::Vector2d( 10.0 + x, -5.0 + y ), 0 ) );
+
+    MortonOrder order;
+    order.update( particles, 1.0 );
+    const std::vector<size_t> &o( order.getOrder() );
+    BOOST_REQUIRE_EQUAL( o.size(), particles.size() );
+
+    // the first quadrant comes first, in z-order
+    const double expected[4][2] = { {10, -5}, {11, -5}, {10, -4}, {11, -4} };
+    for( size_t i = 0; i < 4; i++ )
+    {
+	BOOST_CHECK_EQUAL( particles[o[i]].position.x(), expected[i][0] );
+	BOOST_CHECK_EQUAL( particles[o[i]].position.y(), expected[i][1] );
+    }
+
+    // the order is a permutation
+    std::vector<size_t> sorted( o );
+    std::sort( sorted.begin(), sorted.end() );
+    for( size_t i = 0; i < sorted.size(); i++ )
+	BOOST_CHECK_EQUAL( sorted[i], i );
+
+    // particles in the same cell keep their previous order
+    std::vector<PoseParticle> same( 3, PoseParticle( base::Vector2d( 1.0, 1.0 ), 0 ) );
+    order.update( same, 1.0 );
+    BOOST_CHECK_EQUAL( order.getOrder()[0], 0u );
+    BOOST_CHECK_EQUAL( order.getOrder()[2], 2u );
+}
+
+BOOST_AUTO_TEST_CASE( likelihood_cache )
+{
+    LikelihoodCache cache;
+    cache.setResolution( 0.01, 0.01 );
+
+    LikelihoodCache::Entry entry;
+    entry.found = true;
+    entry.result.weight = 0.5;
+    entry.result.contactPoints.push_back( ContactPoint( base::Vector3d( 1, 2, 3 ), 0.1, 0.01 ) );
+
+    LikelihoodCache::Entry e;
+    const LikelihoodCache::Key key = cache.getKey( 1.001, 2.001, 0.301, 0.101, 0.051 );
+    BOOST_CHECK( !cache.find( key, e ) );
+    cache.insert( key, entry );
+
+    // an existing entry is not replaced
+    LikelihoodCache::Entry other( entry );
+    other.result.weight = 0.25;
+    cache.insert( key, other );
+
+    // poses within the same bin share the entry
+    BOOST_REQUIRE( cache.find( cache.getKey( 1.009, 2.009, 0.309, 0.109, 0.059 ), e ) );
+    BOOST_CHECK_EQUAL( e.result.weight, 0.5 );
+    BOOST_CHECK_EQUAL( e.result.contactPoints.size(), 1u );
+
+    // any coordinate in another bin is a miss
+    BOOST_CHECK( !cache.find( cache.getKey( 1.011, 2.001, 0.301, 0.101, 0.051 ), e ) );
+    BOOST_CHECK( !cache.find( cache.getKey( 1.001, 2.001, 0.311, 0.101, 0.051 ), e ) );
+    BOOST_CHECK( !cache.find( cache.getKey( 1.001, 2.001, 0.301, 0.111, 0.051 ), e ) );
+
+    BOOST_CHECK_EQUAL( cache.getLookups(), 5u );
+    BOOST_CHECK_EQUAL( cache.getHits(), 1u );
+    BOOST_CHECK_CLOSE( cache.getHitRate(), 0.2, 1e-6 );
+
+    // clearing keeps the statistics
+    cache.clear();
+    BOOST_CHECK( !cache.find( key, e ) );
+    BOOST_CHECK_EQUAL( cache.getLookups(), 6u );
+}
+
+BOOST_AUTO_TEST_CASE( island_resampling )
+{
+    SingleValueTracking filter; 
+    filter.init( 100 );
+    filter.update( 0.5 );
+
+    std::vector<State> before = filter.getParticles();
+    double islandWeight = 0;
+    for( size_t i = 25; i < 50; i++ )
+	islandWeight += before[i].weight;
+
+    boost::minstd_rand gen( 1u );
+    filter.resample_stratified( 25, 50, gen );
+
+    const std::vector<State> &after( filter.getParticles() );
+    BOOST_REQUIRE_EQUAL( after.size(), 100u );
+
+    // the other islands are not touched
+    for( size_t i = 0; i < 100; i++ )
+    {
+	if( i >= 25 && i < 50 )
+	    continue;
+	BOOST_CHECK_EQUAL( after[i].pos, before[i].pos );
+	BOOST_CHECK_EQUAL( after[i].weight, before[i].weight );
+    }
+
+    // the island keeps its weight and only contains its own particles
+    for( size_t i = 25; i < 50; i++ )
+    {
+	BOOST_CHECK_CLOSE( after[i].weight, islandWeight / 25, 1e-6 );
+	bool found = false;
+	for( size_t k = 25; k < 50; k++ )
+	    found |= after[i].pos == before[k].pos;
+	BOOST_CHECK( found );
+    }
+}
+
+/** 
+ * map with a grid of 10x10m around the origin, with a slope along x and
+ * waves along y, so the likelihood depends on the pose
+ */
+envire::MLSMap* createTerrainMap( envire::Environment& env )
+{
+    envire::MLSMap *map = new envire::MLSMap();
+    env.setFrameNode( map, env.getRootNode() );
+
+    envire::MLSGrid *grid = new envire::MLSGrid( 100, 100, 0.1, 0.1, -5.0, -5.0 );
+    env.setFrameNode( grid, env.getRootNode() );
+    map->addGrid( grid );
+    for( size_t x = 0; x < 100; x++ )
+	for( size_t y = 0; y < 100; y++ )
+	{
+	    const double height = 0.01 * x + 0.05 * sin( 0.3 * y );
+	    grid->insertTail( x, y, envire::MLSGrid::SurfacePatch( height - 0.5, 0.05 ) );
+	}
+
+    return map;
+}
+
+/** four feet in contact, 0.3m below the body */
+odometry::BodyContactState createContactState()
+{
+    odometry::BodyContactState bs;
+    bs.points.resize( 4 );
+    for( int i = 0; i < 4; i++ )
+    {
+	bs.points[i].position = base::Vector3d( i < 2 ? 0.3 : -0.3, i % 2 ? 0.2 : -0.2, -0.3 );
+	bs.points[i].contact = 1.0;
+	bs.points[i].slip = 0.0;
+	bs.points[i].groupId = i;
+    }
+    return bs;
+}
+
+/** scan of a laser at the given position on the body, which scans the
+ * ground in front of it */
+base::samples::LaserScan createLaserScan( Eigen::Affine3d& laser2body, 
+	const Eigen::Vector3d& position = Eigen::Vector3d( 0, 0, 0.5 ) )
+{
+    base::samples::LaserScan scan;
+    scan.start_angle = -1.2;
+    scan.angular_resolution = 0.01;
+    scan.speed = 0;
+    scan.minRange = 20;
+    scan.maxRange = 30000;
+    scan.ranges.resize( 100, 1500 );
+    laser2body = Eigen::Translation3d( position ) 
+	* Eigen::AngleAxisd( M_PI / 2, Eigen::Vector3d::UnitX() );
+    return scan;
+}
+
+/** pose estimator with uniformly weighted particles on the terrain map */
+struct TerrainEstimator
+{
+    TerrainEstimator( const eslam::Configuration& config, int particles, bool useShared = true )
+	: odometry( odometryConfig ), filter( odometry, config )
+    {
+	map = createTerrainMap( env );
+	filter.init( particles, 
+		base::Pose2D( base::Vector2d( 0, 0 ), 0 ), 
+		base::Pose2D( base::Vector2d( 0.5, 0.5 ), 0.3 ), 
+		0.3, 0.05 );
+	for( size_t i = 0; i < filter.getParticles().size(); i++ )
+	    filter.getParticles()[i].weight = 1.0 / particles;
+	filter.setEnvironment( &env, envire::MLSMap::Ptr( map ), useShared );
+    }
+
+    void update( const base::Time& deadline = base::Time() )
+    {
+	filter.update( createContactState(), base::Quaterniond::Identity(), 
+		std::vector<terrain_estimator::TerrainClassification>(), deadline );
+    }
+
+    envire::Environment env;
+    envire::MLSMap *map;
+    odometry::Configuration odometryConfig;
+    odometry::FootContact odometry;
+    PoseEstimator filter;
+};
+
+BOOST_AUTO_TEST_CASE( cluster_evaluation )
+{
+    eslam::Configuration config;
+    config.minEffective = 0;
+    TerrainEstimator full( config, 200 );
+    full.update();
+    BOOST_CHECK_EQUAL( full.filter.getEvaluatedCount(), 200u );
+
+    // with a threshold of 0, all particles are evaluated
+    config.useClusterEvaluation = true;
+    config.clusterResolution = 1.0;
+    config.clusterAngularResolution = 1.0;
+    config.clusterThreshold = 0.0;
+    TerrainEstimator refined( config, 200 );
+    refined.update();
+    BOOST_CHECK_EQUAL( refined.filter.getEvaluatedCount(), 200u );
+    for( size_t i = 0; i < 200; i++ )
+	BOOST_CHECK_CLOSE( refined.filter.getParticles()[i].weight, full.filter.getParticles()[i].weight, 1e-9 );
+
+    // with a threshold above 1 only the representatives are evaluated, and
+    // the other particles take their likelihood
+    config.clusterThreshold = 2.0;
+    TerrainEstimator coarse( config, 200 );
+    std::vector<double> zPos, zSigma;
+    for( size_t i = 0; i < coarse.filter.getParticles().size(); i++ )
+    {
+	PoseEstimator::Particle &p( coarse.filter.getParticles()[i] );
+	p.zPos += 0.001 * (i % 10);
+	p.zSigma += 0.001 * (i % 5);
+	zPos.push_back( p.zPos );
+	zSigma.push_back( p.zSigma );
+    }
+    coarse.update();
+    const size_t evaluated = coarse.filter.getEvaluatedCount();
+    BOOST_CHECK( evaluated > 0 && evaluated < 200u );
+
+    size_t shared = 0;
+    const std::vector<PoseEstimator::Particle> &particles( coarse.filter.getParticles() );
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	BOOST_CHECK( !particles[i].floating );
+	for( size_t j = 0; j < i; j++ )
+	    if( particles[j].mprob == particles[i].mprob )
+	    {
+		// the particles of a cluster also take the height correction
+		// of their representative
+		BOOST_CHECK_SMALL( (particles[i].zPos - zPos[i]) - (particles[j].zPos - zPos[j]), 1e-9 );
+		BOOST_CHECK_CLOSE( particles[i].zSigma / zSigma[i], particles[j].zSigma / zSigma[j], 1e-6 );
+		shared++;
+		break;
+	    }
+    }
+    BOOST_CHECK_EQUAL( shared, 200u - evaluated );
+}
+
+BOOST_AUTO_TEST_CASE( island_estimator )
+{
+    eslam::Configuration config;
+    config.islandCount = 4;
+    config.islandMigrationPeriod = 1;
+    config.islandMigrationCount = 2;
+    // resample all islands on each update
+    config.minEffective = 1000;
+
+    TerrainEstimator islands( config, 40, false );
+    for( int i = 0; i < 3; i++ )
+    {
+	islands.update();
+
+	const std::vector<PoseEstimator::Particle> &particles( islands.filter.getParticles() );
+	BOOST_REQUIRE_EQUAL( particles.size(), 40u );
+	BOOST_CHECK_EQUAL( islands.filter.getIslandCount(), 4u );
+	BOOST_CHECK_EQUAL( islands.filter.getIslandBegin( 1 ), 10u );
+
+	// each island keeps its total weight while resampling, so the
+	// weights still sum up to one
+	double sum = 0;
+	for( size_t k = 0; k < particles.size(); k++ )
+	    sum += particles[k].weight;
+	BOOST_CHECK_CLOSE( sum, 1.0, 1e-6 );
+
+	// the resampled particles have their own maps, and the maps of the
+	// particles which were dropped are removed from the environment
+	std::set<envire::MLSMap*> maps;
+	for( size_t k = 0; k < particles.size(); k++ )
+	    maps.insert( particles[k].grid.getMap() );
+	BOOST_CHECK_EQUAL( maps.size(), 40u );
+	BOOST_CHECK_EQUAL( islands.env.getItems<envire::MLSMap>().size(), 40u );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( deadline_order )
+{
+    std::vector<size_t> order;
+    std::vector<double> weights( 8, 0.1 );
+    for( size_t i = 0; i < 8; i++ )
+	order.push_back( i );
+    weights[5] = 0.3;
+
+    // the particle with the highest weight first, followed by the others
+    // in bit reversed order
+    std::vector<size_t> sequence;
+    PoseEstimator::getPriorityOrder( order, weights, 1.0 / 8, sequence );
+    const size_t expected[] = { 5, 0, 4, 2, 7, 1, 6, 3 };
+    BOOST_CHECK_EQUAL_COLLECTIONS( sequence.begin(), sequence.end(), expected, expected + 8 );
+
+    // without priority particles the order is a permutation as well
+    PoseEstimator::getPriorityOrder( order, weights, 0.0, sequence );
+    BOOST_REQUIRE_EQUAL( sequence.size(), 8u );
+    BOOST_CHECK_EQUAL( std::set<size_t>( sequence.begin(), sequence.end() ).size(), 8u );
+}
+
+BOOST_AUTO_TEST_CASE( deadline_update )
+{
+    eslam::Configuration config;
+    // resample whenever the update gets that far
+    config.minEffective = 1000;
+
+    // a deadline far in the future evaluates all particles
+    TerrainEstimator late( config, 50 );
+    late.update( base::Time::now() + base::Time::fromSeconds( 3600 ) );
+    BOOST_CHECK_EQUAL( late.filter.getEvaluatedCount(), 50u );
+    BOOST_CHECK_CLOSE( late.filter.getCompletedFraction(), 1.0, 1e-9 );
+
+    // a deadline which has passed already evaluates no particle, and the
+    // resampling, which would clone the maps, is deferred
+    TerrainEstimator early( config, 50, false );
+    std::vector<envire::MLSMap*> maps;
+    for( size_t i = 0; i < early.filter.getParticles().size(); i++ )
+	maps.push_back( early.filter.getParticles()[i].grid.getMap() );
+
+    early.update( base::Time::fromSeconds( 1 ) );
+    BOOST_CHECK_EQUAL( early.filter.getEvaluatedCount(), 0u );
+    BOOST_CHECK_EQUAL( early.filter.getCompletedFraction(), 0.0 );
+
+    const std::vector<PoseEstimator::Particle> &particles( early.filter.getParticles() );
+    BOOST_REQUIRE_EQUAL( particles.size(), 50u );
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	BOOST_CHECK( particles[i].floating );
+	BOOST_CHECK_CLOSE( particles[i].weight, 1.0 / 50, 1e-6 );
+	BOOST_CHECK_EQUAL( particles[i].grid.getMap(), maps[i] );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( numa_split )
+{
+    // contiguous blocks, one per node
+    const int blockNodes[] = { 0, 0, 0, 0, 1, 1, 1, 2, 2, 2 };
+    for( size_t i = 0; i < 10; i++ )
+	BOOST_CHECK_EQUAL( NumaPlacement::getBlockNode( i, 10, 3 ), blockNodes[i] );
+    BOOST_CHECK_EQUAL( NumaPlacement::getBlockNode( 0, 0, 3 ), 0 );
+
+    // each node gets at least one thread, and each thread works on exactly
+    // one node as long as there are enough threads
+    for( int threads = 1; threads <= 9; threads++ )
+    {
+	for( int nodes = 1; nodes <= 4; nodes++ )
+	{
+	    std::vector<int> count( threads, 0 );
+	    for( int node = 0; node < nodes; node++ )
+	    {
+		int first, last;
+		NumaPlacement::getNodeThreads( node, nodes, threads, first, last );
+		BOOST_REQUIRE( first < last && last <= threads );
+		for( int t = first; t < last; t++ )
+		    count[t]++;
+	    }
+	    for( int t = 0; t < threads; t++ )
+	    {
+		BOOST_CHECK( count[t] >= 1 );
+		if( threads >= nodes )
+		    BOOST_CHECK_EQUAL( count[t], 1 );
+	    }
+	}
+    }
+}
+
+BOOST_AUTO_TEST_CASE( numa_estimator )
+{
+    eslam::Configuration config;
+    config.minEffective = 0;
+    TerrainEstimator plain( config, 30, false );
+    plain.update();
+
+    // the blocks are forced, so this works without NUMA support as well
+    config.useNumaPlacement = true;
+    config.numaNodeCount = 3;
+    TerrainEstimator placed( config, 30, false );
+    placed.update();
+
+    const std::vector<PoseEstimator::Particle> &particles( placed.filter.getParticles() );
+    BOOST_CHECK_EQUAL( placed.filter.getEvaluatedCount(), 30u );
+    std::set<envire::MLSMap*> maps;
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	BOOST_CHECK_CLOSE( particles[i].weight, plain.filter.getParticles()[i].weight, 1e-9 );
+	maps.insert( particles[i].grid.getMap() );
+    }
+    BOOST_CHECK_EQUAL( maps.size(), 30u );
+
+    // each node reads its own copy of a shared map
+    TerrainEstimator shared( config, 30, true );
+    shared.update();
+    maps.clear();
+    for( size_t i = 0; i < shared.filter.getParticles().size(); i++ )
+	maps.insert( shared.filter.getParticles()[i].grid.getMap() );
+    BOOST_CHECK_EQUAL( maps.size(), 3u );
+}
+
+BOOST_AUTO_TEST_CASE( replay_repeat )
+{
+    const std::string path = createTempFile();
+    {
+	LogWriter writer( path );
+	writer.writeGroundTruth( base::Time::fromSeconds( 1.0 ), Eigen::Affine3d::Identity() );
+	for( int i = 0; i < 10; i++ )
+	    writer.writeContactState( base::Time::fromSeconds( 1.1 + 0.1 * i ), 
+		    Eigen::Affine3d( Eigen::Translation3d( 0.1 * i, 0, 0 ) ), createContactState() );
+    }
+
+    eslam::Configuration config;
+    config.particleCount = 50;
+    config.useLikelihoodCache = true;
+    odometry::Configuration odometryConfig;
+    Replay replay( odometryConfig, config );
+
+    // runs with the same seed give the same particles
+    LogReader log( path );
+    boost::uint64_t digest = 0;
+    for( int run = 0; run < 2; run++ )
+    {
+	envire::Environment env;
+	createTerrainMap( env );
+
+	log.rewind();
+	const ReplayResult result = replay.run( log, &env );
+	replay.clear();
+
+	BOOST_CHECK_EQUAL( result.records, 11u );
+	BOOST_CHECK_EQUAL( result.update.count(), 10u );
+	BOOST_CHECK( !result.stages.empty() );
+	if( run > 0 )
+	    BOOST_CHECK_EQUAL( result.stateDigest, digest );
+	digest = result.stateDigest;
+    }
+
+    remove( path.c_str() );
+}
+
+BOOST_AUTO_TEST_CASE( async_mapping )
+{
+    Eigen::Affine3d laser2body;
+    const base::samples::LaserScan scan = createLaserScan( laser2body );
+
+    eslam::Configuration config;
+    config.particleCount = 20;
+    config.mappingQueueSize = 100;
+    config.mappingBatchSize = 3;
+    odometry::Configuration odometryConfig;
+
+    // the mapping thread gives the same maps as the synchronous mapping
+    std::vector<size_t> mapBytes;
+    for( int async = 0; async < 2; async++ )
+    {
+	config.asyncMapping = async;
+	envire::Environment env;
+	EmbodiedSlamFilter filter( odometryConfig, config );
+	filter.init( &env, base::Pose( Eigen::Affine3d::Identity() ), false );
+	for( int i = 0; i < 5; i++ )
+	    BOOST_CHECK( filter.update( Eigen::Affine3d( Eigen::Translation3d( 0.1 * i, 0, 0 ) ), scan, laser2body ) );
+	filter.waitForMapping();
+	BOOST_CHECK_EQUAL( filter.getDroppedMappingJobs(), 0u );
+	mapBytes.push_back( filter.getMemoryUsage().maps );
+    }
+    BOOST_CHECK_GT( mapBytes[0], 0u );
+    BOOST_CHECK_EQUAL( mapBytes[0], mapBytes[1] );
+
+    // the particles are resampled while the mapping thread still holds
+    // their old maps, which are removed from the environment once the jobs
+    // are done
+    config.minEffective = 1000;
+    envire::Environment env;
+    EmbodiedSlamFilter filter( odometryConfig, config );
+    filter.init( &env, base::Pose( Eigen::Affine3d::Identity() ), false );
+    const std::vector<terrain_estimator::TerrainClassification> ltc;
+    for( int i = 0; i < 10; i++ )
+    {
+	const Eigen::Affine3d body2odometry( Eigen::Translation3d( 0.1 * i, 0, 0 ) );
+	filter.update( body2odometry, scan, laser2body );
+	filter.update( body2odometry, createContactState(), ltc );
+    }
+    filter.waitForMapping();
+
+    std::set<envire::MLSMap*> maps;
+    for( size_t i = 0; i < filter.getParticles().size(); i++ )
+	maps.insert( filter.getParticles()[i].grid.getMap() );
+    BOOST_CHECK_EQUAL( env.getItems<envire::MLSMap>().size(), maps.size() );
+}
+
+BOOST_AUTO_TEST_CASE( sensor_offset )
+{
+    Eigen::Affine3d laser2body;
+    const base::samples::LaserScan scan = 
+	createLaserScan( laser2body, Eigen::Vector3d( 2.0, 0, 0.5 ) );
+
+    // sensors can be anywhere by default
+    eslam::Configuration config;
+    config.particleCount = 10;
+    odometry::Configuration odometryConfig;
+    {
+	envire::Environment env;
+	EmbodiedSlamFilter filter( odometryConfig, config );
+	filter.init( &env, base::Pose( Eigen::Affine3d::Identity() ), false );
+	BOOST_CHECK( filter.update( Eigen::Affine3d::Identity(), scan, laser2body ) );
+    }
+
+    // with a limit, a sensor further away is rejected instead of losing
+    // its data
+    config.maxSensorOffset = 1.0;
+    envire::Environment env;
+    EmbodiedSlamFilter filter( odometryConfig, config );
+    filter.init( &env, base::Pose( Eigen::Affine3d::Identity() ), false );
+    BOOST_CHECK_THROW( filter.update( Eigen::Affine3d::Identity(), scan, laser2body ), std::runtime_error );
+    BOOST_CHECK( filter.update( Eigen::Affine3d::Identity(), scan, 
+		Eigen::Translation3d( -2.0, 0, 0 ) * laser2body ) );
+}
+
+BOOST_AUTO_TEST_CASE( scan_projection )
+{
+    // a laser 1m above a flat floor, scanning in the x-z plane, with rays
+    // far enough apart to hit different cells
+    base::samples::LaserScan scan;
+    scan.start_angle = -2.0;
+    scan.angular_resolution = 0.15;
+    scan.speed = 0;
+    scan.minRange = 20;
+    scan.maxRange = 30000;
+    for( int i = 0; i < 7; i++ )
+	scan.ranges.push_back( static_cast<boost::uint32_t>( 
+		    -1000.0 / sin( scan.start_angle + i * scan.angular_resolution ) + 0.5 ) );
+
+    // the uncertainty of the transform dominates the sensor noise, which
+    // the two projections model differently
+    Eigen::Matrix<double,6,1> sigma;
+    sigma << 0.1, 0.1, 0, 0, 0, 0.05;
+    const envire::TransformWithUncertainty laser2grid( 
+	    Eigen::Affine3d( Eigen::Translation3d( 0, 0, 1.0 ) 
+		* Eigen::AngleAxisd( M_PI / 2, Eigen::Vector3d::UnitX() ) ),
+	    sigma.array().square().matrix().asDiagonal() );
+
+    envire::Environment env;
+    envire::FrameNode *laserFrame = new envire::FrameNode();
+    env.addChild( env.getRootNode(), laserFrame );
+    laserFrame->setTransform( laser2grid );
+
+    envire::LaserScan *scanNode = new envire::LaserScan();
+    env.setFrameNode( scanNode, laserFrame );
+    scanNode->addScanLine( 0, scan );
+    envire::TriMesh *mesh = new envire::TriMesh();
+    env.setFrameNode( mesh, laserFrame );
+    envire::ScanMeshing *smOp = new envire::ScanMeshing();
+    env.attachItem( smOp );
+    smOp->setMaxRange( 10.0 );
+    smOp->addInput( scanNode );
+    smOp->addOutput( mesh );
+    smOp->updateAll();
+
+    envire::MLSGrid *reference = new envire::MLSGrid( 40, 40, 0.1, 0.1, -2.0, -2.0 );
+    env.setFrameNode( reference, env.getRootNode() );
+    envire::MLSProjection *mlsOp = new envire::MLSProjection();
+    env.attachItem( mlsOp );
+    mlsOp->addInput( mesh );
+    mlsOp->addOutput( reference );
+    mlsOp->useUncertainty( true );
+    mlsOp->updateAll();
+
+    envire::MLSGrid *fused = new envire::MLSGrid( 40, 40, 0.1, 0.1, -2.0, -2.0 );
+    env.setFrameNode( fused, env.getRootNode() );
+    ScanProjection projection;
+    projection.setMaxRange( 10.0 );
+    projection.project( scan, laser2grid, *fused );
+
+    size_t cells = 0;
+    for( size_t m = 0; m < 40; m++ )
+    {
+	for( size_t n = 0; n < 40; n++ )
+	{
+	    envire::MLSGrid::iterator ref = reference->beginCell( m, n );
+	    envire::MLSGrid::iterator it = fused->beginCell( m, n );
+	    BOOST_REQUIRE_EQUAL( ref == reference->endCell(), it == fused->endCell() );
+	    if( ref == reference->endCell() )
+		continue;
+
+	    cells++;
+	    BOOST_CHECK_SMALL( it->mean - ref->mean, 1e-6 );
+	    BOOST_CHECK_CLOSE( it->stdev, ref->stdev, 5.0 );
+	}
+    }
+    BOOST_CHECK_EQUAL( cells, 7u );
+}
+
+/** gives access to the depth pyramid */
+struct PyramidProjection : public ScanProjection
+{
+    using ScanProjection::PyramidLevel;
+    using ScanProjection::buildPyramid;
+    using ScanProjection::pyramid;
+};
+
+BOOST_AUTO_TEST_CASE( depth_pyramid )
+{
+    // the left half of the image sees a surface at 1m, the right half one
+    // at 4m. Within each 4x4 block, the top left pixel is the nearest.
+    base::samples::DistanceImage dimage;
+    dimage.width = dimage.height = 16;
+    dimage.scale_x = dimage.scale_y = 0.01;
+    dimage.center_x = dimage.center_y = -0.08;
+    dimage.data.resize( 16 * 16 );
+    for( size_t y = 0; y < 16; y++ )
+	for( size_t x = 0; x < 16; x++ )
+	    dimage.data[y * 16 + x] = (x < 8 ? 1.0 : 4.0) + 0.001 * (x % 4 + y % 4);
+
+    PyramidProjection projection;
+    projection.setMaxRange( 10.0 );
+    projection.setResolution( 0.05 );
+    projection.setPyramidLevels( 2 );
+
+    projection.buildPyramid( dimage );
+    BOOST_REQUIRE_EQUAL( projection.pyramid.size(), 2u );
+    BOOST_CHECK_EQUAL( projection.pyramid[0].width, 8u );
+    const PyramidProjection::PyramidLevel &top( projection.pyramid[1] );
+    BOOST_REQUIRE_EQUAL( top.width, 4u );
+    BOOST_REQUIRE_EQUAL( top.height, 4u );
+    for( size_t by = 0; by < 4; by++ )
+	for( size_t bx = 0; bx < 4; bx++ )
+	{
+	    BOOST_CHECK_EQUAL( top.index[by * 4 + bx], by * 4 * 16 + bx * 4 );
+	    BOOST_CHECK_CLOSE( top.depth[by * 4 + bx], bx < 2 ? 1.0 : 4.0, 1e-4 );
+	}
+
+    // at 1m a pixel covers 1cm, so the coarsest level is used and only the
+    // nearest pixel of each block is projected, dropping the farther ones.
+    // At 4m a pixel covers 4cm, so all pixels are projected.
+    envire::Environment env;
+    envire::MLSGrid *grid = new envire::MLSGrid( 60, 60, 0.02, 0.02, -0.6, -0.6 );
+    env.setFrameNode( grid, env.getRootNode() );
+    projection.project( dimage, 
+	    envire::TransformWithUncertainty( Eigen::Affine3d::Identity(), Eigen::Matrix<double,6,6>::Zero() ), 
+	    *grid );
+
+    size_t nearCells = 0, farCells = 0;
+    for( size_t m = 0; m < 60; m++ )
+	for( size_t n = 0; n < 60; n++ )
+	    for( envire::MLSGrid::iterator it = grid->beginCell( m, n ); it != grid->endCell(); it++ )
+	    {
+		if( it->mean < 2.0 )
+		{
+		    nearCells++;
+		    BOOST_CHECK_CLOSE( it->mean, 1.0, 1e-4 );
+		}
+		else
+		    farCells++;
+	    }
+    BOOST_CHECK_EQUAL( nearCells, 8u );
+    BOOST_CHECK_EQUAL( farCells, 128u );
+}
+
+BOOST_AUTO_TEST_CASE( paging_radius )
+{
+    odometry::Configuration odometryConfig;
+    odometry::FootContact odometry( odometryConfig );
+
+    // the patches for the contact points would be spilled
+    eslam::Configuration config;
+    config.pagingRadius = 1.0;
+    BOOST_CHECK_THROW( PoseEstimator small( odometry, config ), std::runtime_error );
+
+    config.pagingRadius = GridAccess::LOOKUP_DISTANCE;
+    PoseEstimator filter( odometry, config );
+    BOOST_CHECK( filter.getPager().isEnabled() );
+
+    // paging stays disabled by default
+    BOOST_CHECK( !PoseEstimator( odometry, eslam::Configuration() ).getPager().isEnabled() );
+}
+
+/** maps which are used by the particles, checking that the other maps have
+ * been removed from the environment */
+std::set<envire::MLSMap*> getParticleMaps( PoseEstimator& filter, envire::Environment& env )
+{
+    std::set<envire::MLSMap*> maps;
+    for( size_t i = 0; i < filter.getParticles().size(); i++ )
+	maps.insert( filter.getParticles()[i].grid.getMap() );
+    BOOST_CHECK_EQUAL( env.getItems<envire::MLSMap>().size(), maps.size() );
+    return maps;
+}
+
+BOOST_AUTO_TEST_CASE( share_maps )
+{
+    eslam::Configuration config;
+    // resample on each update
+    config.minEffective = 1000;
+
+    // two groups of particles with nearly the same pose, where the maps of
+    // the particles with the highest weight are used by their group
+    TerrainEstimator estimator( config, 40, false );
+    std::vector<PoseEstimator::Particle> &particles( estimator.filter.getParticles() );
+    for( size_t i = 0; i < particles.size(); i++ )
+    {
+	particles[i].position = base::Vector2d( i < 20 ? 0.25 : 1.25, 0.01 * (i % 20) );
+	particles[i].orientation = 0.01 * (i % 20);
+    }
+    particles[3].weight = particles[25].weight = 2.0 / 40;
+    std::set<envire::MLSMap*> owners;
+    owners.insert( particles[3].grid.getMap() );
+    owners.insert( particles[25].grid.getMap() );
+
+    BOOST_CHECK_EQUAL( estimator.filter.shareMaps( 1.0, 1.0 ), 38u );
+    BOOST_CHECK( getParticleMaps( estimator.filter, estimator.env ) == owners );
+
+    // the maps are not cloned apart again by the resampling
+    for( int i = 0; i < 3; i++ )
+    {
+	estimator.update();
+	BOOST_REQUIRE_EQUAL( estimator.filter.getParticles().size(), 40u );
+	const std::set<envire::MLSMap*> maps( getParticleMaps( estimator.filter, estimator.env ) );
+	BOOST_CHECK( std::includes( owners.begin(), owners.end(), maps.begin(), maps.end() ) );
+    }
+
+    // neither by reducing the number of particles
+    estimator.filter.reduceParticles( 10 );
+    BOOST_REQUIRE_EQUAL( estimator.filter.getParticles().size(), 10u );
+    const std::set<envire::MLSMap*> maps( getParticleMaps( estimator.filter, estimator.env ) );
+    BOOST_CHECK( std::includes( owners.begin(), owners.end(), maps.begin(), maps.end() ) );
+
+    // particles which don't share their maps keep their own ones
+    TerrainEstimator separate( config, 40, false );
+    separate.filter.reduceParticles( 10 );
+    BOOST_REQUIRE_EQUAL( separate.filter.getParticles().size(), 10u );
+    BOOST_CHECK_EQUAL( getParticleMaps( separate.filter, separate.env ).size(), 10u );
+
+    // and the number of particles is never increased
+    separate.filter.reduceParticles( 20 );
+    BOOST_CHECK_EQUAL( separate.filter.getParticles().size(), 10u );
+}
+
+BOOST_AUTO_TEST_CASE( memory_budget )
+{
+    Eigen::Affine3d laser2body;
+    const base::samples::LaserScan scan = createLaserScan( laser2body );
+
+    // a budget which can't be met drops the debug data, shares the maps
+    // and reduces the particles down to the minimum, without leaking the
+    // maps of the removed particles
+    eslam::Configuration config;
+    config.particleCount = 50;
+    config.minEffective = 10;
+    config.logDebug = true;
+    config.memoryBudget = 1;
+    config.memoryCheckPeriod = 1;
+    odometry::Configuration odometryConfig;
+
+    envire::Environment env;
+    EmbodiedSlamFilter filter( odometryConfig, config );
+    filter.init( &env, base::Pose( Eigen::Affine3d::Identity() ), false );
+    BOOST_CHECK( filter.update( Eigen::Affine3d::Identity(), scan, laser2body ) );
+    BOOST_CHECK( filter.update( Eigen::Affine3d::Identity(), createContactState(), 
+		std::vector<terrain_estimator::TerrainClassification>() ) );
+
+    BOOST_CHECK_EQUAL( filter.getParticles().size(), 10u );
+    BOOST_CHECK_EQUAL( filter.getMemoryUsage().debugData, 0u );
+    std::set<envire::MLSMap*> maps;
+    for( size_t i = 0; i < filter.getParticles().size(); i++ )
+	maps.insert( filter.getParticles()[i].grid.getMap() );
+    BOOST_CHECK_EQUAL( env.getItems<envire::MLSMap>().size(), maps.size() );
+    BOOST_CHECK_LE( maps.size(), 10u );
+}
+
+BOOST_AUTO_TEST_CASE( random_state )
+{
+    eslam::Configuration config;
+    // resample on each update
+    config.minEffective = 1000;
+    config.islandCount = 2;
+    const base::Quaterniond orientation( base::Quaterniond::Identity() );
+
+    // both filters draw the same samples from their odometry
+    TerrainEstimator original( config, 50 );
+    TerrainEstimator restored( config, 50 );
+    for( int i = 0; i < 2; i++ )
+    {
+	TerrainEstimator &estimator( i ? restored : original );
+	estimator.filter.project( createContactState(), orientation );
+	estimator.update();
+    }
+
+    // a filter with the restored state continues with the same random
+    // numbers as the original one
+    std::stringstream ss;
+    original.filter.writeState( ss );
+    restored.filter.readState( ss );
+    restored.filter.setEnvironment( &restored.env, envire::MLSMap::Ptr( restored.map ), true );
+
+    for( int i = 0; i < 3; i++ )
+    {
+	original.filter.project( createContactState(), orientation );
+	original.update();
+	restored.filter.project( createContactState(), orientation );
+	restored.update();
+    }
+
+    const std::vector<PoseEstimator::Particle> &a( original.filter.getParticles() );
+    const std::vector<PoseEstimator::Particle> &b( restored.filter.getParticles() );
+    BOOST_REQUIRE_EQUAL( a.size(), b.size() );
+    for( size_t i = 0; i < a.size(); i++ )
+    {
+	BOOST_CHECK( a[i].position == b[i].position );
+	BOOST_CHECK_EQUAL( a[i].orientation, b[i].orientation );
+	BOOST_CHECK_CLOSE( a[i].weight, b[i].weight, 1e-9 );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( checkpoint_restore )
+{
+    Eigen::Affine3d laser2body;
+    const base::samples::LaserScan scan = createLaserScan( laser2body );
+
+    eslam::Configuration config;
+    config.particleCount = 20;
+    // resample on each update, so the particles have different maps
+    config.minEffective = 1000;
+    odometry::Configuration odometryConfig;
+    const std::vector<terrain_estimator::TerrainClassification> ltc;
+    const std::string path = createTempFile();
+
+    for( int async = 0; async < 2; async++ )
+    {
+	config.asyncMapping = async;
+	envire::Environment env;
+	EmbodiedSlamFilter filter( odometryConfig, config );
+	filter.init( &env, base::Pose( Eigen::Affine3d::Identity() ), false );
+	for( int i = 0; i < 5; i++ )
+	{
+	    const Eigen::Affine3d body2odometry( Eigen::Translation3d( 0.1 * i, 0, 0 ) );
+	    filter.update( body2odometry, scan, laser2body );
+	    filter.update( body2odometry, createContactState(), ltc );
+	}
+	filter.waitForMapping();
+
+	std::vector<PoseEstimator::Particle> particles;
+	for( size_t i = 0; i < filter.getParticles().size(); i++ )
+	    particles.push_back( PoseEstimator::Particle( filter.getParticles()[i].position, 
+			filter.getParticles()[i].orientation, filter.getParticles()[i].zPos, 
+			filter.getParticles()[i].zSigma, filter.getParticles()[i].floating ) );
+	std::set<envire::MLSMap*> maps;
+	for( size_t i = 0; i < filter.getParticles().size(); i++ )
+	    maps.insert( filter.getParticles()[i].grid.getMap() );
+	const size_t mapBytes = filter.getMemoryUsage().maps;
+	BOOST_CHECK_GT( mapBytes, 0u );
+
+	// the maps which are merged into while the checkpoint is written are
+	// saved as they were when it was started
+	filter.writeCheckpoint( path );
+	for( int i = 5; i < 10; i++ )
+	    BOOST_CHECK( filter.update( Eigen::Affine3d( Eigen::Translation3d( 0.1 * i, 0, 0 ) ), scan, laser2body ) );
+	filter.waitForMapping();
+	BOOST_REQUIRE( filter.waitForCheckpoint() );
+	BOOST_CHECK_GT( filter.getMemoryUsage().maps, mapBytes );
+
+	envire::Environment restoredEnv;
+	EmbodiedSlamFilter restored( odometryConfig, config );
+	restored.restoreCheckpoint( &restoredEnv, path );
+	BOOST_CHECK_EQUAL( restored.getMemoryUsage().maps, mapBytes );
+
+	const std::vector<PoseEstimator::Particle> &restoredParticles( restored.getParticles() );
+	BOOST_REQUIRE_EQUAL( restoredParticles.size(), particles.size() );
+	std::set<envire::MLSMap*> restoredMaps;
+	for( size_t i = 0; i < particles.size(); i++ )
+	{
+	    BOOST_CHECK( restoredParticles[i].position == particles[i].position );
+	    BOOST_CHECK_EQUAL( restoredParticles[i].orientation, particles[i].orientation );
+	    BOOST_CHECK_EQUAL( restoredParticles[i].zPos, particles[i].zPos );
+	    restoredMaps.insert( restoredParticles[i].grid.getMap() );
+	}
+	BOOST_CHECK_EQUAL( restoredMaps.size(), maps.size() );
+	BOOST_CHECK_EQUAL( restoredEnv.getItems<envire::MLSMap>().size(), maps.size() );
+    }
+
+    remove( path.c_str() );
+}
@@ -0,0 +1,359 @@
+#include "MapSim.hpp"
+
+#include <boost/cstdint.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/**
+ * Headless runner for the batch map experiment. The runs are independent, so
+ * they are distributed over all cores, each with its own environment and a
+ * seed of Config::seed + run index.
+ *
+ * After each run, the aggregated results are written to the result file, and
+ * the state of the aggregation to <result_file>.state. If the state file
+ * exists on startup, the runs it contains are skipped, so an interrupted
+ * sweep can be continued by starting the runner again with the same
+ * configuration.
+ */
+
+namespace
+{
+
+/**
+ * Running sums of a value. Unlike numeric::Stats, these can be written to
+ * disk and merged, which is needed for resuming a sweep.
+ */
+struct Accumulator
+{
+    Accumulator()
+	: n( 0 ), sum( 0 ), sumSq( 0 ),
+	min( std::numeric_limits<double>::infinity() ),
+	max( -std::numeric_limits<double>::infinity() ) {}
+
+    double n, sum, sumSq, min, max;
+
+    void update( double x )
+    {
+	n += 1;
+	sum += x;
+	sumSq += x * x;
+	min = std::min( min, x );
+	max = std::max( max, x );
+    }
+
+    double mean() const
+    {
+	return n > 0 ? sum / n : 0.0;
+    }
+
+    double stdev() const
+    {
+	if( n < 2 )
+	    return 0.0;
+	return sqrt( std::max( 0.0, (sumSq - sum * sum / n) / (n - 1) ) );
+    }
+};
+
+/**
+ * Histogram with fixed bins. Values outside of the range are counted in the
+ * first and last bin.
+ */
+struct Histogram
+{
+    Histogram( size_t size, double min, double max )
+	: min( min ), max( max ), bins( size, 0.0 ) {}
+
+    double min, max;
+    std::vector<double> bins;
+
+    void update( double x )
+    {
+	const double width = (max - min) / bins.size();
+	const int idx = static_cast<int>( floor( (x - min) / width ) );
+	bins[ std::min( std::max( idx, 0 ), static_cast<int>( bins.size() ) - 1 ) ] += 1;
+    }
+
+    double getCenter( size_t i ) const
+    {
+	return min + (i + 0.5) * (max - min) / bins.size();
+    }
+};
+
+/** results of a single run for each step */
+struct RunResult
+{
+    std::vector<double> height, forward, zVar, mapZ, mapStdev;
+    std::vector<char> hasMap;
+};
+
+template <class T>
+void writeValue( std::ostream& os, const T& value )
+{
+    os.write( reinterpret_cast<const char*>( &value ), sizeof( T ) );
+}
+
+template <class T>
+void readValue( std::istream& is, T& value )
+{
+    is.read( reinterpret_cast<char*>( &value ), sizeof( T ) );
+    if( !is )
+	throw std::runtime_error( "the state file is truncated." );
+}
+
+template <class T>
+void writeVector( std::ostream& os, const std::vector<T>& values )
+{
+    if( !values.empty() )
+	os.write( reinterpret_cast<const char*>( &values[0] ), values.size() * sizeof( T ) );
+}
+
+template <class T>
+void readVector( std::istream& is, std::vector<T>& values )
+{
+    if( !values.empty() )
+    {
+	is.read( reinterpret_cast<char*>( &values[0] ), values.size() * sizeof( T ) );
+	if( !is )
+	    throw std::runtime_error( "the state file is truncated." );
+    }
+}
+
+/**
+ * The aggregated results over all finished runs.
+ */
+struct Aggregate
+{
+    Aggregate( const Config& conf )
+	: maxSteps( conf.max_steps ), maxRuns( conf.max_runs ), seed( conf.seed ),
+	runs( 0 ),
+	done( conf.max_runs, 0 ),
+	height( conf.max_steps ), mapZ( conf.max_steps ),
+	forward( conf.max_steps, 0.0 ), zVar( conf.max_steps, 0.0 ), mapStdev( conf.max_steps, 0.0 ),
+	finalHeight( 100, -0.1, 0.1 ) {}
+
+    boost::uint64_t maxSteps, maxRuns, seed;
+    boost::uint64_t runs;
+    std::vector<char> done;
+
+    std::vector<Accumulator> height, mapZ;
+    std::vector<double> forward, zVar, mapStdev;
+    /** error of the height estimate at the last step of each run */
+    Histogram finalHeight;
+
+    void add( size_t run, const RunResult& r )
+    {
+	for( size_t i = 0; i < maxSteps; i++ )
+	{
+	    height[i].update( r.height[i] );
+	    forward[i] = r.forward[i];
+	    zVar[i] = r.zVar[i];
+	    if( r.hasMap[i] )
+	    {
+		mapZ[i].update( r.mapZ[i] );
+		mapStdev[i] = r.mapStdev[i];
+	    }
+	}
+	if( maxSteps > 0 )
+	    finalHeight.update( r.height.back() );
+
+	done[run] = 1;
+	runs++;
+    }
+
+    void save( const std::string& path ) const
+    {
+	const std::string tmp = path + ".tmp";
+	{
+	    std::ofstream os( tmp.c_str(), std::ios::binary );
+	    writeValue( os, maxSteps );
+	    writeValue( os, maxRuns );
+	    writeValue( os, seed );
+	    writeValue( os, runs );
+	    writeVector( os, done );
+	    writeVector( os, height );
+	    writeVector( os, mapZ );
+	    writeVector( os, forward );
+	    writeVector( os, zVar );
+	    writeVector( os, mapStdev );
+	    writeVector( os, finalHeight.bins );
+	    if( !os )
+		throw std::runtime_error( "could not write " + tmp );
+	}
+	if( rename( tmp.c_str(), path.c_str() ) != 0 )
+	    throw std::runtime_error( "could not write " + path );
+    }
+
+    /**
+     * restore the state from the given file.
+     * @result false if there is no state file
+     */
+    bool load( const std::string& path )
+    {
+	std::ifstream is( path.c_str(), std::ios::binary );
+	if( !is )
+	    return false;
+
+	boost::uint64_t steps, maxRuns;
+	readValue( is, steps );
+	readValue( is, maxRuns );
+	if( steps != maxSteps || maxRuns != this->maxRuns )
+	    throw std::runtime_error( path + " was written with a different number of steps or runs." );
+
+	readValue( is, seed );
+	readValue( is, runs );
+	readVector( is, done );
+	readVector( is, height );
+	readVector( is, mapZ );
+	readVector( is, forward );
+	readVector( is, zVar );
+	readVector( is, mapStdev );
+	readVector( is, finalHeight.bins );
+	return true;
+    }
+
+    /** write the results in the format of the batch mode of testMap */
+    void writeTable( const std::string& path ) const
+    {
+	const std::string tmp = path + ".tmp";
+	{
+	    std::ofstream out( tmp.c_str() );
+	    for( size_t i = 0; i < maxSteps; i++ )
+	    {
+		out
+		    << i << " "
+		    << forward[i] << " "
+		    << height[i].mean() << " "
+		    << height[i].stdev() << " "
+		    << sqrt(zVar[i]) << " "
+		    << mapZ[i].mean() << " "
+		    << mapZ[i].stdev() << " "
+		    << mapStdev[i] << " "
+		    << height[i].min << " "
+		    << height[i].max << " "
+		    << std::endl;
+	    }
+	}
+	rename( tmp.c_str(), path.c_str() );
+
+	std::ofstream hist( (path + ".hist").c_str() );
+	for( size_t i = 0; i < finalHeight.bins.size(); i++ )
+	    hist << finalHeight.getCenter( i ) << " " << finalHeight.bins[i] / std::max<double>( runs, 1 ) << std::endl;
+    }
+};
+
+RunResult simulate( const Config& conf, unsigned long seed )
+{
+    MapTest mt;
+    mt.conf = conf;
+    mt.seed( seed );
+
+    // each run uses its own environment, but envire does not guarantee
+    // that creating and deleting items is thread-safe, so these are done
+    // one run at a time
+#pragma omp critical(envire)
+    {
+	mt.env = new envire::Environment();
+	mt.init();
+    }
+
+    RunResult r;
+    r.height.resize( conf.max_steps );
+    r.forward.resize( conf.max_steps );
+    r.zVar.resize( conf.max_steps );
+    r.mapZ.resize( conf.max_steps );
+    r.mapStdev.resize( conf.max_steps );
+    r.hasMap.resize( conf.max_steps, 0 );
+
+    for( size_t i=0; i<conf.max_steps; i++ )
+    {
+	mt.step( i );
+
+	r.height[i] = mt.z_pos - mt.sim.body2world.translation().z();
+	r.forward[i] = mt.sim.body2world.translation().y();
+	r.zVar[i] = mt.z_var;
+
+	// get map height
+	envire::MLSGrid::Position p;
+	if( mt.grid->toGrid( (mt.sim.body2world.translation()).head<2>(), p ) )
+	{
+	    envire::MLSGrid::iterator it = mt.grid->beginCell( p.x, p.y );
+	    if( it != mt.grid->endCell() )
+	    {
+		r.mapZ[i] = it->mean;
+		r.mapStdev[i] = it->stdev;
+		r.hasMap[i] = 1;
+	    }
+	}
+    }
+
+#pragma omp critical(envire)
+    delete mt.env;
+
+    return r;
+}
+
+}
+
+int main( int argc, char **argv )
+{
+    if( argc < 2 )
+    {
+	std::cerr << "usage: testMapRunner <conf_file> [restart]" << std::endl;
+	return 1;
+    }
+
+    Config conf;
+    conf.set( argv[1] );
+    const bool restart = argc >= 3 && std::string( argv[2] ) == "restart";
+
+#ifdef _OPENMP
+    if( conf.threads > 0 )
+	omp_set_num_threads( conf.threads );
+#endif
+
+    const std::string statePath = conf.result_file + ".state";
+    Aggregate agg( conf );
+    if( !restart && agg.load( statePath ) )
+	std::cerr << "resuming with " << agg.runs << " of " << conf.max_runs << " runs done" << std::endl;
+
+    // the seed is taken from the state file, so resumed runs continue with
+    // the same seed sequence
+    const unsigned long seed = agg.seed;
+
+#pragma omp parallel for schedule(dynamic)
+    for( int run = 0; run < static_cast<int>( conf.max_runs ); run++ )
+    {
+	if( agg.done[run] )
+	    continue;
+
+	RunResult r = simulate( conf, seed + run );
+
+#pragma omp critical(aggregate)
+	{
+	    agg.add( run, r );
+	    // exceptions must not leave the parallel region
+	    try
+	    {
+		agg.save( statePath );
+		agg.writeTable( conf.result_file );
+	    }
+	    catch( const std::exception& e )
+	    {
+		std::cerr << e.what() << std::endl;
+	    }
+	    std::cerr << "run " << agg.runs << " of " << conf.max_runs << "     \r";
+	}
+    }
+
+    std::cerr << std::endl;
+    return 0;
+}
@@ -0,0 +1,224 @@
+#ifndef __VIZKIT_PARTICLEGEOMETRY_HPP__
+#define __VIZKIT_PARTICLEGEOMETRY_HPP__
+
+#include <eslam/PoseParticle.hpp>
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <boost/math/special_functions/fpclassify.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace vizkit3d
+{
+
+/**
+ * Pose and appearance of the glyph that represents a single particle.
+ */
+struct ParticleGlyph
+{
+    enum Style
+    {
+	NORMAL = 0,
+	FLOATING = 1,
+	INSPECTED = 2,
+	STYLE_COUNT = 3
+    };
+
+    Eigen::Vector3f position;
+    float heading;
+    /** height of the glyph, proportional to the weight */
+    float height;
+    Style style;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/**
+ * Builds the geometry of the particle visualization from a
+ * PoseDistribution, without depending on OSG.
+ *
+ * setData() keeps a flat copy of the parts of the distribution that are
+ * drawn. build() then creates a glyph per particle and the vertex arrays for
+ * the contact and slip points. All vectors are reused between updates, so
+ * they only allocate when the data grows.
+ *
+ * The contact and slip points of the inspected particle are always drawn.
+ * If enabled, the points of all other particles are drawn as well, but
+ * decimated to at most maxPoints, by taking only every n-th point.
+ */
+class ParticleGeometry
+{
+public:
+    typedef std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f> > Vertices;
+    typedef std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > Colors;
+
+    struct Gaussian
+    {
+	Eigen::Vector2d mean;
+	Eigen::Matrix2d cov;
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    typedef std::vector<Gaussian, Eigen::aligned_allocator<Gaussian> > Gaussians;
+
+    void setData( const eslam::PoseDistribution& dist )
+    {
+	const std::vector<eslam::PoseParticle> &v( dist.particles );
+
+	particles.resize( v.size() );
+	contactOffset.resize( v.size() + 1 );
+	slipOffset.resize( v.size() + 1 );
+	contacts.clear();
+	slips.clear();
+
+	for( size_t i = 0; i < v.size(); i++ )
+	{
+	    State &s( particles[i] );
+	    s.position = Eigen::Vector3f( v[i].position.x(), v[i].position.y(), v[i].zPos );
+	    s.heading = v[i].orientation;
+	    s.weight = v[i].weight;
+	    s.floating = v[i].floating;
+
+	    contactOffset[i] = contacts.size();
+	    contacts.insert( contacts.end(), v[i].cpoints.begin(), v[i].cpoints.end() );
+	    slipOffset[i] = slips.size();
+	    slips.insert( slips.end(), v[i].spoints.begin(), v[i].spoints.end() );
+	}
+	contactOffset.back() = contacts.size();
+	slipOffset.back() = slips.size();
+
+	gaussians.resize( dist.gmm.params.size() );
+	for( size_t i = 0; i < gaussians.size(); i++ )
+	{
+	    gaussians[i].mean = dist.gmm.params[i].dist.mean;
+	    gaussians[i].cov = dist.gmm.params[i].dist.cov;
+	}
+    }
+
+    /**
+     * build the glyphs and vertex arrays.
+     *
+     * @param inspected - index of the inspected particle, or -1
+     * @param showContacts - draw the points of all particles
+     * @param maxPoints - maximum number of contact and slip points each, that
+     *                    are drawn for the particles which are not inspected
+     */
+    void build( int inspected, bool showContacts, size_t maxPoints )
+    {
+	const size_t count = particles.size();
+	glyphs.resize( count );
+	for( size_t i = 0; i < count; i++ )
+	{
+	    const State &s( particles[i] );
+	    ParticleGlyph &g( glyphs[i] );
+	    g.position = s.position;
+	    g.heading = s.heading;
+	    g.height = 0.2 * s.weight * count;
+	    g.style = s.floating ? ParticleGlyph::FLOATING : ParticleGlyph::NORMAL;
+	}
+	if( inspected >= 0 && static_cast<size_t>( inspected ) < count )
+	    glyphs[inspected].style = ParticleGlyph::INSPECTED;
+
+	pointVertices.clear();
+	pointColors.clear();
+	lineVertices.clear();
+	lineColors.clear();
+
+	// ranges of the contact and slip points of the inspected particle
+	size_t cb = 0, ce = 0, sb = 0, se = 0;
+	if( inspected >= 0 && static_cast<size_t>( inspected ) < count )
+	{
+	    cb = contactOffset[inspected];
+	    ce = contactOffset[inspected + 1];
+	    sb = slipOffset[inspected];
+	    se = slipOffset[inspected + 1];
+	    addContacts( cb, ce, 1 );
+	    addSlips( sb, se, 1 );
+	}
+
+	if( showContacts && maxPoints > 0 )
+	{
+	    const size_t cstride = getStride( contacts.size(), maxPoints );
+	    addContacts( 0, cb, cstride );
+	    addContacts( ce, contacts.size(), cstride );
+
+	    const size_t sstride = getStride( slips.size(), maxPoints );
+	    addSlips( 0, sb, sstride );
+	    addSlips( se, slips.size(), sstride );
+	}
+    }
+
+    const std::vector<ParticleGlyph>& getGlyphs() const { return glyphs; }
+    const Vertices& getPointVertices() const { return pointVertices; }
+    const Colors& getPointColors() const { return pointColors; }
+    /** pairs of vertices, one per line */
+    const Vertices& getLineVertices() const { return lineVertices; }
+    const Colors& getLineColors() const { return lineColors; }
+    const Gaussians& getGaussians() const { return gaussians; }
+
+    static size_t getStride( size_t total, size_t maxPoints )
+    {
+	return std::max<size_t>( 1, (total + maxPoints - 1) / maxPoints );
+    }
+
+private:
+    struct State
+    {
+	Eigen::Vector3f position;
+	float heading;
+	float weight;
+	bool floating;
+    };
+
+    void addLine( const Eigen::Vector3f& p, float height, const Eigen::Vector4f& color )
+    {
+	if( !boost::math::isfinite( height ) )
+	    return;
+	lineVertices.push_back( p );
+	lineVertices.push_back( p + Eigen::Vector3f( 0, 0, height ) );
+	lineColors.push_back( color );
+	lineColors.push_back( color );
+    }
+
+    void addContacts( size_t begin, size_t end, size_t stride )
+    {
+	for( size_t i = begin; i < end; i += stride )
+	{
+	    const eslam::ContactPoint &cp( contacts[i] );
+	    const Eigen::Vector3f p = cp.point.cast<float>();
+	    pointVertices.push_back( p );
+	    pointColors.push_back( Eigen::Vector4f( 0.0f, 1.0f, 1.0f, 1.0f ) );
+	    addLine( p, cp.zdiff, Eigen::Vector4f( 1.0f, 1.0f, 0.0f, 1.0f ) );
+	}
+    }
+
+    void addSlips( size_t begin, size_t end, size_t stride )
+    {
+	for( size_t i = begin; i < end; i += stride )
+	{
+	    const eslam::SlipPoint &sp( slips[i] );
+	    const Eigen::Vector3f p = sp.position.cast<float>();
+	    pointVertices.push_back( p );
+	    pointColors.push_back( Eigen::Vector4f( sp.color.x(), sp.color.y(), sp.color.z(), 1.0f ) );
+	    addLine( p, sp.prob, Eigen::Vector4f( 1.0f, 1.0f, 0.0f, 1.0f ) );
+	}
+    }
+
+    std::vector<State> particles;
+    /** contacts[contactOffset[i]..contactOffset[i+1]] belong to particle i */
+    std::vector<size_t> contactOffset, slipOffset;
+    std::vector<eslam::ContactPoint> contacts;
+    std::vector<eslam::SlipPoint> slips;
+    Gaussians gaussians;
+
+    std::vector<ParticleGlyph> glyphs;
+    Vertices pointVertices, lineVertices;
+    Colors pointColors, lineColors;
+};
+
+}
+
+#endif
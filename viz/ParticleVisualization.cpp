@@ -18,6 +18,10 @@
 
 #include <vizkit3d/Uncertainty.hpp>
 
+#include <osg/NodeCallback>
+#include <osg/NodeVisitor>
+#include <osg/FrameStamp>
+
 namespace vizkit3d 
 {
 
@@ -36,6 +40,26 @@ public:
 };
 
 
+/** 
+ * triggers the redraw of the particles with a limited rate, independent of
+ * the arrival of new data
+ */
+class FrameRateCallback : public osg::NodeCallback
+{
+    ParticleVisualization *viz;
+
+public:
+    FrameRateCallback( ParticleVisualization *viz )
+	: viz( viz ) {}
+
+    virtual void operator()( osg::Node* node, osg::NodeVisitor* nv )
+    {
+	if( nv->getFrameStamp() )
+	    viz->frameUpdate( nv->getFrameStamp()->getReferenceTime() );
+	traverse( node, nv );
+    }
+};
+
 osg::Geode* getParticleGeode( const osg::Vec4& color )
 {
     const double diam = 0.01;
@@ -66,145 +90,189 @@ int ParticleVisualization::getInspectedParticle() const
     return inspectIdx;
 }
 
-ParticleVisualization::ParticleVisualization()
-    : show_gmm(false), viscontacts(false), inspectIdx(-1)
+void ParticleVisualization::setVisualiseContacts( bool viscontacts )
 {
-    //particleGeode = getParticleGeode();
+    this->viscontacts = viscontacts;
+    setDirty();
+}
+
+static osg::Geometry* createPointGeometry( osg::Vec3Array* vertices, osg::Vec4Array* colors, osg::DrawArrays* primitives )
+{
+    osg::Geometry *geom = new osg::Geometry();
+    geom->setVertexArray( vertices );
+    geom->setColorArray( colors );
+    geom->setColorBinding( osg::Geometry::BIND_PER_VERTEX );
+    geom->addPrimitiveSet( primitives );
+    // the arrays are modified in place, so use vertex buffer objects
+    // instead of display lists
+    geom->setUseDisplayList( false );
+    geom->setUseVertexBufferObjects( true );
+    geom->setDataVariance( osg::Object::DYNAMIC );
+    return geom;
+}
 
+ParticleVisualization::ParticleVisualization()
+    : show_gmm(false), viscontacts(false), maxFrameRate(10.0), maxContactPoints(2000),
+    pending(false), lastFrame(0), inspectIdx(-1)
+{
     ownNode = new osg::Group();
     setMainNode( ownNode );
 
     osg::PositionAttitudeTransform* tn =
 	new osg::PositionAttitudeTransform();
     ownNode->asGroup()->addChild( tn );
+    tn->setUpdateCallback( new FrameRateCallback( this ) );
 
     offsetNode = new osg::Group();
     tn->addChild( offsetNode );
+
+    // the glyphs of the particles share the same geometry, and only differ
+    // in their transform
+    glyphGeodes[ParticleGlyph::NORMAL] = getParticleGeode( osg::Vec4( .8f, .8f, .8f, 1.0f ) );
+    glyphGeodes[ParticleGlyph::FLOATING] = getParticleGeode( osg::Vec4( .9f, .3f, .3f, 1.0f ) );
+    glyphGeodes[ParticleGlyph::INSPECTED] = getParticleGeode( osg::Vec4( .3f, .8f, .9f, 1.0f ) );
+
+    particleGroup = new osg::Group();
+    offsetNode->asGroup()->addChild( particleGroup );
+
+    pointVertices = new osg::Vec3Array();
+    pointColors = new osg::Vec4Array();
+    pointPrimitives = new osg::DrawArrays( osg::PrimitiveSet::POINTS, 0, 0 );
+    pointGeometry = createPointGeometry( pointVertices, pointColors, pointPrimitives );
+    pointGeometry->getOrCreateStateSet()->setAttribute( new osg::Point( 6.0f ), osg::StateAttribute::ON );
+
+    lineVertices = new osg::Vec3Array();
+    lineColors = new osg::Vec4Array();
+    linePrimitives = new osg::DrawArrays( osg::PrimitiveSet::LINES, 0, 0 );
+    lineGeometry = createPointGeometry( lineVertices, lineColors, linePrimitives );
+    lineGeometry->getOrCreateStateSet()->setAttribute( new osg::LineWidth( 2.0f ), osg::StateAttribute::ON );
+
+    pointGeode = new osg::Geode();
+    pointGeode->addDrawable( pointGeometry );
+    pointGeode->addDrawable( lineGeometry );
+    pointGeode->getOrCreateStateSet()->setMode( GL_LIGHTING, osg::StateAttribute::OFF );
+    offsetNode->asGroup()->addChild( pointGeode );
+
+    gmmGroup = new osg::Group();
+    offsetNode->asGroup()->addChild( gmmGroup );
 }
 
-void ParticleVisualization::operatorIntern ( osg::Node* node, osg::NodeVisitor* nv )
-{   
-    offsetNode->asGroup()->removeChildren(0, offsetNode->asGroup()->getNumChildren());
-
-    /*
-       if( showCentroid )
-       {
-       osg::PositionAttitudeTransform* tn =
-       new osg::PositionAttitudeTransform();
-       ownNode->asGroup()->addChild( tn );
-       }
-       */
-
-    if( show_gmm )
+void ParticleVisualization::frameUpdate( double time )
+{
+    boost::mutex::scoped_lock lock( pendingMutex );
+    if( pending && (maxFrameRate <= 0 || time - lastFrame >= 1.0 / maxFrameRate) )
     {
-	// take the gaussian mixture model and display the uncertainty ellipses
-	eslam::PoseDistribution::GMM &gmm( dist.gmm );
-	for( size_t i=0; i<gmm.params.size(); i++ )
-	{
-	    vizkit3d::Uncertainty *u = new vizkit3d::Uncertainty();
-	    u->setMean( static_cast<Eigen::Vector2d>( gmm.params[i].dist.mean ) );
-	    u->setCovariance( static_cast<Eigen::Matrix2d>( gmm.params[i].dist.cov ) );
-	    offsetNode->asGroup()->addChild( u );
-	}
+	pending = false;
+	lastFrame = time;
+	setDirty();
     }
+}
+
+void ParticleVisualization::operatorIntern ( osg::Node* node, osg::NodeVisitor* nv )
+{   
+    geometry.build( inspectIdx, viscontacts, maxContactPoints > 0 ? maxContactPoints : 0 );
 
-    std::vector<eslam::PoseParticle> &v(dist.particles);
+    updateParticles();
+    updatePoints();
+    updateGMM();
+}
+
+void ParticleVisualization::updateParticles()
+{
+    const std::vector<ParticleGlyph> &glyphs( geometry.getGlyphs() );
 
-    for(size_t i=0;i<v.size();i++)
+    // the transforms are kept, so they only need to be created when the
+    // number of particles grows
+    while( particleNodes.size() < glyphs.size() )
     {
+	const size_t i = particleNodes.size();
 	osg::PositionAttitudeTransform* tn =
 	    new osg::PositionAttitudeTransform();
-
-	const double trans = 1.0;
-	//const double fade = v[i].w * v.size();
-
-	osg::Vec4 color = v[i].floating ?
-	    osg::Vec4( .9f, .3f, .3f, trans ) :
-	    osg::Vec4( .8f, .8f, .8f, trans );
-
-	if( inspectIdx >= 0 && static_cast<size_t>(inspectIdx) == i )
-	    color = osg::Vec4( .3f, .8f, .9f, trans );
-
-	const double height = 0.2*v[i].weight*v.size();
-
-	tn->setPosition(osg::Vec3( v[i].position.x(), v[i].position.y(), v[i].zPos ));
-	tn->setScale(osg::Vec3(1.0,1.0,height));
-	osg::Quat q;
-	q.makeRotate(v[i].orientation,0,0,1.0);
-	tn->setAttitude(q);
-	osg::Node *pnode = getParticleGeode( color );
-	pnode->setUserData( 
+	tn->setUserData( 
 		new ParticlePickedCallback( 
 		    boost::bind( &ParticleVisualization::inspectParticle, this, i ) ) );
-	tn->addChild( pnode );
-	offsetNode->asGroup()->addChild( tn );
+	tn->addChild( glyphGeodes[ParticleGlyph::NORMAL] );
+	particleNodes.push_back( tn );
+	particleStyles.push_back( ParticleGlyph::NORMAL );
     }
 
-    if( inspectIdx >= 0 )
-    {
-	const size_t i = inspectIdx;
-	eslam::PoseParticle &pose( v[i] );
+    const size_t children = particleGroup->getNumChildren();
+    if( children > glyphs.size() )
+	particleGroup->removeChildren( glyphs.size(), children - glyphs.size() );
+    for( size_t i = children; i < glyphs.size(); i++ )
+	particleGroup->addChild( particleNodes[i] );
 
-	Eigen::Affine3d t = 
-	    Eigen::Translation3d( pose.meas_pos ) 
-	    * Eigen::AngleAxisd( pose.meas_theta, Eigen::Vector3d::UnitZ() );
+    for( size_t i = 0; i < glyphs.size(); i++ )
+    {
+	const ParticleGlyph &g( glyphs[i] );
+	osg::PositionAttitudeTransform *tn = particleNodes[i];
 
-	Eigen::Affine3d transform( t * base::removeYaw( dist.orientation ) );
+	tn->setPosition( osg::Vec3( g.position.x(), g.position.y(), g.position.z() ) );
+	tn->setScale( osg::Vec3( 1.0, 1.0, g.height ) );
+	osg::Quat q;
+	q.makeRotate( g.heading, 0, 0, 1.0 );
+	tn->setAttitude( q );
 
-	for(size_t j=0;j<pose.cpoints.size();j++)
+	if( particleStyles[i] != g.style )
 	{
-	    const eslam::ContactPoint &cp(pose.cpoints[j]);
-	    const double radius = 0.01;
-	    const double height = cp.zdiff;
-	    const osg::Vec3 pos( cp.point.x(), cp.point.y(), cp.point.z() ); 
-
-	    osg::Geode* geode = new osg::Geode;
-
-	    osg::Cylinder* cylinderShape = new osg::Cylinder( pos+osg::Vec3(0,0,height*.5), radius*.5, height );
-	    osg::ShapeDrawable *cylinder = new osg::ShapeDrawable(cylinderShape);
-
-	    osg::Sphere* sphereShape = new osg::Sphere( pos, radius );
-	    osg::ShapeDrawable *sphere = new osg::ShapeDrawable( sphereShape ); 
-
-	    cylinder->setColor( osg::Vec4(1.0f, 1.0f, 0.0f, 1.0f) );
-	    sphere->setColor( osg::Vec4(0.0f, 1.0f, 1.0f, 1.0f) );
-	    geode->addDrawable( cylinder );
-	    geode->addDrawable( sphere );
-
-	    offsetNode->asGroup()->addChild( geode );
-
+	    tn->replaceChild( glyphGeodes[particleStyles[i]], glyphGeodes[g.style] );
+	    particleStyles[i] = g.style;
 	}
+    }
+}
 
-	for(size_t j=0;j<pose.spoints.size();j++)
-	{
-	    const eslam::SlipPoint &cp(pose.spoints[j]);
-	    const double radius = 0.05;
-	    const double height = cp.prob;
-	    const osg::Vec3 pos( cp.position.x(), cp.position.y(), cp.position.z() ); 
-
-	    osg::Geode* geode = new osg::Geode;
-
-	    osg::Sphere* sphereShape = new osg::Sphere( pos, radius );
-	    osg::ShapeDrawable *sphere = new osg::ShapeDrawable( sphereShape ); 
+template <class A, class V>
+static void copyArray( A* array, const V& values )
+{
+    array->resize( values.size() );
+    for( size_t i = 0; i < values.size(); i++ )
+	for( size_t j = 0; j < static_cast<size_t>( values[i].size() ); j++ )
+	    (*array)[i][j] = values[i][j];
+    array->dirty();
+}
 
-	    sphere->setColor( osg::Vec4(cp.color.x(), cp.color.y(), cp.color.z(), 1.0 ) );
-	    geode->addDrawable( sphere );
+void ParticleVisualization::updatePoints()
+{
+    copyArray( pointVertices.get(), geometry.getPointVertices() );
+    copyArray( pointColors.get(), geometry.getPointColors() );
+    pointPrimitives->setCount( pointVertices->size() );
+    pointPrimitives->dirty();
+    pointGeometry->dirtyBound();
+
+    copyArray( lineVertices.get(), geometry.getLineVertices() );
+    copyArray( lineColors.get(), geometry.getLineColors() );
+    linePrimitives->setCount( lineVertices->size() );
+    linePrimitives->dirty();
+    lineGeometry->dirtyBound();
+}
 
-	    osg::Cylinder* cylinderShape = new osg::Cylinder( pos+osg::Vec3(0,0,height*.5), radius*.5, height );
-	    osg::ShapeDrawable *cylinder = new osg::ShapeDrawable(cylinderShape);
+void ParticleVisualization::updateGMM()
+{
+    // take the gaussian mixture model and display the uncertainty ellipses
+    const ParticleGeometry::Gaussians &gaussians( geometry.getGaussians() );
+    const size_t count = show_gmm ? gaussians.size() : 0;
 
-	    cylinder->setColor( osg::Vec4(1.0f, 1.0f, 0.0f, 1.0f) );
-	    geode->addDrawable( cylinder );
+    const size_t children = gmmGroup->getNumChildren();
+    if( children > count )
+	gmmGroup->removeChildren( count, children - count );
+    for( size_t i = children; i < count; i++ )
+	gmmGroup->addChild( new vizkit3d::Uncertainty() );
 
-	    offsetNode->asGroup()->addChild( geode );
-	}
+    for( size_t i = 0; i < count; i++ )
+    {
+	vizkit3d::Uncertainty *u = static_cast<vizkit3d::Uncertainty*>( gmmGroup->getChild( i ) );
+	u->setMean( gaussians[i].mean );
+	u->setCovariance( gaussians[i].cov );
     }
 }
 
 void ParticleVisualization::updateDataIntern ( const eslam::PoseDistribution& dist )
 {
-    this->dist = dist;
-    setDirty();
+    geometry.setData( dist );
+
+    // the redraw is triggered by frameUpdate
+    boost::mutex::scoped_lock lock( pendingMutex );
+    pending = true;
 }
 
 void ParticleVisualization::updatePoseDistribution( const eslam::PoseDistribution& data )
@@ -215,4 +283,3 @@ void ParticleVisualization::updatePoseDistribution( const eslam::PoseDistributio
 //VizkitQtPlugin( ParticleVisualization )
 
 }
-
@@ -8,8 +8,13 @@
 #include <base/Pose.hpp>
 #include <eslam/PoseParticle.hpp>
 #include <osg/Geode>
+#include <osg/PositionAttitudeTransform>
 
-namespace vizkit3d 
+#include <boost/thread/mutex.hpp>
+
+#include "ParticleGeometry.hpp"
+
+namespace vizkit3d
 {
 
 class ParticleVisualization : public VizPluginAdapter<eslam::PoseDistribution>
@@ -21,33 +26,71 @@ class ParticleVisualization : public VizPluginAdapter<eslam::PoseDistribution>
 	ParticleVisualization();
 
 	void setVisualiseContacts(bool viscontacts);
-	int getInspectedParticle() const; 
+	int getInspectedParticle() const;
 
 	Q_INVOKABLE void updatePoseDistribution( const eslam::PoseDistribution& data );
 	Q_PROPERTY( bool show_gmm READ getShowGMM WRITE setShowGMM )
-    
+	Q_PROPERTY( double max_frame_rate READ getMaxFrameRate WRITE setMaxFrameRate )
+	Q_PROPERTY( int max_contact_points READ getMaxContactPoints WRITE setMaxContactPoints )
+
+	/** called once per frame by the update traversal */
+	void frameUpdate( double time );
+
     public slots:
 	bool getShowGMM() const { return show_gmm; }
 	void setShowGMM( bool show ) { show_gmm = show; emit propertyChanged("show_gmm"); }
+	/** maximum rate in Hz at which new data is displayed. 0 displays
+	 * new data with every frame. */
+	double getMaxFrameRate() const { return maxFrameRate; }
+	void setMaxFrameRate( double rate ) { maxFrameRate = rate; emit propertyChanged("max_frame_rate"); }
+	/** maximum number of contact and slip points that are shown for the
+	 * particles which are not inspected */
+	int getMaxContactPoints() const { return maxContactPoints; }
+	void setMaxContactPoints( int count ) { maxContactPoints = count; setDirty(); emit propertyChanged("max_contact_points"); }
 	void inspectParticle(int index);
 
     signals:
 	void inspectParticleUpdate(int index);
-	    
+
     private:
 	bool show_gmm;
 	bool viscontacts;
+	double maxFrameRate;
+	int maxContactPoints;
 
 	virtual void updateDataIntern ( const eslam::PoseDistribution& data );
 	virtual void operatorIntern ( osg::Node* node, osg::NodeVisitor* nv );
 
-	eslam::PoseDistribution dist;
+	void updateParticles();
+	void updatePoints();
+	void updateGMM();
+
+	ParticleGeometry geometry;
+
+	/** set if there is data which has not been displayed yet */
+	bool pending;
+	double lastFrame;
+	boost::mutex pendingMutex;
 
-	osg::ref_ptr<osg::Geode> particleGeode;
 	osg::ref_ptr<osg::Node> offsetNode;
 
+	/** particle glyphs, one shared geode for each style */
+	osg::ref_ptr<osg::Group> particleGroup;
+	osg::ref_ptr<osg::Geode> glyphGeodes[ParticleGlyph::STYLE_COUNT];
+	std::vector<osg::ref_ptr<osg::PositionAttitudeTransform> > particleNodes;
+	std::vector<int> particleStyles;
+
+	/** contact and slip points */
+	osg::ref_ptr<osg::Geode> pointGeode;
+	osg::ref_ptr<osg::Geometry> pointGeometry, lineGeometry;
+	osg::ref_ptr<osg::Vec3Array> pointVertices, lineVertices;
+	osg::ref_ptr<osg::Vec4Array> pointColors, lineColors;
+	osg::ref_ptr<osg::DrawArrays> pointPrimitives, linePrimitives;
+
+	osg::ref_ptr<osg::Group> gmmGroup;
+
 	int inspectIdx;
 };
 
 }
-#endif 
+#endif